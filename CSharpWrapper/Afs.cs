@@ -1,6 +1,7 @@
 using System;
 using System.IO;
 using System.Runtime.InteropServices;
+using System.Text;
 
 namespace Afster
 {
@@ -47,7 +48,7 @@ namespace Afster
         public delegate uint DelegateAfsGetEntrycount(IntPtr afs);
 
         [UnmanagedFunctionPointer(CallingConvention.Cdecl, CharSet = CharSet.Ansi)]
-        public delegate IntPtr DelegateAfsExtractEntryToFile(IntPtr afs, int id, string output_folderpath);
+        public delegate int DelegateAfsExtractEntryToFile(IntPtr afs, int id, string output_folderpath, StringBuilder filepath);
 
         [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
         public delegate IntPtr DelegateAfsExtractEntryToBuffer(IntPtr afs, int id);
@@ -59,7 +60,7 @@ namespace Afster
         public delegate int DelegateAfsExtractFull(IntPtr afs, string output_folderpath);
 
         [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
-        public delegate int DelegateAfsReplaceEntry(IntPtr afs, int id, IntPtr data, int data_size);
+        public delegate int DelegateAfsReplaceEntry(IntPtr afs, int id, IntPtr data, ulong data_size);
 
         [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
         public delegate int DelegateAfsReplaceEntriesFromFiles(
@@ -218,19 +219,14 @@ namespace Afster
             {
                 throw new Exception($"Index {index} outside of AFS range.");
             }
-            IntPtr afsreturn = AfsNative.afs_extractEntryToFile(_handle, index, outputFolder);
-            if (afsreturn == IntPtr.Zero)
+            // Receives the path of the output file, large enough for PATH_MAX on every platform
+            StringBuilder filepath = new StringBuilder(4096);
+            int afsreturn = AfsNative.afs_extractEntryToFile(_handle, index, outputFolder, filepath);
+            if (afsreturn != 0)
             {
-                throw new Exception("Failed to extract entry to file.");
-            }
-            try
-            {
-                return Marshal.PtrToStringAnsi(afsreturn);
-            }
-            finally
-            {
-                AfsNative.afs_freeBuffer(afsreturn);
+                throw new Exception($"Failed to extract entry to file. (afs_extractEntryToFile returned {afsreturn})");
             }
+            return filepath.ToString();
         }
 
         public void ExtractFull(string outputFolder)
@@ -248,6 +244,10 @@ namespace Afster
             {
                 throw new Exception("AFS is invalid. (afs_extractFull returned 1)");
             }
+            if (afsreturn == 3)
+            {
+                throw new Exception("Some entries couldn't be extracted. (afs_extractFull returned 3)");
+            }
         }
 
         public int ReplaceEntry(int index, byte[] data)
@@ -269,7 +269,7 @@ namespace Afster
             try
             {
                 IntPtr ptr = gch.AddrOfPinnedObject();
-                return AfsNative.afs_replaceEntry(_handle, index, ptr, data.Length);
+                return AfsNative.afs_replaceEntry(_handle, index, ptr, (ulong)data.Length);
             }
             finally
             {
@@ -35,12 +35,14 @@ JNIEXPORT jstring JNICALL Java_jagger_Afster_Afs_afs_1extractEntryToFile
   (JNIEnv * env, jobject caller, jlong afs, jint id, jstring outputFolderpath) {
     JNIEnv jni = *env;
     char* path = jni->GetStringUTFChars(env, outputFolderpath, NULL);
-    char* out = afs_extractEntryToFile((Afs*)afs, id, path);
+    char out[PATH_MAX];
+    int ret = afs_extractEntryToFile((Afs*)afs, id, path, out);
     jni->ReleaseStringUTFChars(env, outputFolderpath, path);
 
-    jstring outstr = jni->NewStringUTF(env, out);
-    free(out);
-    return outstr;
+    if(ret != 0) {
+        return NULL;
+    }
+    return jni->NewStringUTF(env, out);
 }
 
 /*
@@ -86,7 +86,8 @@ public class Afs {
     public void setPermanent(boolean value) { _permanent = value; }
     
     public File extractEntryToFile(int id, String outputFolderpath) {
-    	return new File(afs_extractEntryToFile(_handle, id, outputFolderpath));
+    	String path = afs_extractEntryToFile(_handle, id, outputFolderpath);
+    	return path != null ? new File(path) : null;
     }
     
     public byte[] extractEntryToBuffer(int id) {
@@ -53,6 +53,7 @@ Afl* afl_create(Afs* afs, char* filepath) {
     afl->head.entrycount = afs->header.entrycount;
     afl->entrynames = (char*)malloc(afl->head.entrycount * AFL_NAMEBUFFERSIZE);
 
+    afs_loadMetadata(afs);
     for(int i=0;i<afl->head.entrycount;i++) {
         strncpy(_AFL_NAME(afl,i), afs->meta[i].filename, AFL_NAMEBUFFERSIZE);
     }
@@ -176,6 +177,10 @@ int afl_importAfl(Afl* afl, Afs* afs, bool permament) {
         _afl_LogError("ERROR: afl_importAfl - afs exists, but afs->fstream doesn't.");
         return 1;
     }
+    if(afs->openFlags & AFS_OPEN_READONLY) {
+        _afl_LogError("ERROR: afl_importAfl - afs was opened read-only.");
+        return 1;
+    }
     if(afl == NULL) {
         _afl_LogError("ERROR: afl_importAfl - afl null.");
         return 2;
@@ -186,13 +191,13 @@ int afl_importAfl(Afl* afl, Afs* afs, bool permament) {
         _afl_LogErrorF("AFS file count: %d\nAFL file count: %d\n", afs->header.entrycount, afl->head.entrycount);
     }
 
+    afs_loadMetadata(afs);
     for(int i=0;i<afs->header.entrycount;i++) {
         memcpy(afs->meta[i].filename, afl_getName(afl, i), AFSMETA_NAMEBUFFERSIZE);
     }
     if(permament) {
-        AfsEntryInfo metaInfo = afs->header.entryinfo[afs->header.entrycount];
-        fseek(afs->fstream, metaInfo.offset, SEEK_SET);
-        fwrite(afs->meta, metaInfo.size, 1, afs->fstream);
+        // Deferred to afs_commit() if a transaction is open
+        afs_writeMetadata(afs);
     }
     return 0;
 }
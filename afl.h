@@ -115,7 +115,7 @@ EXPORT int afl_saveNew(Afl* afl, const char* filepath);
  *
  * @param afs The AFS to be updated
  * @param afl The AFL Name List
- * @param permanent If true, the function will overwrite the metadata in the AFS File itself as well.
+ * @param permanent If true, the function will overwrite the metadata in the AFS File itself as well. Inside a transaction this happens at afs_commit().
  *
  * @retval 0 if successful
  * @retval 1 if AFS is invalid
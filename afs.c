@@ -1,5 +1,180 @@
+// Needed for copy_file_range()
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+// 64-bit file offsets for fseeko/pread/pwrite on 32-bit systems as well, the Makefiles pass it too
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
 #include "afs.h"
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define AFS_HAVE_IOURING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifdef __unix__
+#include <pthread.h>
+typedef pthread_mutex_t AfsMutex;
+#endif
+#ifdef _WIN32
+typedef CRITICAL_SECTION AfsMutex;
+#endif
+
+typedef void* (*AfsWorkerFunc)(void*);
+
+/** State of a dry run, see afs_planReplace().
+ * While afs->internal->dryRun is set, nothing is read from or written to the AFS file or the sources, it's only counted.
+ */
+struct AfsDryRun {
+    AfsReplacePlan* plan;
+    /** What happened with each entry, by ID */
+    AfsEditAction* actions;
+    /** Memory currently taken up by tracked buffers */
+    u64 memory;
+    /** Size the AFS file would have */
+    u64 fileSize;
+};
+
+/** Edits staged by afs_begin() until they are applied by afs_commit() or dropped by afs_rollback().
+ * The entry count can't change while it's open, so the tables are indexed by entry ID.
+ */
+struct AfsTransaction {
+    /** Staged replacement of each entry, only valid where staged[id] is set.
+     * Buffers, paths and names are owned copies, callback sources are read into a buffer when they are staged. */
+    AfsEntrySource* sources;
+    bool* staged;
+    int stagedCount;
+    /** Copy of the metadata buffer when the transaction was opened, restored by afs_rollback() */
+    AfsEntryMetadata* savedMeta;
+    u64 savedMetaSize;
+};
+
+#define AFS_JOURNAL_WRITE 1
+#define AFS_JOURNAL_TRUNCATE 2
+#define AFS_JOURNAL_COMMIT 3
+
+/** Record of the journal file. A write record is followed by its data.
+ * Truncate records store the new file size in size, commit records the amount of records
+ * of the batch in offset and the checksum of those records in size.
+ */
+typedef struct {
+    u32 type;
+    u32 reserved;
+    u64 offset;
+    u64 size;
+} AfsJournalRecord;
+
+/** A record of the current batch, with the position of its data in the journal file. */
+typedef struct {
+    u32 type;
+    u64 offset;
+    u64 size;
+    u64 data;
+} AfsJournalEntry;
+
+/** Range of the AFS file whose latest data in the current journal batch is stored at one place in the journal file. */
+typedef struct {
+    u64 offset;
+    u64 size;
+    u64 data;
+} AfsJournalExtent;
+
+/** Write-ahead journal of an AFS opened with AFS_OPEN_JOURNAL.
+ * Writes to the AFS are appended to the journal file instead, and reads are served from it where they overlap.
+ * A batch is committed with one sync of the journal, and only then applied to the AFS.
+ */
+struct AfsJournal {
+    FILE* fp;
+    char* path;
+    /** Records of the current batch, in the order they were made */
+    AfsJournalEntry* entries;
+    int count;
+    int capacity;
+    /** Where the next record goes in the journal file */
+    u64 end;
+    /** Checksum of the records of the current batch */
+    u64 checksum;
+    /** Size of the AFS file with the current batch applied */
+    u64 fileSize;
+    /** How much of the AFS file is read from the file itself: its size before the batch,
+     * or the smallest size the batch truncated it to. Everything behind it comes from the batch or reads as zeros. */
+    u64 baseSize;
+    /** Where the latest data of each range the batch wrote to is, sorted by offset and without overlaps,
+     * so a read only has to look at the writes it overlaps */
+    AfsJournalExtent* extents;
+    int extentCount;
+    int extentCapacity;
+};
+
+/** Writes a new file front to back, see _afs_rebuildToNewFile().
+ * With direct I/O the data is gathered in an aligned buffer and written whenever the buffer is full,
+ * so every write has an aligned offset and size and bypasses the page cache (see afs_setDirectIo()).
+ * Without it, every write goes straight to the file.
+ */
+struct AfsBulkWriter {
+    FILE* fp;
+    bool direct;
+    /** Alignment of direct writes, see _afs_getDirectAlignment() */
+    u64 alignment;
+    /** Aligned buffer, its size is a multiple of the alignment */
+    u8* buffer;
+    u64 bufferSize;
+    /** Offset within the file where the data in the buffer starts, and amount of bytes in it */
+    u64 offset;
+    u64 fill;
+};
+
+/** State of an AFS handle that isn't part of the public Afs struct. */
+struct AfsInternal {
+    /** Base of the read-only mapping of the whole file (afs_openMapped), NULL otherwise. */
+    u8* mapping;
+    u64 mappingSize;
+    /** Platform handle backing the mapping (only used on Windows). */
+    void* mappingHandle;
+    /** Backend used for multi-entry extraction, see afs_setIoBackend(). */
+    AfsIoBackend ioBackend;
+    /** Size of the buffer used when data is moved or copied in chunks, see afs_setChunkSize(). */
+    u64 chunkSize;
+    /** What happens when a replaced entry outgrows its reserved space, see afs_setGrowthPolicy(). */
+    AfsGrowthPolicy growthPolicy;
+    /** Free space between the entries, sorted by offset. Built from the entry info on first use, NULL until then. */
+    AfsExtent* freeExtents;
+    int freeExtentCount;
+    /** Headroom given to entries that are resized, see afs_setGrowthHeadroom(). */
+    AfsHeadroomMode headroomMode;
+    u64 headroomValue;
+    /** Space reserved for each entry by headroom or afs_reserveEntry(), NULL until the first reservation. */
+    u64* reservedSpace;
+    /** Set while afs_planReplace() simulates a replacement on a copy of the handle, NULL otherwise. */
+    struct AfsDryRun* dryRun;
+    /** Edits staged since afs_begin(), NULL if no transaction is open. */
+    struct AfsTransaction* transaction;
+    /** Set while afs_commit() applies the staged edits, the records are written once at the end instead of by each edit. */
+    bool committing;
+    /** Entry info and metadata records that were changed in memory but not written yet, one mark per record.
+     * NULL if none is dirty, see afs_flush(). */
+    u8* dirtyInfo;
+    u8* dirtyMeta;
+    /** Journal of an AFS opened with AFS_OPEN_JOURNAL, NULL otherwise. */
+    struct AfsJournal* journal;
+    /** Path the AFS was opened with, needed to rebuild it into a new file (AFS_GROWTH_REBUILD). */
+    char* filePath;
+    /** Whether rebuilds into a new file use direct I/O, see afs_setDirectIo(). */
+    bool directIo;
+    /** Aligned buffer for direct I/O, allocated by the first rebuild that uses it and kept for later ones. */
+    u8* directBuffer;
+    u64 directBufferSize;
+    u64 directAlignment;
+    /** Set while a rebuild writes a new file front to back, NULL otherwise. */
+    struct AfsBulkWriter* bulk;
+    /** How the AFS is read outside of extractions and rebuilds, see afs_setAccessPattern(). */
+    AfsAccessPattern accessPattern;
+};
+
 void _afs_LogError(const char* message) {
     fprintf(stderr, "%s\n", message);
 }
@@ -82,605 +257,5627 @@ int _afs_ApplyTimestamp(char* filepath, Timestamp ts) {
     return 0;
 }
 
-/** Calculates the reserved space for this entry.
+/** Reads a range of a file into a buffer without using or changing its position.
  * @note DESIGNED FOR INTERNAL USE ONLY
  *
- * @param new_size The new size of the entry
- * @return The amount of space that should be reserved for this entry.
+ * @param fp The file
+ * @param dst Buffer that receives the data
+ * @param size Amount of bytes to read
+ * @param offset Offset within the file
+ * @return The amount of bytes read.
  */
-int _afs_calcReservedSpace(int new_size) {
-    if(AFS_RESERVEDSPACEBUFFER % 0x10 != 0) {
-        return -3;
+u64 _afs_readFile(FILE* fp, void* dst, u64 size, u64 offset) {
+    u64 done = 0;
+    #ifdef __unix__
+    int fd = fileno(fp);
+    while(done < size) {
+        ssize_t ret = pread(fd, (u8*)dst + done, size - done, offset + done);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) break;
+        done += ret;
     }
-
-    int newReservedSpace = (new_size / AFS_RESERVEDSPACEBUFFER + 1) * AFS_RESERVEDSPACEBUFFER;
-
-    return newReservedSpace;
+    #endif
+    #ifdef _WIN32
+    HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(fp));
+    while(done < size) {
+        OVERLAPPED ov;
+        memset(&ov, 0x00, sizeof(OVERLAPPED));
+        ov.Offset = (DWORD)(offset + done);
+        ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD chunk = (size - done > 0x40000000) ? 0x40000000 : (DWORD)(size - done);
+        DWORD ret = 0;
+        if(!ReadFile(hFile, (u8*)dst + done, chunk, &ret, &ov) || ret == 0) break;
+        done += ret;
+    }
+    #endif
+    return done;
 }
 
-/** Replaces an entry within the AFS without resizing
+/** Writes a buffer to a range of a file without using or changing its position.
  * @note DESIGNED FOR INTERNAL USE ONLY
  *
- * @param afs The AFS struct
- * @param id The index of the entry
- * @param data Byte Array containing the new entry data
- * @param data_size Size of the data
- * @return 0 if successful, 1 if AFS is invalid, 2 if entry ID is out of range, 3 if data array is invalid (NULL or zero size).
+ * @param fp The file
+ * @param src Buffer containing the data
+ * @param size Amount of bytes to write
+ * @param offset Offset within the file
+ * @return The amount of bytes written.
  */
-int _afs_replaceEntry_noResize(Afs* afs, int id, u8* data, int data_size) {
-    if(afs == NULL || afs->fstream == NULL) {
-        return 1;
-    }
-    if(id < 0 || id >= afs->header.entrycount) {
-        return 2;
+u64 _afs_writeFile(FILE* fp, const void* src, u64 size, u64 offset) {
+    u64 done = 0;
+    #ifdef __unix__
+    int fd = fileno(fp);
+    while(done < size) {
+        ssize_t ret = pwrite(fd, (const u8*)src + done, size - done, offset + done);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) break;
+        done += ret;
     }
-    if(data == NULL || data_size <= 0) {
-        return 3;
+    #endif
+    #ifdef _WIN32
+    HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(fp));
+    while(done < size) {
+        OVERLAPPED ov;
+        memset(&ov, 0x00, sizeof(OVERLAPPED));
+        ov.Offset = (DWORD)(offset + done);
+        ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD chunk = (size - done > 0x40000000) ? 0x40000000 : (DWORD)(size - done);
+        DWORD ret = 0;
+        if(!WriteFile(hFile, (const u8*)src + done, chunk, &ret, &ov) || ret == 0) break;
+        done += ret;
     }
+    #endif
+    return done;
+}
 
-    int reservedSpace = afs->header.entryinfo[id+1].offset - afs->header.entryinfo[id].offset;
+/** Makes sure everything written to a file is on the disk.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @return 0 if successful, 1 if it failed.
+ */
+int _afs_syncFile(FILE* fp) {
+    #ifdef __unix__
+    return fsync(fileno(fp)) != 0;
+    #endif
+    #ifdef _WIN32
+    return _commit(_fileno(fp)) != 0;
+    #endif
+}
 
-    u8* newData = (u8*)malloc(reservedSpace);
-    memset(newData, 0x00, reservedSpace);
-    memcpy(newData, data, data_size);
+/** Sets the size of a file, cutting off everything behind it.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @return 0 if successful, 1 if it failed.
+ */
+int _afs_truncateFile(FILE* fp, u64 size) {
+    #ifdef __unix__
+    return ftruncate(fileno(fp), size) != 0;
+    #endif
+    #ifdef _WIN32
+    return _chsize_s(_fileno(fp), size) != 0;
+    #endif
+}
 
-    fseek(afs->fstream, afs->header.entryinfo[id].offset, SEEK_SET);
-    fwrite(newData, 1, reservedSpace, afs->fstream);
-    int entryinfoOffset = 8 + (sizeof(AfsEntryInfo) * id); // 8 = sizeof(identifier) + sizeof(entrycount)
-    fseek(afs->fstream, entryinfoOffset, SEEK_SET);
-    afs->header.entryinfo[id].size = data_size;
-    fwrite(afs->header.entryinfo + id, sizeof(AfsEntryInfo), 1, afs->fstream);
+/** Size of the block of zeros that padding is written from. */
+#define AFS_ZEROBLOCKSIZE 0x10000
+/** Amount of zero blocks written with a single pwritev(). */
+#define AFS_ZEROIOVECS 16
 
-    afs->meta[id].filesize = data_size;
-    fseek(afs->fstream, afs->header.entryinfo[afs->header.entrycount].offset + sizeof(AfsEntryMetadata) * id, SEEK_SET);
-    fwrite(afs->meta + id, sizeof(AfsEntryMetadata), 1, afs->fstream);
+/** Shared block of zeros, so padding never needs a zero-filled allocation. */
+static const u8 _afs_zeroBlock[AFS_ZEROBLOCKSIZE];
 
-    fseek(afs->fstream, 0, SEEK_SET);
-    free(newData);
+/** Writes zeros to a range of a file without using or changing its position.
+ * On Linux the range is cleared with fallocate(FALLOC_FL_ZERO_RANGE) where the filesystem supports it,
+ * so the zeros don't have to be written at all. Otherwise _afs_zeroBlock is written over and over,
+ * on Unix with one pwritev() for up to AFS_ZEROIOVECS blocks.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param fp The file
+ * @param offset Offset within the file
+ * @param size Amount of bytes to clear
+ * @return 0 if successful, 1 if writing failed.
+ */
+int _afs_writeZerosFile(FILE* fp, u64 offset, u64 size) {
+    if(size == 0) {
+        return 0;
+    }
+    #ifdef __linux__
+    if(fallocate(fileno(fp), FALLOC_FL_ZERO_RANGE, offset, size) == 0) {
+        return 0;
+    }
+    #endif
+    u64 done = 0;
+    #ifdef __unix__
+    struct iovec iov[AFS_ZEROIOVECS];
+    for(int i=0;i<AFS_ZEROIOVECS;i++) {
+        iov[i].iov_base = (void*)_afs_zeroBlock;
+        iov[i].iov_len = AFS_ZEROBLOCKSIZE;
+    }
+    while(done < size) {
+        u64 left = size - done;
+        int count = (left + AFS_ZEROBLOCKSIZE - 1) / AFS_ZEROBLOCKSIZE;
+        if(count > AFS_ZEROIOVECS) count = AFS_ZEROIOVECS;
+        iov[count-1].iov_len = (left < (u64)count * AFS_ZEROBLOCKSIZE) ? left - (u64)(count - 1) * AFS_ZEROBLOCKSIZE : AFS_ZEROBLOCKSIZE;
+        ssize_t ret = pwritev(fileno(fp), iov, count, offset + done);
+        iov[count-1].iov_len = AFS_ZEROBLOCKSIZE;
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) return 1;
+        done += ret;
+    }
+    #endif
+    #ifdef _WIN32
+    while(done < size) {
+        u64 chunk = (size - done < AFS_ZEROBLOCKSIZE) ? size - done : AFS_ZEROBLOCKSIZE;
+        if(_afs_writeFile(fp, _afs_zeroBlock, chunk, offset + done) != chunk) return 1;
+        done += chunk;
+    }
+    #endif
     return 0;
 }
 
-/** Clears and resizes the reserved space for the specified entry.
- * This will change each offset for following entries!
+/** Tells the kernel how the AFS file is going to be read, with posix_fadvise() or madvise() for a mapped AFS.
+ * It's only a hint, so failures are ignored. Does nothing on Windows.
  * @note DESIGNED FOR INTERNAL USE ONLY
  *
  * @param afs The AFS struct
- * @param id The index of the entry
- * @param new_size new reserved space for the entry, will be expanded to be 16-Byte aligned.
- * @return 0 if successful, 1 if AFS is invalid, 2 if entry ID is out of range, 3 if AFS_RESERVEDSPACEBUFFER isn't 16-Byte aligned.
+ * @param pattern The access pattern for the whole file
  */
-int _afs_resizeEntrySpace(Afs* afs, int id, int new_size) {
-    if(afs == NULL || afs->fstream == NULL) {
-        return 1;
+void _afs_adviseAccess(Afs* afs, AfsAccessPattern pattern) {
+    if(afs->internal->dryRun != NULL) {
+        return;
     }
-    if(id < 0 || id >= afs->header.entrycount) {
-        return 2;
+    #ifdef __unix__
+    if(afs->internal->mapping != NULL) {
+        int advice = (pattern == AFS_ACCESS_RANDOM) ? MADV_RANDOM :
+                     (pattern == AFS_ACCESS_SEQUENTIAL) ? MADV_SEQUENTIAL : MADV_NORMAL;
+        madvise(afs->internal->mapping, afs->internal->mappingSize, advice);
     }
-
-    int oldSize = afs->header.entryinfo[id].size;
-    afs->header.entryinfo[id].size = new_size;
-
-    int newReservedSpace = _afs_calcReservedSpace(new_size);
-    if(newReservedSpace < 0) {
-        return -newReservedSpace;
+    if(afs->fstream != NULL) {
+        int advice = (pattern == AFS_ACCESS_RANDOM) ? POSIX_FADV_RANDOM :
+                     (pattern == AFS_ACCESS_SEQUENTIAL) ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL;
+        posix_fadvise(fileno(afs->fstream), 0, 0, advice);
     }
-    u8* buffer = (u8*)malloc(newReservedSpace);
-    memset(buffer, 0x00, newReservedSpace);
+    #endif
+}
 
-    // This variable is the starting offset for the back half of the AFS
-    int oldOffsetNextEntry = afs->header.entryinfo[id+1].offset;
+/** Largest range handed to the kernel per prefetch request.
+ * Linux reads at most the readahead size of the device per request (often only 128 KiB) and quietly drops the rest.
+ */
+#define AFS_PREFETCHCHUNK 0x20000
 
-    // This loop updates each element in the entryinfo array with their new offsets.
-    int curOffset = afs->header.entryinfo[id].offset + newReservedSpace;
-    for(int i=id + 1; i < afs->header.entrycount; i++) {
-        int reserved = afs->header.entryinfo[i+1].offset - afs->header.entryinfo[i].offset;
-        afs->header.entryinfo[i].offset = curOffset;
-        curOffset += reserved;
+/** Asks the kernel to start reading a range of the AFS file into the page cache, without waiting for it.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param offset Offset of the range within the AFS file
+ * @param size Size of the range
+ */
+void _afs_prefetchRange(Afs* afs, u64 offset, u64 size) {
+    #ifdef __unix__
+    // madvise() wants a page aligned address
+    u64 pageSize = (u64)sysconf(_SC_PAGESIZE);
+    u64 end = offset + size;
+    offset -= offset % pageSize;
+    for(u64 pos=offset;pos<end;pos+=AFS_PREFETCHCHUNK) {
+        u64 chunk = (end - pos < AFS_PREFETCHCHUNK) ? end - pos : AFS_PREFETCHCHUNK;
+        if(afs->internal->mapping != NULL) {
+            madvise(afs->internal->mapping + pos, chunk, MADV_WILLNEED);
+        }
+        else {
+            posix_fadvise(fileno(afs->fstream), (off_t)pos, (off_t)chunk, POSIX_FADV_WILLNEED);
+        }
     }
-    // Metadata
-    afs->header.entryinfo[afs->header.entrycount].offset = curOffset;
+    #endif
+}
 
-    // Consider the AFS as one long line of data.
-    // This is splitting the AFS exactly where the entry is,
-    // Creating a Front part and a back part.
+/** Alignment of direct I/O buffers, offsets and sizes when the file doesn't report a usable block size.
+ * Covers devices with sectors of up to 4096 bytes.
+ */
+#define AFS_DIRECTALIGNMENT 4096
 
-    // This is the size of that back part
-    fseek(afs->fstream, oldOffsetNextEntry, SEEK_SET);
-    int backSize = ftell(afs->fstream);
-    fseek(afs->fstream, 0, SEEK_END);
-    backSize = ftell(afs->fstream) - backSize;
-
-    // This here reads the back part into a buffer
-    u8* back = (u8*)malloc(backSize);
-    fseek(afs->fstream, oldOffsetNextEntry, SEEK_SET);;
-    fread(back, 1, backSize, afs->fstream);
-
-    // This here writes the new space to the file
-    fseek(afs->fstream, afs->header.entryinfo[id].offset, SEEK_SET);
-    fwrite(buffer, 1, newReservedSpace, afs->fstream);
-    // This here writes the back part to the file
-    fwrite(back, 1, backSize, afs->fstream);
+/** Turns direct I/O (O_DIRECT) on or off for an opened file.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @return 0 if successful, 1 if the platform or the filesystem doesn't support it.
+ */
+int _afs_setDirectFlag(FILE* fp, bool enabled) {
+    #ifdef __linux__
+    int fd = fileno(fp);
+    int flags = fcntl(fd, F_GETFL);
+    if(flags < 0) {
+        return 1;
+    }
+    flags = enabled ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    return fcntl(fd, F_SETFL, flags) != 0;
+    #else
+    return 1;
+    #endif
+}
 
-    // This here writes the new entry info into the header.
-    fseek(afs->fstream, 8, SEEK_SET);
-    fwrite(afs->header.entryinfo, sizeof(AfsEntryInfo), afs->header.entrycount + 1, afs->fstream);
+/** Gets the alignment direct I/O needs for an opened file: the logical block size of a block device,
+ * the block size of the filesystem for a regular file, AFS_DIRECTALIGNMENT if neither is known.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+u64 _afs_getDirectAlignment(FILE* fp) {
+    #ifdef __linux__
+    struct stat st;
+    if(fstat(fileno(fp), &st) == 0) {
+        if(S_ISBLK(st.st_mode)) {
+            int sectorSize = 0;
+            if(ioctl(fileno(fp), BLKSSZGET, &sectorSize) == 0 && sectorSize >= 512 && (sectorSize & (sectorSize - 1)) == 0) {
+                return sectorSize;
+            }
+        }
+        else if(st.st_blksize >= 512 && (st.st_blksize & (st.st_blksize - 1)) == 0) {
+            return st.st_blksize;
+        }
+    }
+    #endif
+    return AFS_DIRECTALIGNMENT;
+}
 
-    free(back);
-    free(buffer);
+/** Writes the buffer of a bulk writer to its file.
+ * The last write is padded to the alignment of the writer, the file has to be truncated to its real size afterwards.
+ * If the filesystem refuses a direct write, the writer falls back to regular writes for good.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @return 0 if successful, 1 if writing failed.
+ */
+int _afs_bulkFlush(struct AfsBulkWriter* writer) {
+    if(writer->fill == 0) {
+        return 0;
+    }
+    if(writer->direct) {
+        u64 size = (writer->fill + writer->alignment - 1) / writer->alignment * writer->alignment;
+        memset(writer->buffer + writer->fill, 0x00, size - writer->fill);
+        if(_afs_writeFile(writer->fp, writer->buffer, size, writer->offset) != size) {
+            writer->direct = false;
+            _afs_setDirectFlag(writer->fp, false);
+        }
+    }
+    if(!writer->direct && _afs_writeFile(writer->fp, writer->buffer, writer->fill, writer->offset) != writer->fill) {
+        return 1;
+    }
+    writer->offset += writer->fill;
+    writer->fill = 0;
     return 0;
 }
 
-
-Afs* afs_open(char* filePath) {
-    if(filePath == NULL || *filePath == '\0') {
-        return NULL;
+/** Writes data to the file of a bulk writer, behind everything that was written so far.
+ * With direct I/O the data is gathered in the buffer of the writer, the gap in front of it is filled with zeros.
+ * Without it, the data is written straight away (the file is expected to be zero-filled already).
+ * If direct I/O falls back to regular writes halfway through a gap, the rest of the gap is cleared explicitly,
+ * the file behind the last flush can't be expected to be zero-filled then.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param writer The bulk writer
+ * @param src Buffer containing the data
+ * @param size Amount of bytes to write
+ * @param offset Offset within the file, mustn't be in front of data that was written already.
+ * @return 0 if successful, 1 if writing failed.
+ */
+int _afs_bulkWrite(struct AfsBulkWriter* writer, const void* src, u64 size, u64 offset) {
+    const u8* data = (const u8*)src;
+    u64 gap = 0;
+    if(writer->direct) {
+        u64 pos = writer->offset + writer->fill;
+        if(offset < pos) {
+            return 1;
+        }
+        gap = offset - pos;
     }
-    FILE* fp = fopen(filePath, "rb+");
-
-    if(fp == NULL) {
-        _afs_LogError(  "ERROR: afs_open - AFS Filepath invalid." \
-                        "Make sure that you have read+write permission for this file.");
-        _afs_LogErrorF("Filepath: %s\n", filePath);
-        return NULL;
+    while(writer->direct && gap + size > 0) {
+        u64 space = writer->bufferSize - writer->fill;
+        u64 n = (gap > 0) ? (gap < space ? gap : space) : (size < space ? size : space);
+        if(gap > 0) {
+            memset(writer->buffer + writer->fill, 0x00, n);
+            gap -= n;
+        }
+        else {
+            memcpy(writer->buffer + writer->fill, data, n);
+            data += n;
+            size -= n;
+            offset += n;
+        }
+        writer->fill += n;
+        if(writer->fill == writer->bufferSize && _afs_bulkFlush(writer) != 0) {
+            return 1;
+        }
     }
-    Afs* afs = (Afs*)malloc(sizeof(Afs));
-    afs->fstream = fp;
-
-    // Read AFS Header
-    fread(&afs->header, 8, 1, afs->fstream);
-    AfsHeader* head = &afs->header;
-
-    // Read Info for all files in the AFS
-    head->entryinfo = (AfsEntryInfo*)malloc((head->entrycount + 1) * sizeof(AfsEntryInfo));
-    fread(head->entryinfo, sizeof(AfsEntryInfo), head->entrycount + 1, afs->fstream);
-
-    // Read Metadata for all files in the AFS
-    int metaSize = head->entryinfo[head->entrycount].size;
-    afs->meta = (AfsEntryMetadata*)malloc(metaSize);
-    fseek(afs->fstream, head->entryinfo[head->entrycount].offset, SEEK_SET);
-    fread(afs->meta, metaSize, 1, afs->fstream);
+    if(!writer->direct && gap > 0 && _afs_writeZerosFile(writer->fp, offset - gap, gap) != 0) {
+        return 1;
+    }
+    if(!writer->direct && size > 0) {
+        return _afs_writeFile(writer->fp, data, size, offset) != size;
+    }
+    return 0;
+}
 
-    return afs;
+/** Updates the checksum of a journal batch (64-bit FNV-1a).
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+u64 _afs_journalChecksum(u64 hash, const void* data, u64 size) {
+    const u8* bytes = (const u8*)data;
+    for(u64 i=0;i<size;i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
 }
 
-void afs_free(Afs* afs) {
-    if(afs == NULL) {
-        puts("WARNING: afs_free - afs pointer already freed. Returning.");
-        return;
+/** Finds the first extent of the journal index that ends behind an offset.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+int _afs_journalFindExtent(struct AfsJournal* journal, u64 offset) {
+    int low = 0;
+    int high = journal->extentCount;
+    while(low < high) {
+        int mid = low + (high - low) / 2;
+        AfsJournalExtent* e = &journal->extents[mid];
+        if(e->offset + e->size <= offset) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
     }
-    free(afs->meta);
-    free(afs->header.entryinfo);
-    fclose(afs->fstream);
-    free(afs);
-    afs = NULL;
+    return low;
 }
 
-int afs_save(Afs* afs, char* filepath) {
-    if(afs == NULL) {
-        _afs_LogError("ERROR: afs_save - Invalid AFS pointer");
-        return 1;
+/** Adds a write to the journal index. Whatever older writes it overlaps is taken out of the index,
+ * the parts of them in front of and behind the new range are kept.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param journal The journal
+ * @param offset Offset within the AFS file
+ * @param size Size of the data
+ * @param data Position of the data in the journal file
+ */
+void _afs_journalIndex(struct AfsJournal* journal, u64 offset, u64 size, u64 data) {
+    u64 end = offset + size;
+    int first = _afs_journalFindExtent(journal, offset);
+    int last = first;
+    while(last < journal->extentCount && journal->extents[last].offset < end) {
+        last++;
     }
-    if(filepath == NULL || *filepath == 0x00) {
-        _afs_LogError("ERROR: afs_save - Invalid filepath.");
-        return 2;
+
+    AfsJournalExtent pieces[3];
+    int amount = 0;
+    if(first < last && journal->extents[first].offset < offset) {
+        pieces[amount] = journal->extents[first];
+        pieces[amount].size = offset - pieces[amount].offset;
+        amount++;
     }
-    FILE* fp = fopen(filepath, "w+b");
-    if(fp == NULL) {
-        _afs_LogErrorF( "ERROR: afs_save - Couldn't create file.\n" \
-                        "Filepath: '%s'\n", filepath);
-        perror(NULL);
-        return 3;
+    pieces[amount].offset = offset;
+    pieces[amount].size = size;
+    pieces[amount].data = data;
+    amount++;
+    if(first < last) {
+        AfsJournalExtent* e = &journal->extents[last - 1];
+        if(e->offset + e->size > end) {
+            pieces[amount].offset = end;
+            pieces[amount].size = e->offset + e->size - end;
+            pieces[amount].data = e->data + (end - e->offset);
+            amount++;
+        }
     }
 
-    if(*afs->header.identifier != 'A' || (afs->header.entrycount > 0 && afs->header.entryinfo == NULL)) {
-        _afs_LogError("ERROR: afs_save - afs->header is invalid.");
-        return 3;
-    }
-    if(afs->meta == NULL) {
-        _afs_LogError("ERROR: afs_save - afs->meta is invalid.");
-        return 3;
+    int newCount = journal->extentCount - (last - first) + amount;
+    if(newCount > journal->extentCapacity) {
+        journal->extentCapacity = journal->extentCapacity * 2 > newCount ? journal->extentCapacity * 2 : newCount + 64;
+        journal->extents = (AfsJournalExtent*)realloc(journal->extents, sizeof(AfsJournalExtent) * journal->extentCapacity);
     }
+    memmove(journal->extents + first + amount, journal->extents + last, sizeof(AfsJournalExtent) * (journal->extentCount - last));
+    memcpy(journal->extents + first, pieces, sizeof(AfsJournalExtent) * amount);
+    journal->extentCount = newCount;
+}
 
-    fwrite(&afs->header, 1, 8, fp);
-    fwrite(afs->header.entryinfo, sizeof(AfsEntryInfo), afs->header.entrycount+1, fp);
-    fseek(fp, afs->header.entryinfo[afs->header.entrycount].offset, SEEK_SET);
-    fwrite(afs->meta, sizeof(AfsEntryMetadata), afs->header.entrycount, fp);
+/** Appends a record to the journal, with its data for write records.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param journal The journal
+ * @param type AFS_JOURNAL_WRITE or AFS_JOURNAL_TRUNCATE
+ * @param offset Offset within the AFS file
+ * @param size Size of the data, or the new file size
+ * @param data The data of a write record
+ * @return 0 if successful, 1 if writing the journal failed.
+ */
+int _afs_journalAppend(struct AfsJournal* journal, u32 type, u64 offset, u64 size, const void* data) {
+    AfsJournalRecord record;
+    memset(&record, 0x00, sizeof(AfsJournalRecord));
+    record.type = type;
+    record.offset = offset;
+    record.size = size;
+    u64 dataSize = (type == AFS_JOURNAL_WRITE) ? size : 0;
+    if(_afs_writeFile(journal->fp, &record, sizeof(AfsJournalRecord), journal->end) != sizeof(AfsJournalRecord)
+        || _afs_writeFile(journal->fp, data, dataSize, journal->end + sizeof(AfsJournalRecord)) != dataSize) {
+        _afs_LogError("ERROR: _afs_journalAppend - Failed to write to the journal.");
+        return 1;
+    }
+    journal->checksum = _afs_journalChecksum(journal->checksum, &record, sizeof(AfsJournalRecord));
+    journal->checksum = _afs_journalChecksum(journal->checksum, data, dataSize);
 
-    fclose(fp);
+    if(journal->count == journal->capacity) {
+        journal->capacity = journal->capacity > 0 ? journal->capacity * 2 : 64;
+        journal->entries = (AfsJournalEntry*)realloc(journal->entries, sizeof(AfsJournalEntry) * journal->capacity);
+    }
+    AfsJournalEntry* entry = &journal->entries[journal->count++];
+    entry->type = type;
+    entry->offset = offset;
+    entry->size = size;
+    entry->data = journal->end + sizeof(AfsJournalRecord);
+    journal->end += sizeof(AfsJournalRecord) + dataSize;
 
+    if(type == AFS_JOURNAL_WRITE) {
+        _afs_journalIndex(journal, offset, size, entry->data);
+        if(offset + size > journal->fileSize) journal->fileSize = offset + size;
+    }
+    else {
+        // Data written behind the new end is gone, just like in the file
+        int i = _afs_journalFindExtent(journal, size);
+        if(i < journal->extentCount && journal->extents[i].offset < size) {
+            journal->extents[i].size = size - journal->extents[i].offset;
+            i++;
+        }
+        journal->extentCount = i;
+        journal->fileSize = size;
+        if(size < journal->baseSize) journal->baseSize = size;
+    }
     return 0;
 }
 
-int afs_getEntrycount(Afs* afs) {
-    return afs->header.entrycount;
-}
-
-AfsEntryInfo afs_getEntryinfo(Afs* afs, int id) {
-    AfsEntryInfo out;
-    memset(&out, 0x00, sizeof(AfsEntryInfo));
-    if(afs == NULL || afs->fstream == NULL) {
-        _afs_LogError("ERROR: afs_getEntryinfo - Invalid AFS pointer (afs or afs->fstream).");
-        return out;
+/** Puts the data of the current journal batch over a range that was read from the AFS file.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param journal The journal
+ * @param dst Buffer with the data read from the AFS file
+ * @param size Amount of bytes that were requested
+ * @param offset Offset within the AFS file
+ * @param done Amount of bytes that were read from the AFS file
+ * @return The amount of bytes read with the batch applied.
+ */
+u64 _afs_journalOverlay(struct AfsJournal* journal, u8* dst, u64 size, u64 offset, u64 done) {
+    u64 end = offset + size;
+    if(end > journal->fileSize) end = journal->fileSize;
+    if(end <= offset) {
+        return 0;
     }
-
-    if(id < 0 || id > afs->header.entrycount) {
-        _afs_LogError("ERROR: afs_getEntryinfo - Entry ID out of range.");
-        _afs_LogErrorF("Entry ID: %d\tAFS entry count: %d\n", id, afs->header.entrycount);
-        return out;
+    // A short read before the end of the AFS file is a read error, behind it the file just isn't as large yet.
+    // Data behind a size the batch truncated the file to is gone, even if the read returned it.
+    u64 baseEnd = journal->baseSize < end ? journal->baseSize : end;
+    if(baseEnd > offset && done < baseEnd - offset) {
+        return done;
     }
+    u64 zeroStart = baseEnd > offset ? baseEnd : offset;
+    memset(dst + (zeroStart - offset), 0x00, end - zeroStart);
 
-    memcpy(&out, &afs->header.entryinfo[id], sizeof(AfsEntryInfo));
-    return out;
+    for(int i=_afs_journalFindExtent(journal, offset);i<journal->extentCount && journal->extents[i].offset < end;i++) {
+        AfsJournalExtent* e = &journal->extents[i];
+        u64 from = e->offset > offset ? e->offset : offset;
+        u64 to = e->offset + e->size < end ? e->offset + e->size : end;
+        if(from >= to) continue;
+        if(_afs_readFile(journal->fp, dst + (from - offset), to - from, e->data + (from - e->offset)) != to - from) {
+            _afs_LogError("ERROR: _afs_journalOverlay - Failed to read from the journal.");
+            return from - offset;
+        }
+    }
+    return end - offset;
 }
 
-int afs_extractEntryToFile(Afs* afs, int id, const char* folderpath, char* filepath) {
-    if(afs == NULL || afs->fstream == NULL) {
-        _afs_LogError("ERROR: afs_extractEntryToFile - Invalid AFS pointer (afs or afs->fstream).");
-        return 1;
+/** Reads a range of the AFS file into a buffer.
+ * This doesn't use or change the position of afs->fstream,
+ * which makes it safe to call from multiple threads at once.
+ * Served straight from the mapping if the AFS was opened with afs_openMapped(),
+ * and includes the journal batch that wasn't committed yet if the AFS was opened with AFS_OPEN_JOURNAL.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param dst Buffer that receives the data
+ * @param size Amount of bytes to read
+ * @param offset Offset within the AFS file
+ * @return The amount of bytes read.
+ */
+u64 _afs_readAt(Afs* afs, void* dst, u64 size, u64 offset) {
+    if(afs->internal->dryRun != NULL) {
+        afs->internal->dryRun->plan->bytesRead += size;
+        return size;
     }
-
-    if(id < 0 || id > afs->header.entrycount) {
-        _afs_LogError("ERROR: afs_extractEntryToFile - Entry ID out of range.");
-        _afs_LogErrorF("Entry ID: %d\tAFS entry count: %d\n", id, afs->header.entrycount);
-        return 2;
+    if(afs->internal->mapping != NULL) {
+        if(offset >= afs->internal->mappingSize) {
+            return 0;
+        }
+        if(size > afs->internal->mappingSize - offset) {
+            size = afs->internal->mappingSize - offset;
+        }
+        memcpy(dst, afs->internal->mapping + offset, size);
+        return size;
     }
 
-    if(folderpath == NULL || *folderpath == 0x00 ) {
-        _afs_LogError("ERROR: afs_extractEntryToFile - folderpath invalid.");
-        return 3;
+    u64 done = _afs_readFile(afs->fstream, dst, size, offset);
+    if(afs->internal->journal != NULL && afs->internal->journal->count > 0) {
+        done = _afs_journalOverlay(afs->internal->journal, (u8*)dst, size, offset, done);
+    }
+    return done;
+}
+
+/** Writes a buffer to a range of the AFS file.
+ * Like _afs_readAt(), this doesn't use or change the position of afs->fstream.
+ * If the AFS was opened with AFS_OPEN_JOURNAL, the data goes into the journal instead.
+ * While a rebuild writes a new file front to back, it goes through the bulk writer of that file.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param src Buffer containing the data
+ * @param size Amount of bytes to write
+ * @param offset Offset within the AFS file
+ * @return The amount of bytes written.
+ */
+u64 _afs_writeAt(Afs* afs, const void* src, u64 size, u64 offset) {
+    if(afs->internal->dryRun != NULL) {
+        afs->internal->dryRun->plan->bytesWritten += size;
+        if(offset + size > afs->internal->dryRun->fileSize) {
+            afs->internal->dryRun->fileSize = offset + size;
+        }
+        return size;
+    }
+    if(afs->internal->bulk != NULL) {
+        return _afs_bulkWrite(afs->internal->bulk, src, size, offset) == 0 ? size : 0;
+    }
+    if(afs->internal->journal != NULL) {
+        if(size == 0) {
+            return 0;
+        }
+        return _afs_journalAppend(afs->internal->journal, AFS_JOURNAL_WRITE, offset, size, src) == 0 ? size : 0;
+    }
+    u64 done = _afs_writeFile(afs->fstream, src, size, offset);
+    if(done != size) {
+        _afs_LogError("ERROR: _afs_writeAt - Failed to write to the AFS file.");
+    }
+    return done;
+}
+
+/** Gets the size of an opened file without moving its position.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param fp The file
+ * @return The size of the file in bytes.
+ */
+u64 _afs_getStreamSize(FILE* fp) {
+    #ifdef __unix__
+    struct stat st;
+    if(fstat(fileno(fp), &st) != 0) {
+        return 0;
+    }
+    return st.st_size;
+    #endif
+    #ifdef _WIN32
+    LARGE_INTEGER fsize;
+    if(!GetFileSizeEx((HANDLE)_get_osfhandle(_fileno(fp)), &fsize)) {
+        return 0;
+    }
+    return fsize.QuadPart;
+    #endif
+}
+
+/** Gets the current size of the AFS file.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @return The size of the file in bytes.
+ */
+u64 _afs_getFileSize(Afs* afs) {
+    if(afs->internal->dryRun != NULL) {
+        return afs->internal->dryRun->fileSize;
+    }
+    if(afs->internal->mapping != NULL) {
+        return afs->internal->mappingSize;
+    }
+    if(afs->internal->journal != NULL) {
+        return afs->internal->journal->fileSize;
+    }
+    return _afs_getStreamSize(afs->fstream);
+}
+
+/** Counts memory taken up (positive size) or given back (negative size) by a buffer during a dry run.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_trackMemory(Afs* afs, s64 size) {
+    if(afs->internal->dryRun == NULL) {
+        return;
+    }
+    afs->internal->dryRun->memory += size;
+    if(afs->internal->dryRun->memory > afs->internal->dryRun->plan->peakMemory) {
+        afs->internal->dryRun->plan->peakMemory = afs->internal->dryRun->memory;
+    }
+}
+
+/** Notes what happened with an entry during a dry run.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_setAction(Afs* afs, int id, AfsEditAction action) {
+    if(afs->internal->dryRun != NULL) {
+        afs->internal->dryRun->actions[id] = action;
+    }
+}
+
+/** Checks whether the AFS can be modified.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param caller Name of the calling function, used for the error message.
+ * @return true if the AFS is read-only, false otherwise.
+ */
+bool _afs_isReadOnly(Afs* afs, const char* caller) {
+    if(afs->openFlags & AFS_OPEN_READONLY) {
+        _afs_LogErrorF("ERROR: %s - AFS was opened read-only.\n", caller);
+        return true;
+    }
+    return false;
+}
+
+/** Checks whether a transaction is open on the AFS, for functions that can't be staged.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param caller Name of the calling function, used for the error message.
+ * @return true if a transaction is open, false otherwise.
+ */
+bool _afs_isInTransaction(Afs* afs, const char* caller) {
+    if(afs->internal->transaction != NULL) {
+        _afs_LogErrorF("ERROR: %s - Not possible while a transaction is open.\n", caller);
+        return true;
+    }
+    return false;
+}
+
+/** Gets the metadata array, reading it from the file first if the AFS was opened with AFS_OPEN_LAZYMETA.
+ * Safe to call from multiple threads, if two threads load it at the same time one of the copies is discarded.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @return The metadata array. Entries are zeroed if the metadata section couldn't be read.
+ */
+AfsEntryMetadata* _afs_getMeta(Afs* afs) {
+    #ifdef _WIN32
+    AfsEntryMetadata* meta = (AfsEntryMetadata*)InterlockedCompareExchangePointer((PVOID volatile*)&afs->meta, NULL, NULL);
+    #else
+    AfsEntryMetadata* meta = __atomic_load_n(&afs->meta, __ATOMIC_ACQUIRE);
+    #endif
+    if(meta != NULL) {
+        return meta;
+    }
+
+    // Some AFS files have a smaller (or no) metadata section,
+    // the buffer always covers every entry so indexing it stays safe.
+    AfsEntryInfo metaInfo = afs->header.entryinfo[afs->header.entrycount];
+    u64 bufferSize = (u64)afs->header.entrycount * sizeof(AfsEntryMetadata);
+    if(bufferSize < metaInfo.size) {
+        bufferSize = metaInfo.size;
+    }
+    meta = (AfsEntryMetadata*)calloc(1, bufferSize > 0 ? bufferSize : 1);
+    _afs_trackMemory(afs, bufferSize);
+    if(metaInfo.size > 0 && _afs_readAt(afs, meta, metaInfo.size, metaInfo.offset) != metaInfo.size) {
+        _afs_LogError("WARNING: _afs_getMeta - Metadata section couldn't be read completely.");
+    }
+
+    #ifdef _WIN32
+    AfsEntryMetadata* other = (AfsEntryMetadata*)InterlockedCompareExchangePointer((PVOID volatile*)&afs->meta, meta, NULL);
+    if(other != NULL) {
+        free(meta);
+        meta = other;
+    }
+    #else
+    AfsEntryMetadata* expected = NULL;
+    if(!__atomic_compare_exchange_n(&afs->meta, &expected, meta, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(meta);
+        meta = expected;
+    }
+    #endif
+    return meta;
+}
+
+/** Marks the entry info of entries first..last as changed in memory, it's written by the next _afs_flushDirty().
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_markInfoDirty(Afs* afs, int first, int last) {
+    if(first > last) {
+        return;
+    }
+    if(afs->internal->dirtyInfo == NULL) {
+        afs->internal->dirtyInfo = (u8*)calloc(afs->header.entrycount + 1, 1);
+    }
+    memset(afs->internal->dirtyInfo + first, 1, last + 1 - first);
+}
+
+/** Marks the metadata of entries first..last as changed in memory, it's written by the next _afs_flushDirty().
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_markMetaDirty(Afs* afs, int first, int last) {
+    if(first > last) {
+        return;
+    }
+    if(afs->internal->dirtyMeta == NULL) {
+        afs->internal->dirtyMeta = (u8*)calloc(afs->header.entrycount, 1);
+    }
+    memset(afs->internal->dirtyMeta + first, 1, last + 1 - first);
+}
+
+/** Forgets the dirty marks, for when the whole entry info or metadata section was just written anyway.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_clearDirty(Afs* afs, bool info, bool meta) {
+    if(info) {
+        free(afs->internal->dirtyInfo);
+        afs->internal->dirtyInfo = NULL;
+    }
+    if(meta) {
+        free(afs->internal->dirtyMeta);
+        afs->internal->dirtyMeta = NULL;
+    }
+}
+
+/** Writes the marked records of a table, one write for each run of consecutive records.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param dirty One mark per record
+ * @param amount Amount of records
+ * @param table The records in memory
+ * @param recordSize Size of one record
+ * @param offset Offset of the table in the AFS file
+ * @param maxGap Runs separated by at most this many clean records are written together,
+ * only possible if the clean records in memory are the same as in the file.
+ * @return 0 if successful, 5 if writing failed.
+ */
+int _afs_flushRecords(Afs* afs, const u8* dirty, int amount, const void* table, u64 recordSize, u64 offset, int maxGap) {
+    int ret = 0;
+    for(int i=0;i<amount;i++) {
+        if(!dirty[i]) continue;
+        int end = i;
+        int gap = 0;
+        while(end + gap < amount && gap <= maxGap) {
+            if(dirty[end + gap]) {
+                end += gap + 1;
+                gap = 0;
+            }
+            else {
+                gap++;
+            }
+        }
+        u64 start = (u64)i * recordSize;
+        u64 size = (u64)(end - i) * recordSize;
+        if(_afs_writeAt(afs, (const u8*)table + start, size, offset + start) != size) {
+            ret = 5;
+        }
+        i = end;
+    }
+    return ret;
+}
+
+/** Writes all entry info and metadata records that were changed in memory since the last flush, see afs_flush().
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @return 0 if successful, 5 if writing failed.
+ */
+int _afs_flushDirty(Afs* afs) {
+    if(afs->fstream == NULL) {
+        // The AFS file couldn't be reopened after a rebuild (see _afs_swapRebuiltFile())
+        return (afs->internal->dirtyInfo != NULL || afs->internal->dirtyMeta != NULL) ? 5 : 0;
+    }
+    int count = afs->header.entrycount;
+    AfsEntryInfo metaInfo = afs->header.entryinfo[count];
+    int ret = 0;
+    if(afs->internal->dirtyInfo != NULL) {
+        // Only the marked records are written, the ones in between can be in the middle of an edit that isn't finished yet
+        ret = _afs_flushRecords(afs, afs->internal->dirtyInfo, count + 1, afs->header.entryinfo, sizeof(AfsEntryInfo), 8, 0);
+    }
+    // Without a metadata section in the file, the metadata only exists in memory.
+    // It can differ from the file where it wasn't changed permanently, so only the marked records are written.
+    if(afs->internal->dirtyMeta != NULL && metaInfo.offset >= 8 + sizeof(AfsEntryInfo) * (count + 1)) {
+        if(_afs_flushRecords(afs, afs->internal->dirtyMeta, count, afs->meta, sizeof(AfsEntryMetadata), metaInfo.offset, 0) != 0) {
+            ret = 5;
+        }
+    }
+    _afs_clearDirty(afs, true, true);
+    return ret;
+}
+
+int _afs_journalCommit(Afs* afs);
+
+/** Writes the records marked dirty by a public function that changed the AFS, right before it returns,
+ * so the entry info and metadata in the file always match the data that was already written.
+ * With AFS_OPEN_JOURNAL, everything the function wrote is then committed as one batch,
+ * so the journal never holds more than a single edit.
+ * Inside a transaction nothing is written, afs_commit() writes everything at once.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param ret What the function returns so far
+ * @param failed What the function returns if writing fails
+ * @return ret, or failed if ret was 0 and writing the records failed.
+ */
+int _afs_endEdit(Afs* afs, int ret, int failed) {
+    if(afs->internal->transaction != NULL || afs->internal->committing) {
+        return ret;
+    }
+    if((_afs_flushDirty(afs) != 0 || _afs_journalCommit(afs) != 0) && ret == 0) {
+        _afs_LogError("ERROR: _afs_endEdit - Failed to write the entry info or metadata, the AFS might be damaged.");
+        return failed;
+    }
+    return ret;
+}
+
+/** Gets the size of the buffer used for chunked moves and copies.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+u64 _afs_getChunkSize(Afs* afs) {
+    return afs->internal->chunkSize > 0 ? afs->internal->chunkSize : AFS_COPYBUFFERSIZE;
+}
+
+/** Moves a range of the AFS file to another offset, the two ranges may overlap.
+ * The data goes through one buffer of the configured chunk size. When moving towards the end of the file,
+ * the range is copied starting at its end, so nothing gets overwritten before it was moved.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param src Current offset of the range
+ * @param dst New offset of the range
+ * @param size Size of the range
+ * @return 0 if successful, 1 if reading or writing failed.
+ */
+int _afs_moveRange(Afs* afs, u64 src, u64 dst, u64 size) {
+    if(src == dst || size == 0) {
+        return 0;
+    }
+
+    u64 bufferSize = _afs_getChunkSize(afs);
+    if(bufferSize > size) {
+        bufferSize = size;
+    }
+    if(afs->internal->dryRun != NULL) {
+        _afs_trackMemory(afs, bufferSize);
+        _afs_trackMemory(afs, -(s64)bufferSize);
+        afs->internal->dryRun->plan->bytesMoved += size;
+        _afs_readAt(afs, NULL, size, src);
+        _afs_writeAt(afs, NULL, size, dst);
+        return 0;
+    }
+    u8* buffer = (u8*)malloc(bufferSize);
+
+    int ret = 0;
+    u64 done = 0;
+    while(done < size) {
+        u64 chunk = size - done;
+        if(chunk > bufferSize) chunk = bufferSize;
+        u64 pos = (dst > src) ? size - done - chunk : done;
+
+        if(_afs_readAt(afs, buffer, chunk, src + pos) != chunk || _afs_writeAt(afs, buffer, chunk, dst + pos) != chunk) {
+            _afs_LogError("ERROR: _afs_moveRange - Failed to move data within the AFS.");
+            ret = 1;
+            break;
+        }
+        done += chunk;
+    }
+
+    free(buffer);
+    return ret;
+}
+
+/** Writes zeros to a range of the AFS file, see _afs_writeZerosFile().
+ * With a journal or in a dry run the zeros go through _afs_writeAt(), still straight from _afs_zeroBlock.
+ * A dry run without a journal counts them as cleared on Linux, like _afs_writeZerosFile() clears them there.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param offset Offset within the AFS file
+ * @param size Amount of bytes to clear
+ * @return 0 if successful, 1 if writing failed.
+ */
+int _afs_writeZeros(Afs* afs, u64 offset, u64 size) {
+    #ifdef __linux__
+    if(afs->internal->dryRun != NULL && afs->internal->journal == NULL) {
+        // The real run clears the range with fallocate(), nothing gets written
+        afs->internal->dryRun->plan->bytesZeroed += size;
+        if(offset + size > afs->internal->dryRun->fileSize) {
+            afs->internal->dryRun->fileSize = offset + size;
+        }
+        return 0;
+    }
+    #endif
+    if(afs->internal->dryRun == NULL && afs->internal->journal == NULL) {
+        if(_afs_writeZerosFile(afs->fstream, offset, size) != 0) {
+            _afs_LogError("ERROR: _afs_writeZeros - Failed to write to the AFS file.");
+            return 1;
+        }
+        return 0;
+    }
+    u64 done = 0;
+    while(done < size) {
+        u64 chunk = size - done;
+        if(chunk > AFS_ZEROBLOCKSIZE) chunk = AFS_ZEROBLOCKSIZE;
+        if(_afs_writeAt(afs, _afs_zeroBlock, chunk, offset + done) != chunk) {
+            return 1;
+        }
+        done += chunk;
+    }
+    return 0;
+}
+
+/** Calculates the reserved space for this entry.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param new_size The new size of the entry
+ * @return The amount of space that should be reserved for this entry.
+ */
+s64 _afs_calcReservedSpace(u64 new_size) {
+    if(AFS_RESERVEDSPACEBUFFER % 0x10 != 0) {
+        return -3;
+    }
+
+    s64 newReservedSpace = (new_size / AFS_RESERVEDSPACEBUFFER + 1) * AFS_RESERVEDSPACEBUFFER;
+
+    return newReservedSpace;
+}
+
+/** Rounds an offset up to the next multiple of AFS_RESERVEDSPACEBUFFER.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+u64 _afs_alignUp(u64 offset) {
+    return (offset + AFS_RESERVEDSPACEBUFFER - 1) / AFS_RESERVEDSPACEBUFFER * AFS_RESERVEDSPACEBUFFER;
+}
+
+/** Calculates the reserved space for an entry that is resized, including the headroom of the AFS (see afs_setGrowthHeadroom()).
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param old_reserved The space the entry had before
+ * @param new_size The new size of the entry
+ * @return The amount of space that should be reserved for this entry, never less than _afs_calcReservedSpace().
+ */
+u64 _afs_calcGrowthSpace(Afs* afs, u64 old_reserved, u64 new_size) {
+    u64 needed = _afs_calcReservedSpace(new_size);
+    u64 target = 0;
+    switch(afs->internal->headroomMode) {
+        case AFS_HEADROOM_NONE:
+            break;
+        case AFS_HEADROOM_FIXED:
+            target = new_size + afs->internal->headroomValue;
+            break;
+        case AFS_HEADROOM_PERCENT:
+            target = new_size + new_size / 100 * afs->internal->headroomValue + new_size % 100 * afs->internal->headroomValue / 100;
+            break;
+        case AFS_HEADROOM_GEOMETRIC:
+            target = old_reserved / 100 * (afs->internal->headroomValue > 100 ? afs->internal->headroomValue : 200);
+            break;
+    }
+    // Anything that can't be stored in an AFS anyway falls back to the plain reserved space
+    if(target > AFS_MAXOFFSET) {
+        return needed;
+    }
+    target = _afs_alignUp(target);
+    return target > needed ? target : needed;
+}
+
+/** Remembers the space reserved for an entry, so it isn't treated as free space (see _afs_getFreeExtents()).
+ * Nothing is stored as long as no entry has more space than it needs.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_setReservedSpace(Afs* afs, int id, u64 space) {
+    if(afs->internal->reservedSpace == NULL) {
+        if(space <= (u64)_afs_calcReservedSpace(afs->header.entryinfo[id].size)) {
+            return;
+        }
+        afs->internal->reservedSpace = (u64*)calloc(afs->header.entrycount, sizeof(u64));
+    }
+    afs->internal->reservedSpace[id] = space;
+}
+
+/** Gets the space an entry needs: what its size needs or what was reserved for it, whichever is larger.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+u64 _afs_getNeededSpace(Afs* afs, int id) {
+    u64 needed = _afs_calcReservedSpace(afs->header.entryinfo[id].size);
+    if(afs->internal->reservedSpace != NULL && afs->internal->reservedSpace[id] > needed) {
+        return afs->internal->reservedSpace[id];
+    }
+    return needed;
+}
+
+/** Checks whether an entry has space within the data section.
+ * Empty entries sometimes point into the header (usually offset 0), those don't take up any space.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+bool _afs_isPlaced(Afs* afs, int id) {
+    return afs->header.entryinfo[id].offset >= 8 + sizeof(AfsEntryInfo) * (afs->header.entrycount + 1);
+}
+
+/** Gets the offset where the space reserved for an entry ends,
+ * which is the offset of the next entry in the file or of the metadata section.
+ * Entries don't have to be stored in the order of their IDs.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ * @return The end offset of the entry's reserved space.
+ */
+u64 _afs_extentEnd(Afs* afs, int id) {
+    AfsEntryInfo* info = afs->header.entryinfo;
+    u64 offset = info[id].offset;
+    if(!_afs_isPlaced(afs, id)) {
+        return offset;
+    }
+    u64 end = info[afs->header.entrycount].offset;
+    for(int i=0;i<afs->header.entrycount;i++) {
+        if(info[i].offset > offset && info[i].offset < end) {
+            end = info[i].offset;
+        }
+    }
+    return end > offset ? end : offset;
+}
+
+void _afs_invalidateFreeExtents(Afs* afs);
+int _afs_writeSource(Afs* afs, const AfsEntrySource* source, u64 size, u64 offset, u8* buffer, u64 buffer_size);
+
+/** Replaces an entry within the AFS without resizing
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ * @param source Source of the new entry data
+ * @param data_size Size of the data, has to be smaller than the space reserved for the entry.
+ * @return 0 if successful, 1 if AFS is invalid, 2 if entry ID is out of range, 5 if reading the source or writing the AFS failed.
+ */
+int _afs_replaceEntry_noResize(Afs* afs, int id, const AfsEntrySource* source, u64 data_size) {
+    if(afs == NULL || afs->fstream == NULL) {
+        return 1;
+    }
+    if(id < 0 || id >= afs->header.entrycount) {
+        return 2;
+    }
+
+    // Space behind the entry that is larger than what it needs is left alone, it might be free space
+    u64 reservedSpace = _afs_extentEnd(afs, id) - afs->header.entryinfo[id].offset;
+    if(reservedSpace > (u64)_afs_calcReservedSpace(data_size)) {
+        reservedSpace = _afs_calcReservedSpace(data_size);
+    }
+    if(reservedSpace > (u64)_afs_calcReservedSpace(afs->header.entryinfo[id].size)) {
+        _afs_invalidateFreeExtents(afs);
+    }
+
+    // Buffers are written straight away, everything else goes through a chunk buffer
+    u64 bufferSize = (source->type == AFS_SOURCE_BUFFER) ? 0 : _afs_getChunkSize(afs);
+    u8* buffer = (bufferSize > 0) ? (u8*)malloc(bufferSize) : NULL;
+    _afs_trackMemory(afs, bufferSize);
+    int ret = 0;
+    u64 offset = afs->header.entryinfo[id].offset;
+    if(_afs_writeSource(afs, source, data_size, offset, buffer, bufferSize) != 0
+        || _afs_writeZeros(afs, offset + data_size, reservedSpace - data_size) != 0) {
+        ret = 5;
+    }
+    free(buffer);
+    _afs_trackMemory(afs, -(s64)bufferSize);
+
+    // The records are written together with the ones of other replaced entries by the next flush
+    afs->header.entryinfo[id].size = data_size;
+    _afs_markInfoDirty(afs, id, id);
+
+    AfsEntryMetadata* meta = _afs_getMeta(afs);
+    meta[id].filesize = data_size;
+    _afs_markMetaDirty(afs, id, id);
+
+    return ret;
+}
+
+/** Grows the reserved space of an entry by shifting everything behind it back, keeping the entry's data.
+ * This will change each offset for following entries!
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ * @param new_reserved The new reserved space, has to be larger than the current one.
+ * @return 0 if successful, 4 if the AFS would grow past AFS_MAXOFFSET, 5 if moving the data or writing the entry info failed.
+ */
+int _afs_growEntrySpace(Afs* afs, int id, u64 new_reserved) {
+    // Every offset has to stay within 32 bits, so this is checked before anything is changed.
+    AfsEntryInfo metaInfo = afs->header.entryinfo[afs->header.entrycount];
+    u64 oldOffsetNextEntry = _afs_extentEnd(afs, id);
+    u64 oldReservedSpace = oldOffsetNextEntry - afs->header.entryinfo[id].offset;
+    if((u64)metaInfo.offset + metaInfo.size - oldReservedSpace + new_reserved > AFS_MAXOFFSET) {
+        return 4;
+    }
+
+    // This loop moves every entry behind this one (and the metadata) back by the amount the entry grew.
+    u64 growth = new_reserved - oldReservedSpace;
+    for(int i=0; i <= afs->header.entrycount; i++) {
+        if(afs->header.entryinfo[i].offset >= oldOffsetNextEntry) {
+            afs->header.entryinfo[i].offset += growth;
+        }
+    }
+    _afs_invalidateFreeExtents(afs);
+
+    // Consider the AFS as one long line of data.
+    // This is splitting the AFS exactly where the entry is,
+    // Creating a Front part and a back part.
+
+    // This is the size of that back part
+    u64 backSize = _afs_getFileSize(afs) - oldOffsetNextEntry;
+
+    // This here moves the back part to its new position.
+    // It's streamed through a fixed-size buffer, so this doesn't need more memory for larger AFS files.
+    int ret = 0;
+    if(_afs_moveRange(afs, oldOffsetNextEntry, oldOffsetNextEntry + growth, backSize) != 0
+        || _afs_writeZeros(afs, oldOffsetNextEntry, growth) != 0) {
+        ret = 5;
+    }
+
+    // This here writes the new entry info into the header.
+    // If that fails, the new offsets stay marked in memory since the data already moved.
+    u64 infoSize = sizeof(AfsEntryInfo) * (afs->header.entrycount + 1);
+    if(_afs_writeAt(afs, afs->header.entryinfo, infoSize, 8) != infoSize) {
+        _afs_markInfoDirty(afs, 0, afs->header.entrycount);
+        ret = 5;
+    }
+    return ret;
+}
+
+/** Resizes the reserved space for the specified entry.
+ * The entry gets the headroom set with afs_setGrowthHeadroom(), unless that would grow the AFS past AFS_MAXOFFSET.
+ * The old data isn't cleared, the new data has to be written over all of it (it's at least as large as the old space).
+ * This will change each offset for following entries!
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ * @param new_size new reserved space for the entry, will be expanded to be 16-Byte aligned.
+ * @return 0 if successful, 1 if AFS is invalid, 2 if entry ID is out of range, 3 if AFS_RESERVEDSPACEBUFFER isn't 16-Byte aligned,
+ * 4 if the AFS would grow past AFS_MAXOFFSET, 5 if moving the data or writing the entry info failed.
+ */
+int _afs_resizeEntrySpace(Afs* afs, int id, u64 new_size) {
+    if(afs == NULL || afs->fstream == NULL) {
+        return 1;
+    }
+    if(id < 0 || id >= afs->header.entrycount) {
+        return 2;
+    }
+
+    s64 newReservedSpace = _afs_calcReservedSpace(new_size);
+    if(newReservedSpace < 0) {
+        return -newReservedSpace;
+    }
+    if(new_size > AFS_MAXOFFSET) {
+        return 4;
+    }
+
+    u64 oldReservedSpace = _afs_extentEnd(afs, id) - afs->header.entryinfo[id].offset;
+    u64 growthSpace = _afs_calcGrowthSpace(afs, oldReservedSpace, new_size);
+    int ret = _afs_growEntrySpace(afs, id, growthSpace);
+    if(ret == 4 && growthSpace > (u64)newReservedSpace) {
+        growthSpace = newReservedSpace;
+        ret = _afs_growEntrySpace(afs, id, growthSpace);
+    }
+    if(ret != 0) {
+        return ret;
+    }
+
+    // The space behind the old data was already cleared while growing
+    afs->header.entryinfo[id].size = new_size;
+    _afs_setReservedSpace(afs, id, growthSpace);
+    if(_afs_writeAt(afs, afs->header.entryinfo + id, sizeof(AfsEntryInfo), 8 + sizeof(AfsEntryInfo) * id) != sizeof(AfsEntryInfo)) {
+        _afs_markInfoDirty(afs, id, id);
+        return 5;
+    }
+    return 0;
+}
+
+
+/** Initializes a mutex.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_mutexInit(AfsMutex* mutex) {
+    #ifdef __unix__
+    pthread_mutex_init(mutex, NULL);
+    #endif
+    #ifdef _WIN32
+    InitializeCriticalSection(mutex);
+    #endif
+}
+void _afs_mutexLock(AfsMutex* mutex) {
+    #ifdef __unix__
+    pthread_mutex_lock(mutex);
+    #endif
+    #ifdef _WIN32
+    EnterCriticalSection(mutex);
+    #endif
+}
+void _afs_mutexUnlock(AfsMutex* mutex) {
+    #ifdef __unix__
+    pthread_mutex_unlock(mutex);
+    #endif
+    #ifdef _WIN32
+    LeaveCriticalSection(mutex);
+    #endif
+}
+void _afs_mutexDestroy(AfsMutex* mutex) {
+    #ifdef __unix__
+    pthread_mutex_destroy(mutex);
+    #endif
+    #ifdef _WIN32
+    DeleteCriticalSection(mutex);
+    #endif
+}
+
+/** Gets the amount of processors available to this process.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+int _afs_getCpuCount() {
+    int cpus = 1;
+    #ifdef __unix__
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    #endif
+    #ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    cpus = si.dwNumberOfProcessors;
+    #endif
+    return cpus > 0 ? cpus : 1;
+}
+
+#ifdef _WIN32
+typedef struct {
+    AfsWorkerFunc func;
+    void* arg;
+} AfsWorkerStart;
+
+DWORD WINAPI _afs_workerTrampoline(LPVOID param) {
+    AfsWorkerStart* start = (AfsWorkerStart*)param;
+    start->func(start->arg);
+    return 0;
+}
+#endif
+
+/** Runs the given function on multiple threads and waits for all of them to finish.
+ * The calling thread counts as one of the workers.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param threads Total amount of workers
+ * @param func The function every worker runs
+ * @param arg Argument passed to every worker
+ */
+void _afs_runWorkers(int threads, AfsWorkerFunc func, void* arg) {
+    if(threads <= 1) {
+        func(arg);
+        return;
+    }
+    int started = 0;
+    #ifdef __unix__
+    pthread_t* handles = (pthread_t*)malloc(sizeof(pthread_t) * (threads - 1));
+    while(started < threads - 1 && pthread_create(&handles[started], NULL, func, arg) == 0) {
+        started++;
+    }
+    func(arg);
+    for(int i=0;i<started;i++) {
+        pthread_join(handles[i], NULL);
+    }
+    #endif
+    #ifdef _WIN32
+    AfsWorkerStart start = { func, arg };
+    HANDLE* handles = (HANDLE*)malloc(sizeof(HANDLE) * (threads - 1));
+    while(started < threads - 1) {
+        handles[started] = CreateThread(NULL, 0, _afs_workerTrampoline, &start, 0, NULL);
+        if(handles[started] == NULL) break;
+        started++;
+    }
+    func(arg);
+    for(int i=0;i<started;i++) {
+        WaitForSingleObject(handles[i], INFINITE);
+        CloseHandle(handles[i]);
+    }
+    #endif
+    free(handles);
+}
+
+/** Copies a range of the AFS file into an output file.
+ * On Linux the data is moved inside the kernel with copy_file_range(),
+ * which shares extents instead of copying on reflink-capable filesystems,
+ * or with sendfile(). If neither works, the data is copied in chunks of
+ * the configured chunk size (see afs_setChunkSize()).
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param outfile The output file, only its file descriptor is used.
+ * @param offset Offset of the range within the AFS file
+ * @param size Size of the range
+ * @param buffer Pointer to a reusable chunk buffer (may point to NULL), allocated if the fallback needs it.
+ * @param buffer_size Pointer to the current size of that buffer.
+ * @return The amount of bytes copied, less than size if the range exceeds the AFS file.
+ */
+u64 _afs_copyToFile(Afs* afs, FILE* outfile, u64 offset, u64 size, u8** buffer, u64* buffer_size) {
+    u64 done = 0;
+
+    #ifdef __unix__
+    int outfd = fileno(outfile);
+
+    if(afs->internal->mapping != NULL) {
+        // Like afs_getEntryView(), nothing past the end of the mapping is touched, the result is short instead
+        if(offset >= afs->internal->mappingSize) {
+            return 0;
+        }
+        if(size > afs->internal->mappingSize - offset) {
+            size = afs->internal->mappingSize - offset;
+        }
+        while(done < size) {
+            ssize_t ret = write(outfd, afs->internal->mapping + offset + done, size - done);
+            if(ret < 0 && errno == EINTR) continue;
+            if(ret <= 0) break;
+            done += ret;
+        }
+        return done;
+    }
+
+    int infd = fileno(afs->fstream);
+
+    #ifdef __linux__
+    // A batch that's still in the journal isn't in the file yet, it's only seen by _afs_readAt()
+    bool inKernel = afs->internal->journal == NULL || afs->internal->journal->count == 0;
+    // Both calls take the input offset as a pointer,
+    // so the position of afs->fstream is never touched.
+    loff_t inOffset = offset;
+    while(inKernel && done < size) {
+        ssize_t ret = copy_file_range(infd, &inOffset, outfd, NULL, size - done, 0);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) break;
+        done += ret;
+    }
+    off_t sendOffset = offset + done;
+    while(inKernel && done < size) {
+        ssize_t ret = sendfile(outfd, infd, &sendOffset, size - done);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) break;
+        done += ret;
+    }
+    #endif
+    #endif
+
+    // Chunked copy through user space
+    while(done < size) {
+        u64 chunk = size - done;
+        if(chunk > _afs_getChunkSize(afs)) chunk = _afs_getChunkSize(afs);
+        if(*buffer_size < chunk) {
+            free(*buffer);
+            *buffer = (u8*)malloc(chunk);
+            *buffer_size = chunk;
+        }
+        u64 got = _afs_readAt(afs, *buffer, chunk, offset + done);
+        if(got == 0) break;
+        #ifdef __unix__
+        u64 written = 0;
+        while(written < got) {
+            ssize_t ret = write(outfd, *buffer + written, got - written);
+            if(ret < 0 && errno == EINTR) continue;
+            if(ret <= 0) break;
+            written += ret;
+        }
+        #endif
+        #ifdef _WIN32
+        u64 written = fwrite(*buffer, 1, got, outfile);
+        #endif
+        done += written;
+        if(written != got) break;
+    }
+
+    return done;
+}
+
+/** Writes the data of an entry into a new file and applies its timestamp.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ * @param outpath Path of the output file
+ * @param buffer Pointer to a reusable chunk buffer (may point to NULL), see _afs_copyToFile().
+ * @param buffer_size Pointer to the current size of that buffer.
+ * @return 0 if successful, 1 if the file couldn't be created, 2 if the data couldn't be copied.
+ */
+int _afs_writeEntryToFile(Afs* afs, int id, char* outpath, u8** buffer, u64* buffer_size) {
+    AfsEntryInfo info = afs->header.entryinfo[id];
+
+    FILE* outfile = fopen(outpath, "wb");
+    if(outfile == NULL) {
+        return 1;
+    }
+
+    int ret = 0;
+    if(_afs_copyToFile(afs, outfile, info.offset, info.size, buffer, buffer_size) != info.size) {
+        ret = 2;
+    }
+    fclose(outfile);
+
+    // Set the correct last modified date
+    _afs_ApplyTimestamp(outpath, _afs_getMeta(afs)[id].lastModified);
+    return ret;
+}
+
+/** Hash set of strings, used to keep track of the output paths
+ * that were already handed out during one extraction.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+typedef struct {
+    const char** slots;
+    u32 mask;
+} AfsNameSet;
+
+u32 _afs_hashName(const char* name) {
+    // FNV-1a
+    u32 hash = 2166136261u;
+    while(*name) {
+        hash ^= (u8)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/** Checks whether the name is in the set.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+bool _afs_nameSetContains(AfsNameSet* set, const char* name) {
+    u32 i = _afs_hashName(name) & set->mask;
+    while(set->slots[i] != NULL) {
+        if(strcmp(set->slots[i], name) == 0) return true;
+        i = (i + 1) & set->mask;
+    }
+    return false;
+}
+
+/** Adds a name to the set. The string is not copied and has to outlive the set.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_nameSetAdd(AfsNameSet* set, const char* name) {
+    u32 i = _afs_hashName(name) & set->mask;
+    while(set->slots[i] != NULL) {
+        i = (i + 1) & set->mask;
+    }
+    set->slots[i] = name;
+}
+
+/** Creates the output file paths for a list of entries.
+ * Names that are already taken, either by an existing file or by another
+ * entry of this list, get a counter appended: "name(1).ext", "name(2).ext", ...
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param dir The output folder, must end with PATH_SEP.
+ * @param ids Array of entry IDs
+ * @param count Amount of entries
+ * @return Array of count paths. Each path and the array itself must be freed.
+ */
+char** _afs_createExtractPaths(Afs* afs, const char* dir, const int* ids, int count) {
+    int pathlen = strlen(dir);
+    // name + "(counter)" + terminator
+    int bufsize = pathlen + AFSMETA_NAMEBUFFERSIZE + 16;
+
+    char** paths = (char**)malloc(sizeof(char*) * (count > 0 ? count : 1));
+
+    AfsNameSet taken;
+    u32 capacity = 16;
+    while(capacity < (u32)count * 2) capacity <<= 1;
+    taken.slots = (const char**)calloc(capacity, sizeof(char*));
+    taken.mask = capacity - 1;
+
+    AfsEntryMetadata* meta = _afs_getMeta(afs);
+    for(int i=0;i<count;i++) {
+        int id = ids[i];
+        char* filepath = (char*)malloc(bufsize);
+        strcpy(filepath, dir);
+
+        char name[AFSMETA_NAMEBUFFERSIZE + 1];
+        if(*meta[id].filename == 0x00) {
+            snprintf(name, AFSMETA_NAMEBUFFERSIZE, "blank_%d", id);
+        }
+        else {
+            memcpy(name, meta[id].filename, AFSMETA_NAMEBUFFERSIZE);
+            name[AFSMETA_NAMEBUFFERSIZE] = 0x00;
+        }
+        strcat(filepath, name);
+
+        int fcnt = 1;
+        // file already exists
+        while(_afs_nameSetContains(&taken, filepath) || access(filepath, F_OK) == 0) {
+            // we need to check whether this file has an extension
+            char* ext = strrchr(name, '.');
+            if(ext != NULL) {
+                snprintf(filepath + pathlen, bufsize - pathlen, "%.*s(%d)%s", (int)(ext-name), name, fcnt++, ext);
+            }
+            else {
+                snprintf(filepath + pathlen, bufsize - pathlen, "%s(%d)", name, fcnt++);
+            }
+        }
+
+        _afs_nameSetAdd(&taken, filepath);
+        paths[i] = filepath;
+    }
+
+    free(taken.slots);
+    return paths;
+}
+
+typedef struct {
+    Afs* afs;
+    const int* ids;
+    char** paths;
+    int count;
+    int next;
+    int failed;
+    AfsMutex lock;
+} AfsExtractContext;
+
+/** Worker for multi-entry extraction, takes jobs from the context until none are left.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void* _afs_extractWorker(void* arg) {
+    AfsExtractContext* ctx = (AfsExtractContext*)arg;
+    u8* buffer = NULL;
+    u64 bufferSize = 0;
+
+    while(true) {
+        _afs_mutexLock(&ctx->lock);
+        int job = ctx->next++;
+        _afs_mutexUnlock(&ctx->lock);
+        if(job >= ctx->count) break;
+
+        int ret = _afs_writeEntryToFile(ctx->afs, ctx->ids[job], ctx->paths[job], &buffer, &bufferSize);
+        if(ret != 0) {
+            _afs_LogError("ERROR: afs_extractFull - Failed to extract entry.");
+            _afs_LogErrorF("filepath: %s\n", ctx->paths[job]);
+            _afs_mutexLock(&ctx->lock);
+            ctx->failed++;
+            _afs_mutexUnlock(&ctx->lock);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+#ifdef AFS_HAVE_IOURING
+/** Maximum amount of entries that are submitted in one io_uring batch. */
+#define AFS_URING_BATCHENTRIES 64
+/** Maximum amount of entry data buffered for one io_uring batch. */
+#define AFS_URING_BATCHBYTES (AFS_COPYBUFFERSIZE * 8)
+/** user_data of a request: the chain it belongs to and its opcode. */
+#define AFS_URING_USERDATA(chain, op) (((u64)(chain) << 8) | (op))
+#define AFS_URING_BATCHOF(data) ((int)((data) >> 8))
+#define AFS_URING_OPOF(data) ((u8)((data) & 0xFF))
+
+/** Minimal io_uring instance, set up with the raw syscalls.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+typedef struct {
+    int fd;
+    u32* sqHead;
+    u32* sqTail;
+    u32* sqMask;
+    u32* sqArray;
+    struct io_uring_sqe* sqes;
+    u32* cqHead;
+    u32* cqTail;
+    u32* cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+} AfsUring;
+
+/** Tears down an io_uring instance created by _afs_uringInit().
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_uringFree(AfsUring* ring) {
+    if(ring->sqes != NULL) munmap(ring->sqes, ring->sqesSize);
+    if(ring->cqRing != NULL && ring->cqRing != ring->sqRing) munmap(ring->cqRing, ring->cqRingSize);
+    if(ring->sqRing != NULL) munmap(ring->sqRing, ring->sqRingSize);
+    if(ring->fd >= 0) close(ring->fd);
+    memset(ring, 0x00, sizeof(AfsUring));
+    ring->fd = -1;
+}
+
+/** Creates an io_uring instance with a sparse table of direct descriptors,
+ * one per entry of a batch.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param ring The ring to set up
+ * @param entries Amount of submission queue entries
+ * @return 0 if successful, 1 if io_uring (or the needed features) isn't available.
+ */
+int _afs_uringInit(AfsUring* ring, u32 entries) {
+    memset(ring, 0x00, sizeof(AfsUring));
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0x00, sizeof(struct io_uring_params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(fd < 0) {
+        return 1;
+    }
+    ring->fd = fd;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(u32);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cqRingSize > ring->sqRingSize) ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    void* sq = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED) {
+        _afs_uringFree(ring);
+        return 1;
+    }
+    ring->sqRing = sq;
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = sq;
+    }
+    else {
+        void* cq = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(cq == MAP_FAILED) {
+            _afs_uringFree(ring);
+            return 1;
+        }
+        ring->cqRing = cq;
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        _afs_uringFree(ring);
+        return 1;
+    }
+    ring->sqes = (struct io_uring_sqe*)sqes;
+
+    u8* sqBase = (u8*)ring->sqRing;
+    ring->sqHead = (u32*)(sqBase + params.sq_off.head);
+    ring->sqTail = (u32*)(sqBase + params.sq_off.tail);
+    ring->sqMask = (u32*)(sqBase + params.sq_off.ring_mask);
+    ring->sqArray = (u32*)(sqBase + params.sq_off.array);
+    u8* cqBase = (u8*)ring->cqRing;
+    ring->cqHead = (u32*)(cqBase + params.cq_off.head);
+    ring->cqTail = (u32*)(cqBase + params.cq_off.tail);
+    ring->cqMask = (u32*)(cqBase + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cqBase + params.cq_off.cqes);
+
+    // Output files are opened into direct descriptors,
+    // so the write and close can be linked to the open.
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0x00, sizeof(struct io_uring_rsrc_register));
+    reg.nr = AFS_URING_BATCHENTRIES;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES2, &reg, sizeof(reg)) < 0) {
+        _afs_uringFree(ring);
+        return 1;
+    }
+
+    return 0;
+}
+
+/** Gets the next free submission queue entry. The ring must have room for it.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+struct io_uring_sqe* _afs_uringGetSqe(AfsUring* ring) {
+    u32 tail = *ring->sqTail;
+    u32 index = tail & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0x00, sizeof(struct io_uring_sqe));
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/** Submits all queued entries and waits until the given amount of completions arrived.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @return 0 if successful, 1 if io_uring_enter failed.
+ */
+int _afs_uringSubmitAndWait(AfsUring* ring, u32 submit, u32 wait) {
+    while(submit > 0 || wait > 0) {
+        u32 ready = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) - *ring->cqHead;
+        u32 minComplete = (wait > ready) ? wait - ready : 0;
+        int ret = syscall(__NR_io_uring_enter, ring->fd, submit, minComplete, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(ret < 0) {
+            if(errno == EINTR) continue;
+            return 1;
+        }
+        submit -= ret;
+        ready = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) - *ring->cqHead;
+        if(submit == 0 && ready >= wait) break;
+    }
+    return 0;
+}
+
+/** Waits until every request the kernel took from the submission queue has completed, then discards the completions.
+ * Used after _afs_uringSubmitAndWait() failed: until then, the requests might still read into or write from
+ * the batch buffer and write the output files. If waiting through io_uring_enter fails as well,
+ * the completion queue is polled, the kernel posts the completions whenever the thread returns from a syscall.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param ring The ring
+ * @param submitted Amount of requests that were submitted, every one of them produces exactly one completion.
+ */
+void _afs_uringDrain(AfsUring* ring, u32 submitted) {
+    while(__atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) - *ring->cqHead < submitted) {
+        u32 ready = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) - *ring->cqHead;
+        if(syscall(__NR_io_uring_enter, ring->fd, 0, submitted - ready, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            struct timespec delay = { 0, 1000000 };
+            nanosleep(&delay, NULL);
+        }
+    }
+    __atomic_store_n(ring->cqHead, __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+/** Extracts the entries of an extraction context with io_uring.
+ * Each entry becomes one linked chain: open the output file, read the entry,
+ * write it out and close the file. A batch of chains is submitted with one syscall.
+ * Entries that don't fit into a batch buffer are extracted the regular way.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param ctx The extraction context
+ * @return 0 if successful, 1 if io_uring isn't available or failed midway.
+ * Then the entries from ctx->next onwards weren't extracted yet.
+ */
+int _afs_extractUring(AfsExtractContext* ctx) {
+    // io_uring reads the file directly, a batch that's still in the journal would be missed
+    if(ctx->afs->internal->journal != NULL && ctx->afs->internal->journal->count > 0) {
+        return 1;
+    }
+    AfsUring ring;
+    if(_afs_uringInit(&ring, AFS_URING_BATCHENTRIES * 4) != 0) {
+        return 1;
+    }
+
+    Afs* afs = ctx->afs;
+    bool mapped = afs->internal->mapping != NULL;
+    int infd = fileno(afs->fstream);
+    u8* arena = mapped ? NULL : (u8*)malloc(AFS_URING_BATCHBYTES);
+    int batchJobs[AFS_URING_BATCHENTRIES];
+    bool chainFailed[AFS_URING_BATCHENTRIES];
+    u8* fallbackBuffer = NULL;
+    u64 fallbackBufferSize = 0;
+
+    int job = 0;
+    while(job < ctx->count) {
+        int batch = 0;
+        u32 queued = 0;
+        u64 arenaUsed = 0;
+
+        while(job < ctx->count && batch < AFS_URING_BATCHENTRIES) {
+            AfsEntryInfo info = afs->header.entryinfo[ctx->ids[job]];
+            bool outside = mapped && (u64)info.offset + info.size > afs->internal->mappingSize;
+            if((!mapped && info.size > AFS_URING_BATCHBYTES) || outside) {
+                // Too large to buffer or past the end of the mapping, this one goes through the regular path
+                if(_afs_writeEntryToFile(afs, ctx->ids[job], ctx->paths[job], &fallbackBuffer, &fallbackBufferSize) != 0) {
+                    _afs_LogError("ERROR: afs_extractFull - Failed to extract entry.");
+                    _afs_LogErrorF("filepath: %s\n", ctx->paths[job]);
+                    ctx->failed++;
+                }
+                job++;
+                continue;
+            }
+            if(!mapped && arenaUsed + info.size > AFS_URING_BATCHBYTES) break;
+
+            u8* data = mapped ? afs->internal->mapping + info.offset : arena + arenaUsed;
+            arenaUsed += info.size;
+
+            struct io_uring_sqe* sqe = _afs_uringGetSqe(&ring);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (u64)(size_t)ctx->paths[job];
+            sqe->len = 0666;
+            sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+            sqe->file_index = batch + 1;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = AFS_URING_USERDATA(batch, IORING_OP_OPENAT);
+
+            if(!mapped) {
+                sqe = _afs_uringGetSqe(&ring);
+                sqe->opcode = IORING_OP_READ;
+                sqe->fd = infd;
+                sqe->addr = (u64)(size_t)data;
+                sqe->len = info.size;
+                sqe->off = info.offset;
+                sqe->flags = IOSQE_IO_LINK;
+                sqe->user_data = AFS_URING_USERDATA(batch, IORING_OP_READ);
+            }
+
+            sqe = _afs_uringGetSqe(&ring);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = batch;
+            sqe->addr = (u64)(size_t)data;
+            sqe->len = info.size;
+            sqe->off = 0;
+            // The close has to run even if the write fails
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+            sqe->user_data = AFS_URING_USERDATA(batch, IORING_OP_WRITE);
+
+            sqe = _afs_uringGetSqe(&ring);
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->file_index = batch + 1;
+            sqe->user_data = AFS_URING_USERDATA(batch, IORING_OP_CLOSE);
+
+            chainFailed[batch] = false;
+            batchJobs[batch] = job;
+            queued += mapped ? 3 : 4;
+            batch++;
+            job++;
+        }
+
+        if(queued == 0) continue;
+
+        u32 sqHead = __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+        bool submitFailed = _afs_uringSubmitAndWait(&ring, queued, queued) != 0;
+        if(submitFailed) {
+            _afs_LogError("WARNING: afs_extractFull - io_uring_enter failed, the remaining entries are extracted the regular way.");
+            // Nothing is redone before the requests that made it into the kernel are finished,
+            // they could still write the same output files
+            _afs_uringDrain(&ring, __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) - sqHead);
+            for(int b=0;b<batch;b++) {
+                chainFailed[b] = true;
+            }
+        }
+        else {
+            // Every submitted request produces exactly one completion,
+            // a chain only succeeded if all of its requests did and the read and write weren't short.
+            u32 head = *ring.cqHead;
+            u32 tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+            while(head != tail) {
+                struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cqMask];
+                int b = AFS_URING_BATCHOF(cqe->user_data);
+                u8 op = AFS_URING_OPOF(cqe->user_data);
+                if(cqe->res < 0 || ((op == IORING_OP_READ || op == IORING_OP_WRITE)
+                    && (u32)cqe->res != afs->header.entryinfo[ctx->ids[batchJobs[b]]].size)) {
+                    chainFailed[b] = true;
+                }
+                head++;
+            }
+            __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+        }
+
+        for(int b=0;b<batch;b++) {
+            int j = batchJobs[b];
+            if(chainFailed[b]) {
+                // The chain is redone the regular way, which continues short reads and writes
+                if(_afs_writeEntryToFile(afs, ctx->ids[j], ctx->paths[j], &fallbackBuffer, &fallbackBufferSize) != 0) {
+                    _afs_LogError("ERROR: afs_extractFull - Failed to extract entry.");
+                    _afs_LogErrorF("filepath: %s\n", ctx->paths[j]);
+                    ctx->failed++;
+                }
+                continue;
+            }
+            // Apply the Timestamp from the metadata section
+            _afs_ApplyTimestamp(ctx->paths[j], _afs_getMeta(afs)[ctx->ids[j]].lastModified);
+        }
+
+        if(submitFailed) {
+            // The entries that weren't queued yet are left to the thread pool
+            free(fallbackBuffer);
+            free(arena);
+            _afs_uringFree(&ring);
+            ctx->next = job;
+            return 1;
+        }
+    }
+
+    free(fallbackBuffer);
+    free(arena);
+    _afs_uringFree(&ring);
+    return 0;
+}
+#endif
+
+/** Extracts all entries of an extraction context with the I/O backend selected for the AFS.
+ * Falls back to the thread pool if io_uring isn't available, or for the entries left when it fails midway.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param ctx The extraction context
+ * @param threads Amount of worker threads for the thread pool, 0 for one per processor.
+ */
+void _afs_runExtract(AfsExtractContext* ctx, int threads) {
+    #ifdef AFS_HAVE_IOURING
+    if(ctx->afs->internal->ioBackend == AFS_IOBACKEND_IOURING && _afs_extractUring(ctx) == 0) {
+        return;
+    }
+    #endif
+
+    if(threads <= 0) {
+        threads = _afs_getCpuCount();
+    }
+    if(threads > ctx->count) {
+        threads = ctx->count;
+    }
+    _afs_runWorkers(threads, _afs_extractWorker, ctx);
+}
+
+/** Creates the output folder if it doesn't exist yet.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param folderpath The path to the folder
+ * @return Copy of the path that is guaranteed to end with PATH_SEP, must be freed.
+ */
+char* _afs_createOutputDir(const char* folderpath) {
+    // In order to ensure each file path will be concatenated correctly,
+    // we must ensure the folder path ends with a '/' character.
+    int pathlen = strlen(folderpath);
+    char* dir = (char*)malloc(pathlen+2);
+    memset(dir, 0x00, pathlen+2);
+    strcpy(dir, folderpath);
+
+    if(folderpath[pathlen-1] != PATH_SEP) {
+        dir[pathlen++] = PATH_SEP;
+    }
+
+    if(access(dir, F_OK) != 0) {
+        mkdir(dir);
+    }
+    return dir;
+}
+
+/** Sort key used to order entries by their position within the AFS file.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+typedef struct {
+    u64 offset;
+    int index;
+} AfsSortKey;
+
+int _afs_compareSortKey(const void* a, const void* b) {
+    const AfsSortKey* ka = (const AfsSortKey*)a;
+    const AfsSortKey* kb = (const AfsSortKey*)b;
+    if(ka->offset != kb->offset) return (ka->offset < kb->offset) ? -1 : 1;
+    return ka->index - kb->index;
+}
+
+/** Largest gap between two entries that is read over instead of starting a new read. */
+#define AFS_EXTRACT_MERGEGAP 0x10000
+/** Largest span of the AFS file that is read at once when merging entries. */
+#define AFS_EXTRACT_WINDOW (AFS_COPYBUFFERSIZE * 8)
+
+/** Extracts the entries of an extraction context in the order they are listed,
+ * which is expected to be sorted by offset. Neighbouring entries are read
+ * with a single read and then written out one after another.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param ctx The extraction context, the entries from ctx->next onwards are extracted.
+ */
+void _afs_extractMerged(AfsExtractContext* ctx) {
+    Afs* afs = ctx->afs;
+    u8* window = NULL;
+    u8* buffer = NULL;
+    u64 bufferSize = 0;
+
+    int job = ctx->next;
+    while(job < ctx->count) {
+        AfsEntryInfo first = afs->header.entryinfo[ctx->ids[job]];
+        if(afs->internal->mapping != NULL || first.size > AFS_EXTRACT_WINDOW) {
+            // Nothing to gain from merging, the entry is copied on its own
+            if(_afs_writeEntryToFile(afs, ctx->ids[job], ctx->paths[job], &buffer, &bufferSize) != 0) {
+                _afs_LogError("ERROR: afs_extractEntries - Failed to extract entry.");
+                _afs_LogErrorF("filepath: %s\n", ctx->paths[job]);
+                ctx->failed++;
+            }
+            job++;
+            continue;
+        }
+
+        // Find the run of entries that can be read together
+        u64 runStart = first.offset;
+        u64 runEnd = (u64)first.offset + first.size;
+        int last = job + 1;
+        while(last < ctx->count) {
+            AfsEntryInfo next = afs->header.entryinfo[ctx->ids[last]];
+            u64 nextEnd = (u64)next.offset + next.size;
+            if(next.offset > runEnd + AFS_EXTRACT_MERGEGAP) break;
+            if((nextEnd > runEnd ? nextEnd : runEnd) - runStart > AFS_EXTRACT_WINDOW) break;
+            if(nextEnd > runEnd) runEnd = nextEnd;
+            last++;
+        }
+
+        if(window == NULL) {
+            window = (u8*)malloc(AFS_EXTRACT_WINDOW);
+        }
+        u64 got = _afs_readAt(afs, window, runEnd - runStart, runStart);
+
+        for(;job < last;job++) {
+            int id = ctx->ids[job];
+            AfsEntryInfo info = afs->header.entryinfo[id];
+            FILE* outfile = fopen(ctx->paths[job], "wb");
+            bool failed = outfile == NULL || (u64)info.offset + info.size - runStart > got;
+            if(!failed) {
+                // Whatever is left in the stdio buffer is only written by fclose()
+                failed = fwrite(window + (info.offset - runStart), 1, info.size, outfile) != info.size;
+            }
+            if(outfile != NULL && fclose(outfile) != 0) {
+                failed = true;
+            }
+            if(failed) {
+                _afs_LogError("ERROR: afs_extractEntries - Failed to extract entry.");
+                _afs_LogErrorF("filepath: %s\n", ctx->paths[job]);
+                ctx->failed++;
+                continue;
+            }
+            // Apply the Timestamp from the metadata section
+            _afs_ApplyTimestamp(ctx->paths[job], _afs_getMeta(afs)[id].lastModified);
+        }
+    }
+
+    free(window);
+    free(buffer);
+}
+
+/** Gets the filename part of a path, accepting both '/' and '\\' as separators.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+const char* _afs_getFilename(const char* path) {
+    const char* unix_fname = strrchr(path, '/');
+    const char* win_fname = strrchr(path, '\\');
+    if(win_fname > unix_fname) return win_fname + 1;
+    if(unix_fname != NULL) return unix_fname + 1;
+    return path;
+}
+
+/** Gets the size of the data a source provides.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param source The source
+ * @param size Receives the size
+ * @return true if successful, false if the source is invalid or its file isn't accessible.
+ */
+bool _afs_getSourceSize(const AfsEntrySource* source, u64* size) {
+    switch(source->type) {
+        case AFS_SOURCE_FILE: {
+            if(source->filepath == NULL) return false;
+            FILE* fp = fopen(source->filepath, "rb");
+            if(fp == NULL) return false;
+            *size = _afs_getStreamSize(fp);
+            fclose(fp);
+            return true;
+        }
+        case AFS_SOURCE_BUFFER:
+            *size = source->size;
+            return source->data != NULL || source->size == 0;
+        case AFS_SOURCE_CALLBACK:
+            *size = source->size;
+            return source->read != NULL;
+    }
+    return false;
+}
+
+/** Streams the data of a source into the AFS file.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param source The source
+ * @param size Amount of bytes to take from the source
+ * @param offset Offset within the AFS file
+ * @param buffer Chunk buffer used for files and callbacks
+ * @param buffer_size Size of that buffer
+ * @return 0 if successful, 1 if reading the source or writing the AFS failed.
+ */
+int _afs_writeSource(Afs* afs, const AfsEntrySource* source, u64 size, u64 offset, u8* buffer, u64 buffer_size) {
+    if(afs->internal->dryRun != NULL) {
+        if(source->type != AFS_SOURCE_BUFFER) {
+            afs->internal->dryRun->plan->bytesRead += size;
+        }
+        _afs_writeAt(afs, NULL, size, offset);
+        return 0;
+    }
+    if(source->type == AFS_SOURCE_BUFFER) {
+        return _afs_writeAt(afs, source->data, size, offset) != size;
+    }
+
+    FILE* fp = NULL;
+    if(source->type == AFS_SOURCE_FILE) {
+        fp = fopen(source->filepath, "rb");
+        if(fp == NULL) {
+            return 1;
+        }
+    }
+
+    int ret = 0;
+    u64 done = 0;
+    while(done < size) {
+        u64 chunk = size - done;
+        if(chunk > buffer_size) chunk = buffer_size;
+        s64 got;
+        if(fp != NULL) {
+            got = fread(buffer, 1, chunk, fp);
+        }
+        else {
+            got = source->read(source->userdata, buffer, done, chunk);
+        }
+        if(got <= 0 || (u64)got > chunk || _afs_writeAt(afs, buffer, got, offset + done) != (u64)got) {
+            ret = 1;
+            break;
+        }
+        done += got;
+    }
+
+    if(fp != NULL) {
+        fclose(fp);
+    }
+    return ret;
+}
+
+/** Gets the entries of the AFS sorted by their offset, which is the order the rebuild works in.
+ * Entries that aren't placed (see _afs_isPlaced()) are left out.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param amount Receives the amount of entries in the array
+ * @return Array of indices with room for entrycount elements, must be freed.
+ */
+int* _afs_getOffsetOrder(Afs* afs, int* amount) {
+    int count = afs->header.entrycount;
+    AfsSortKey* keys = (AfsSortKey*)malloc(sizeof(AfsSortKey) * (count > 0 ? count : 1));
+    _afs_trackMemory(afs, sizeof(AfsSortKey) * count);
+    int placed = 0;
+    for(int i=0;i<count;i++) {
+        if(!_afs_isPlaced(afs, i)) continue;
+        keys[placed].offset = afs->header.entryinfo[i].offset;
+        keys[placed].index = i;
+        placed++;
+    }
+    qsort(keys, placed, sizeof(AfsSortKey), _afs_compareSortKey);
+
+    int* order = (int*)malloc(sizeof(int) * (count > 0 ? count : 1));
+    _afs_trackMemory(afs, sizeof(int) * count);
+    for(int i=0;i<placed;i++) {
+        order[i] = keys[i].index;
+    }
+    free(keys);
+    _afs_trackMemory(afs, -(s64)(sizeof(AfsSortKey) * count));
+    *amount = placed;
+    return order;
+}
+
+/** Gets the space reserved for an entry, which is the distance to the next entry (or the metadata section).
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param info The entry info array
+ * @param count The entry count
+ * @param order The entries sorted by offset
+ * @param amount The amount of entries in order
+ * @param pos Position of the entry within order
+ */
+u64 _afs_getReservedSpace(const AfsEntryInfo* info, int count, const int* order, int amount, int pos) {
+    u64 next = (pos + 1 < amount) ? info[order[pos+1]].offset : info[count].offset;
+    return next - info[order[pos]].offset;
+}
+
+/** Calculates the layout after replacing entries: every entry stays in the same order,
+ * replaced entries get a new reserved space for their new size and everything behind them shifts.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * Replaced entries that weren't placed yet are added behind the last entry,
+ * and appended to order.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param order The entries sorted by offset
+ * @param amount The amount of entries in order, grows if entries were appended.
+ * @param sources Source for each entry, NULL if the entry is kept
+ * @param sizes New size for each replaced entry
+ * @param newInfo Receives the new entry info array (entrycount + 1 elements)
+ * @param headroom Whether replaced entries get headroom and keep reservations (see afs_setGrowthHeadroom(), afs_reserveEntry())
+ * @return The end offset of the metadata section in the new layout.
+ */
+u64 _afs_planSequential(Afs* afs, int* order, int* amount, const AfsEntrySource** sources, const u64* sizes, AfsEntryInfo* newInfo, bool headroom) {
+    int count = afs->header.entrycount;
+    AfsEntryInfo* oldInfo = afs->header.entryinfo;
+    memcpy(newInfo, oldInfo, sizeof(AfsEntryInfo) * (count + 1));
+
+    int placed = *amount;
+    u64 curOffset = (placed > 0) ? oldInfo[order[0]].offset : oldInfo[count].offset;
+    for(int pos=0;pos<placed;pos++) {
+        int id = order[pos];
+        u64 oldReserved = _afs_getReservedSpace(oldInfo, count, order, placed, pos);
+        newInfo[id].offset = curOffset;
+        if(sources[id] == NULL) {
+            newInfo[id].size = oldInfo[id].size;
+            curOffset += oldReserved;
+            continue;
+        }
+        newInfo[id].size = sizes[id];
+        u64 space = _afs_calcReservedSpace(sizes[id]);
+        if(headroom) {
+            if(sizes[id] >= oldReserved) {
+                space = _afs_calcGrowthSpace(afs, oldReserved, sizes[id]);
+            }
+            else if(afs->internal->headroomMode != AFS_HEADROOM_NONE) {
+                // Entries that got smaller keep their space, they might grow again
+                space = oldReserved;
+            }
+            if(afs->internal->reservedSpace != NULL && afs->internal->reservedSpace[id] > space) {
+                space = afs->internal->reservedSpace[id];
+            }
+        }
+        curOffset += space;
+    }
+    for(int id=0;id<count;id++) {
+        if(sources[id] == NULL || _afs_isPlaced(afs, id)) continue;
+        order[(*amount)++] = id;
+        newInfo[id].offset = curOffset;
+        newInfo[id].size = sizes[id];
+        curOffset += headroom ? _afs_calcGrowthSpace(afs, 0, sizes[id]) : (u64)_afs_calcReservedSpace(sizes[id]);
+    }
+    // Metadata
+    newInfo[count].offset = curOffset;
+    newInfo[count].size = oldInfo[count].size;
+    return curOffset + oldInfo[count].size;
+}
+
+int _afs_rebuildToNewFile(Afs* afs, const int* order, int amount, const AfsEntrySource** sources, const AfsEntryInfo* newInfo, u64* moved);
+
+/** Rebuilds the AFS file into a new layout without loading more than one chunk at a time.
+ * Entries without a source keep their data and are moved to their new offset,
+ * entries with a source get the data of that source.
+ *
+ * The moves are ordered so no data is overwritten before it was moved:
+ * first every entry that moves towards the start of the file, front to back,
+ * then every entry that moves towards the end, back to front,
+ * and only then the new data, padding, entry info and metadata are written.
+ * Neighbouring entries that move by the same distance are moved together.
+ * With AFS_GROWTH_REBUILD, the AFS is rebuilt into a new file instead, see _afs_rebuildToNewFile().
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct, its entry info is replaced by newInfo.
+ * @param order The entries sorted by offset, the new layout must keep this order.
+ * @param amount The amount of entries in order
+ * @param sources Source for each entry, NULL if the entry is kept
+ * @param newInfo The new entry info array (entrycount + 1 elements)
+ * @param moved Receives the amount of bytes that were moved within the file (may be NULL)
+ * @return 0 if successful, 1 if reading or writing failed.
+ */
+int _afs_applyLayout(Afs* afs, const int* order, int amount, const AfsEntrySource** sources, const AfsEntryInfo* newInfo, u64* moved) {
+    if(afs->internal->growthPolicy == AFS_GROWTH_REBUILD) {
+        // The old file is read front to back. Afterwards the handle's own pattern goes to the new file.
+        _afs_adviseAccess(afs, AFS_ACCESS_SEQUENTIAL);
+        int rebuilt = _afs_rebuildToNewFile(afs, order, amount, sources, newInfo, moved);
+        _afs_adviseAccess(afs, afs->internal->accessPattern);
+        return rebuilt;
+    }
+    int count = afs->header.entrycount;
+    u64 movedBytes = 0;
+    AfsEntryInfo* oldInfo = afs->header.entryinfo;
+    AfsEntryMetadata* meta = _afs_getMeta(afs);
+    int ret = 0;
+
+    // runEnd[pos] is the last position of the run of kept entries starting at pos
+    int* runEnd = (int*)malloc(sizeof(int) * (amount > 0 ? amount : 1));
+    _afs_trackMemory(afs, sizeof(int) * amount);
+    for(int pos=amount-1;pos>=0;pos--) {
+        int id = order[pos];
+        runEnd[pos] = pos;
+        if(sources[id] != NULL || pos + 1 >= amount) continue;
+        int next = order[pos+1];
+        s64 delta = (s64)newInfo[id].offset - oldInfo[id].offset;
+        if(sources[next] == NULL && (s64)newInfo[next].offset - oldInfo[next].offset == delta) {
+            runEnd[pos] = runEnd[pos+1];
+        }
+    }
+
+    // Kept entries moving towards the start
+    for(int pos=0;pos<amount && ret == 0;pos++) {
+        int id = order[pos];
+        if(sources[id] != NULL) continue;
+        int last = order[runEnd[pos]];
+        if(newInfo[id].offset < oldInfo[id].offset) {
+            u64 size = oldInfo[last].offset + oldInfo[last].size - oldInfo[id].offset;
+            ret = _afs_moveRange(afs, oldInfo[id].offset, newInfo[id].offset, size);
+            movedBytes += size;
+        }
+        pos = runEnd[pos];
+    }
+    // Kept entries moving towards the end
+    for(int pos=amount-1;pos>=0 && ret == 0;pos--) {
+        int id = order[pos];
+        if(sources[id] != NULL || (pos > 0 && runEnd[pos-1] == runEnd[pos] && sources[order[pos-1]] == NULL)) continue;
+        int last = order[runEnd[pos]];
+        if(newInfo[id].offset > oldInfo[id].offset) {
+            u64 size = oldInfo[last].offset + oldInfo[last].size - oldInfo[id].offset;
+            ret = _afs_moveRange(afs, oldInfo[id].offset, newInfo[id].offset, size);
+            movedBytes += size;
+        }
+    }
+
+    // New data, and padding wherever it wasn't moved along with the entries
+    u64 bufferSize = _afs_getChunkSize(afs);
+    u8* buffer = (u8*)malloc(bufferSize);
+    _afs_trackMemory(afs, bufferSize);
+    for(int pos=0;pos<amount && ret == 0;pos++) {
+        int id = order[pos];
+        if(sources[id] != NULL) {
+            ret = _afs_writeSource(afs, sources[id], newInfo[id].size, newInfo[id].offset, buffer, bufferSize);
+        }
+        else if(runEnd[pos] != pos) {
+            continue;
+        }
+        if(ret == 0) {
+            u64 next = (pos + 1 < amount) ? newInfo[order[pos+1]].offset : newInfo[count].offset;
+            u64 end = newInfo[id].offset + newInfo[id].size;
+            ret = _afs_writeZeros(afs, end, next - end);
+        }
+    }
+    free(buffer);
+    free(runEnd);
+    _afs_trackMemory(afs, -(s64)(bufferSize + sizeof(int) * amount));
+    if(ret != 0) {
+        _afs_LogError("ERROR: _afs_applyLayout - Failed to rebuild the AFS.");
+        return 1;
+    }
+
+    memcpy(oldInfo, newInfo, sizeof(AfsEntryInfo) * (count + 1));
+    _afs_invalidateFreeExtents(afs);
+    // Write the new entryinfo and the metadata to the AFS file. The data was moved already,
+    // so if that fails, all records stay marked dirty and a later flush can still write them.
+    if(_afs_writeAt(afs, oldInfo, sizeof(AfsEntryInfo) * (count + 1), 8) != sizeof(AfsEntryInfo) * (count + 1)
+        || _afs_writeAt(afs, meta, sizeof(AfsEntryMetadata) * count, oldInfo[count].offset) != sizeof(AfsEntryMetadata) * count) {
+        _afs_LogError("ERROR: _afs_applyLayout - Failed to write the entry info, the AFS might be damaged.");
+        _afs_markInfoDirty(afs, 0, count);
+        _afs_markMetaDirty(afs, 0, count - 1);
+        return 1;
+    }
+    _afs_clearDirty(afs, true, true);
+    if(moved != NULL) {
+        *moved = movedBytes;
+    }
+    return 0;
+}
+
+/** Throws away the free extent map, it gets rebuilt from the entry info on its next use.
+ * Has to be called whenever entries are moved or grown by anything else than _afs_relocateEntry().
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_invalidateFreeExtents(Afs* afs) {
+    free(afs->internal->freeExtents);
+    afs->internal->freeExtents = NULL;
+    afs->internal->freeExtentCount = 0;
+}
+
+/** Adds a range to the free extent map and merges it with the extents it overlaps or touches.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param offset Offset of the free range
+ * @param size Size of the free range
+ */
+void _afs_freeExtentAdd(Afs* afs, u64 offset, u64 size) {
+    if(size == 0) {
+        return;
+    }
+    AfsExtent* ext = afs->internal->freeExtents;
+    int count = afs->internal->freeExtentCount;
+    u64 end = offset + size;
+
+    // ext[first] to ext[last-1] are replaced by a single extent
+    int first = 0;
+    while(first < count && ext[first].offset + ext[first].size < offset) {
+        first++;
+    }
+    int last = first;
+    while(last < count && ext[last].offset <= end) {
+        if(ext[last].offset < offset) offset = ext[last].offset;
+        if(ext[last].offset + ext[last].size > end) end = ext[last].offset + ext[last].size;
+        last++;
+    }
+
+    if(last == first) {
+        ext = (AfsExtent*)realloc(ext, sizeof(AfsExtent) * (count + 1));
+    }
+    memmove(ext + first + 1, ext + last, sizeof(AfsExtent) * (count - last));
+    ext[first].offset = offset;
+    ext[first].size = end - offset;
+
+    afs->internal->freeExtents = ext;
+    afs->internal->freeExtentCount = count - (last - first) + 1;
+}
+
+/** Removes an extent from the free extent map.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_freeExtentRemove(Afs* afs, int index) {
+    memmove(afs->internal->freeExtents + index, afs->internal->freeExtents + index + 1, sizeof(AfsExtent) * (afs->internal->freeExtentCount - index - 1));
+    afs->internal->freeExtentCount--;
+}
+
+/** Gets the free extent map, building it if needed.
+ * Free space is everything between the end of the space an entry needs (see _afs_getNeededSpace())
+ * and the start of the next entry or the metadata section.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @return The free extents, sorted by offset. afs->internal->freeExtentCount holds the amount.
+ */
+AfsExtent* _afs_getFreeExtents(Afs* afs) {
+    if(afs->internal->freeExtents != NULL) {
+        return afs->internal->freeExtents;
+    }
+    afs->internal->freeExtents = (AfsExtent*)malloc(sizeof(AfsExtent));
+    afs->internal->freeExtentCount = 0;
+
+    int count = afs->header.entrycount;
+    AfsEntryInfo* info = afs->header.entryinfo;
+    int amount;
+    int* order = _afs_getOffsetOrder(afs, &amount);
+    for(int pos=0;pos<amount;pos++) {
+        AfsEntryInfo cur = info[order[pos]];
+        u64 start = cur.offset + _afs_getNeededSpace(afs, order[pos]);
+        u64 end = _afs_getReservedSpace(info, count, order, amount, pos) + cur.offset;
+        if(end > start) {
+            _afs_freeExtentAdd(afs, start, end - start);
+        }
+    }
+    free(order);
+    return afs->internal->freeExtents;
+}
+
+/** Moves an entry into free space and writes its new data there (AFS_GROWTH_RELOCATE).
+ * The first free extent that is large enough for the reserved space is used. If there is none, the entry is put at the end
+ * of the data section and the metadata section moves behind it.
+ * The new data is written before the entry info changes, so the old data stays intact until the entry points to the new one.
+ * The space the entry used before is added to the free extent map.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ * @param source Source of the new data
+ * @param size Size of the new data
+ * @param reserved Space to reserve for the entry, at least _afs_calcReservedSpace(size).
+ * If the AFS would grow past AFS_MAXOFFSET with it, only _afs_calcReservedSpace(size) is reserved.
+ * @return 0 if successful, 4 if the AFS would grow past AFS_MAXOFFSET, 5 if writing failed.
+ */
+int _afs_relocateEntry(Afs* afs, int id, const AfsEntrySource* source, u64 size, u64 reserved) {
+    int count = afs->header.entrycount;
+    AfsEntryInfo* info = afs->header.entryinfo;
+    u64 metaOffset = info[count].offset;
+    u64 oldOffset = info[id].offset;
+    u64 oldEnd = _afs_extentEnd(afs, id);
+    // The metadata might get overwritten by the new data, so it has to be in memory
+    AfsEntryMetadata* meta = _afs_getMeta(afs);
+
+    AfsExtent* ext = _afs_getFreeExtents(afs);
+    int n = afs->internal->freeExtentCount;
+    int found = -1;
+    bool atEnd = false;
+    u64 newOffset = 0;
+    if(oldEnd == metaOffset) {
+        // The last entry can simply grow into the space of the metadata section
+        atEnd = true;
+        newOffset = oldOffset;
+        if(n > 0 && ext[n-1].offset + ext[n-1].size == metaOffset && ext[n-1].offset >= oldOffset) {
+            found = n - 1;
+        }
+    }
+    else {
+        for(int i=0;i<n;i++) {
+            // The free space behind the entry itself can't be used, it's given up together with the old data
+            bool ownSpace = ext[i].offset >= oldOffset && ext[i].offset < oldEnd;
+            if(ext[i].size >= reserved && !ownSpace) {
+                found = i;
+                newOffset = ext[i].offset;
+                break;
+            }
+        }
+        if(found < 0) {
+            atEnd = true;
+            newOffset = metaOffset;
+            // Free space right in front of the metadata is used as well
+            if(n > 0 && ext[n-1].offset + ext[n-1].size == metaOffset) {
+                found = n - 1;
+                newOffset = ext[n-1].offset;
+            }
+        }
+    }
+    if(atEnd && newOffset + reserved + info[count].size > AFS_MAXOFFSET) {
+        // Without the headroom it might still fit
+        reserved = _afs_calcReservedSpace(size);
+        if(newOffset + reserved + info[count].size > AFS_MAXOFFSET) {
+            return 4;
+        }
+    }
+
+    u64 bufferSize = _afs_getChunkSize(afs);
+    u8* buffer = (u8*)malloc(bufferSize);
+    _afs_trackMemory(afs, bufferSize);
+    int ret = _afs_writeSource(afs, source, size, newOffset, buffer, bufferSize);
+    free(buffer);
+    _afs_trackMemory(afs, -(s64)bufferSize);
+    if(ret == 0) {
+        ret = _afs_writeZeros(afs, newOffset + size, reserved - size);
+    }
+    if(ret == 0 && atEnd) {
+        // The whole section moves, including anything stored behind the records (the buffer always covers it, see _afs_getMeta())
+        ret = _afs_writeAt(afs, meta, info[count].size, newOffset + reserved) != info[count].size;
+        if(ret == 0) {
+            _afs_clearDirty(afs, false, true);
+        }
+    }
+    if(ret != 0) {
+        _afs_LogError("ERROR: _afs_relocateEntry - Failed to write the entry.");
+        return 5;
+    }
+
+    // Take the new space out of the free extent map and give back the old one
+    if(found >= 0) {
+        if(atEnd || ext[found].size == reserved) {
+            _afs_freeExtentRemove(afs, found);
+        }
+        else {
+            ext[found].offset += reserved;
+            ext[found].size -= reserved;
+        }
+    }
+    if(newOffset != oldOffset) {
+        _afs_freeExtentAdd(afs, oldOffset, oldEnd - oldOffset);
+    }
+
+    info[id].offset = newOffset;
+    info[id].size = size;
+    _afs_setReservedSpace(afs, id, reserved);
+    _afs_setAction(afs, id, newOffset == oldOffset ? AFS_EDIT_SHIFT : AFS_EDIT_RELOCATE);
+    if(atEnd) {
+        info[count].offset = newOffset + reserved;
+    }
+    if(_afs_writeAt(afs, info + id, sizeof(AfsEntryInfo), 8 + sizeof(AfsEntryInfo) * id) != sizeof(AfsEntryInfo)
+        || (atEnd && _afs_writeAt(afs, info + count, sizeof(AfsEntryInfo), 8 + sizeof(AfsEntryInfo) * count) != sizeof(AfsEntryInfo))) {
+        // The new data is in place, so the entry keeps pointing to it in memory and the next flush writes the entry info again
+        _afs_LogError("ERROR: _afs_relocateEntry - Failed to write the entry info.");
+        _afs_markInfoDirty(afs, id, id);
+        if(atEnd) {
+            _afs_markInfoDirty(afs, count, count);
+        }
+        return 5;
+    }
+    return 0;
+}
+
+/** Replaces entries with AFS_GROWTH_RELOCATE: entries that still fit are overwritten in place,
+ * the others are moved with _afs_relocateEntry(). Nothing else in the AFS is moved.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param sources Source for each entry, NULL if the entry is kept
+ * @param sizes New size for each replaced entry
+ * @return 0 if successful, 4 if the AFS would grow past AFS_MAXOFFSET, 5 if writing failed.
+ */
+int _afs_replaceRelocating(Afs* afs, const AfsEntrySource** sources, const u64* sizes) {
+    int count = afs->header.entrycount;
+    AfsEntryInfo* info = afs->header.entryinfo;
+
+    u64 bufferSize = _afs_getChunkSize(afs);
+    u8* buffer = (u8*)malloc(bufferSize);
+    _afs_trackMemory(afs, bufferSize);
+    int ret = 0;
+    for(int id=0;id<count && ret == 0;id++) {
+        if(sources[id] == NULL) continue;
+        u64 reserved = _afs_extentEnd(afs, id) - info[id].offset;
+        if(sizes[id] >= reserved) {
+            ret = _afs_relocateEntry(afs, id, sources[id], sizes[id], _afs_calcGrowthSpace(afs, reserved, sizes[id]));
+            continue;
+        }
+
+        u64 used = _afs_calcReservedSpace(sizes[id]);
+        if(used > reserved) used = reserved;
+        if(used > _afs_calcReservedSpace(info[id].size)) {
+            // The entry grows into space the free extent map still lists as free
+            _afs_invalidateFreeExtents(afs);
+        }
+        if(_afs_writeSource(afs, sources[id], sizes[id], info[id].offset, buffer, bufferSize) != 0
+            || _afs_writeZeros(afs, info[id].offset + sizes[id], used - sizes[id]) != 0) {
+            ret = 5;
+            break;
+        }
+        info[id].size = sizes[id];
+        _afs_setAction(afs, id, AFS_EDIT_INPLACE);
+    }
+    free(buffer);
+    _afs_trackMemory(afs, -(s64)bufferSize);
+
+    // Write the new entryinfo and metadata to the AFS file, also after a failure for the entries that were already replaced.
+    // If that fails, all records stay marked dirty and a later flush can still write them.
+    if(_afs_writeAt(afs, info, sizeof(AfsEntryInfo) * (count + 1), 8) != sizeof(AfsEntryInfo) * (count + 1)
+        || _afs_writeAt(afs, _afs_getMeta(afs), sizeof(AfsEntryMetadata) * count, info[count].offset) != sizeof(AfsEntryMetadata) * count) {
+        _afs_LogError("ERROR: _afs_replaceRelocating - Failed to write the entry info, the AFS might be damaged.");
+        _afs_markInfoDirty(afs, 0, count);
+        _afs_markMetaDirty(afs, 0, count - 1);
+        return 5;
+    }
+    _afs_clearDirty(afs, true, true);
+    return ret;
+}
+
+/** Sets the filename of a metadata record. Names that don't fit are cut off, so the filename stays terminated.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_setFilename(AfsEntryMetadata* meta, const char* name) {
+    size_t len = strnlen(name, AFSMETA_NAMEBUFFERSIZE - 1);
+    memcpy(meta->filename, name, len);
+    memset(meta->filename + len, 0x00, AFSMETA_NAMEBUFFERSIZE - len);
+}
+
+/** Updates the metadata of a replaced entry: filename, last modified date and file size.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param meta The metadata array
+ * @param id The index of the entry
+ * @param source Source of the new data. Files use their own filename, other sources only change it if they have a name.
+ * @param size Size of the new data
+ * @param tm The last modified date
+ */
+void _afs_setReplacedMetadata(AfsEntryMetadata* meta, int id, const AfsEntrySource* source, u64 size, const struct tm* tm) {
+    // Filename
+    if(source->name != NULL) {
+        _afs_setFilename(&meta[id], source->name);
+    }
+    else if(source->type == AFS_SOURCE_FILE) {
+        _afs_setFilename(&meta[id], _afs_getFilename(source->filepath));
+    }
+    // Last Modified Date
+    meta[id].lastModified.year = tm->tm_year + 1900;
+    meta[id].lastModified.month = tm->tm_mon + 1;
+    meta[id].lastModified.day = tm->tm_mday;
+    meta[id].lastModified.hours = tm->tm_hour;
+    meta[id].lastModified.minutes = tm->tm_min;
+    meta[id].lastModified.seconds = tm->tm_sec;
+    // File Size
+    meta[id].filesize = size;
+}
+
+/** Replaces a single entry: in place if it fits, otherwise it's resized or moved depending on the growth policy.
+ * This is what afs_replaceEntry() does, and afs_replaceEntries() when only one entry is replaced.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ * @param source Source of the new data
+ * @param size Size of the new data
+ * @return 0 if successful, 4 if the AFS would grow past AFS_MAXOFFSET, 5 if reading the source or writing the AFS failed.
+ */
+int _afs_replaceRebuilding(Afs* afs, int id, const AfsEntrySource* source, u64 size);
+
+int _afs_replaceEntrySource(Afs* afs, int id, const AfsEntrySource* source, u64 size) {
+    u64 reservedSpace = _afs_extentEnd(afs, id) - afs->header.entryinfo[id].offset;
+    if(size < reservedSpace) {
+        _afs_setAction(afs, id, AFS_EDIT_INPLACE);
+        return _afs_replaceEntry_noResize(afs, id, source, size);
+    }
+    if(afs->internal->growthPolicy == AFS_GROWTH_REBUILD) {
+        return _afs_replaceRebuilding(afs, id, source, size);
+    }
+
+    // Entries without space of their own can't be grown in place, so they are always moved
+    if(afs->internal->growthPolicy == AFS_GROWTH_RELOCATE || !_afs_isPlaced(afs, id)) {
+        int ret = _afs_relocateEntry(afs, id, source, size, _afs_calcGrowthSpace(afs, reservedSpace, size));
+        if(ret != 0) {
+            return ret;
+        }
+        AfsEntryMetadata* meta = _afs_getMeta(afs);
+        meta[id].filesize = size;
+        _afs_markMetaDirty(afs, id, id);
+        return 0;
+    }
+
+    int ret = _afs_resizeEntrySpace(afs, id, size);
+    if(ret != 0) {
+        return ret == 4 ? 4 : 5;
+    }
+    _afs_setAction(afs, id, AFS_EDIT_SHIFT);
+    return _afs_replaceEntry_noResize(afs, id, source, size);
+}
+
+typedef struct {
+    Afs* afs;
+    u64 offset;
+} AfsFileRange;
+
+/** AfsSourceReadFunc that reads data from the AFS file itself, used to move an entry with _afs_relocateEntry().
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param userdata AfsFileRange with the offset the data starts at
+ */
+s64 _afs_readFileRange(void* userdata, void* dst, u64 offset, u64 length) {
+    AfsFileRange* range = (AfsFileRange*)userdata;
+    return _afs_readAt(range->afs, dst, length, range->offset + offset);
+}
+
+/** Sets the size of the AFS file, cutting off everything behind it.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param size The new file size
+ * @return 0 if successful, 1 if it failed.
+ */
+int _afs_truncate(Afs* afs, u64 size) {
+    if(afs->internal->dryRun != NULL) {
+        afs->internal->dryRun->fileSize = size;
+        return 0;
+    }
+    if(afs->internal->journal != NULL) {
+        return _afs_journalAppend(afs->internal->journal, AFS_JOURNAL_TRUNCATE, 0, size, NULL);
+    }
+    return _afs_truncateFile(afs->fstream, size);
+}
+
+#define AFS_JOURNAL_MAGIC "AFSJ"
+#define AFS_JOURNAL_VERSION 1
+#define AFS_JOURNAL_HEADERSIZE 8
+#define AFS_JOURNAL_CHECKSUMBASIS 0xCBF29CE484222325ull
+
+/** Builds the path of the journal file that belongs to an AFS file.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+char* _afs_journalPath(const char* filePath) {
+    size_t len = strlen(filePath);
+    char* path = (char*)malloc(len + sizeof(".journal"));
+    memcpy(path, filePath, len);
+    memcpy(path + len, ".journal", sizeof(".journal"));
+    return path;
+}
+
+/** Applies journal records to the AFS file, in the order they were made.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param journalFp The journal file
+ * @param fp The AFS file
+ * @param entries The records
+ * @param count Amount of records
+ * @param buffer Buffer the data is copied through
+ * @param buffer_size Size of that buffer
+ * @return 0 if successful, 1 if reading the journal or writing the AFS failed.
+ */
+int _afs_journalReplay(FILE* journalFp, FILE* fp, const AfsJournalEntry* entries, int count, u8* buffer, u64 buffer_size) {
+    for(int i=0;i<count;i++) {
+        const AfsJournalEntry* e = &entries[i];
+        if(e->type == AFS_JOURNAL_TRUNCATE) {
+            if(_afs_truncateFile(fp, e->size) != 0) return 1;
+            continue;
+        }
+        for(u64 done=0;done<e->size;) {
+            u64 chunk = (e->size - done < buffer_size) ? e->size - done : buffer_size;
+            if(_afs_readFile(journalFp, buffer, chunk, e->data + done) != chunk
+                || _afs_writeFile(fp, buffer, chunk, e->offset + done) != chunk) {
+                return 1;
+            }
+            done += chunk;
+        }
+    }
+    return 0;
+}
+
+/** Checks whether a path still leads to an opened file, and not to a file that was created there since.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+bool _afs_isFileAtPath(FILE* fp, const char* path) {
+    #ifdef __unix__
+    struct stat opened, current;
+    return fstat(fileno(fp), &opened) == 0 && stat(path, &current) == 0
+        && opened.st_dev == current.st_dev && opened.st_ino == current.st_ino;
+    #else
+    return true;
+    #endif
+}
+
+/** Replays the batches that were committed to the journal of an AFS file, then removes the journal.
+ * Batches without a valid commit record were never applied to the AFS file, so they are discarded.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param fp The AFS file
+ * @param path Path of the journal file
+ * @param readOnly If true, the AFS can't be recovered and only a warning is logged.
+ * @return 0 if there was nothing to recover or the recovery succeeded, 1 if it failed,
+ * 2 if the journal belongs to another handle that has the AFS opened right now.
+ */
+int _afs_journalRecover(FILE* fp, const char* path, bool readOnly) {
+    FILE* journalFp = fopen(path, "rb");
+    if(journalFp == NULL) {
+        // On Windows, the journal of an opened handle can't be opened at all, see _afs_journalCreateFile()
+        return (errno == ENOENT) ? 0 : 2;
+    }
+    #ifdef __unix__
+    if(flock(fileno(journalFp), LOCK_EX | LOCK_NB) != 0) {
+        fclose(journalFp);
+        return 2;
+    }
+    #endif
+    if(readOnly) {
+        _afs_LogError("WARNING: _afs_journalRecover - The AFS has a journal that wasn't replayed yet, open it for writing to recover it.");
+        _afs_LogErrorF("Journal: %s\n", path);
+        fclose(journalFp);
+        return 0;
+    }
+
+    u64 size = _afs_getStreamSize(journalFp);
+    u8* buffer = (u8*)malloc(AFS_COPYBUFFERSIZE);
+    AfsJournalEntry* entries = NULL;
+    int count = 0;
+    int capacity = 0;
+    int batches = 0;
+    int ret = 0;
+    char magic[4];
+    u64 pos = AFS_JOURNAL_HEADERSIZE;
+    if(_afs_readFile(journalFp, magic, 4, 0) != 4 || memcmp(magic, AFS_JOURNAL_MAGIC, 4) != 0) {
+        pos = size;
+    }
+    u64 checksum = AFS_JOURNAL_CHECKSUMBASIS;
+    while(ret == 0 && pos + sizeof(AfsJournalRecord) <= size) {
+        AfsJournalRecord record;
+        if(_afs_readFile(journalFp, &record, sizeof(AfsJournalRecord), pos) != sizeof(AfsJournalRecord)) break;
+        pos += sizeof(AfsJournalRecord);
+
+        if(record.type == AFS_JOURNAL_COMMIT) {
+            // An incomplete or damaged batch was never applied
+            if(record.offset != (u64)count || record.size != checksum) break;
+            if(_afs_journalReplay(journalFp, fp, entries, count, buffer, AFS_COPYBUFFERSIZE) != 0) {
+                ret = 1;
+            }
+            batches++;
+            count = 0;
+            checksum = AFS_JOURNAL_CHECKSUMBASIS;
+            continue;
+        }
+        if(record.type != AFS_JOURNAL_WRITE && record.type != AFS_JOURNAL_TRUNCATE) break;
+        u64 dataSize = (record.type == AFS_JOURNAL_WRITE) ? record.size : 0;
+        if(dataSize > size - pos) break;
+        checksum = _afs_journalChecksum(checksum, &record, sizeof(AfsJournalRecord));
+        bool readFailed = false;
+        for(u64 done=0;done<dataSize && !readFailed;) {
+            u64 chunk = (dataSize - done < AFS_COPYBUFFERSIZE) ? dataSize - done : AFS_COPYBUFFERSIZE;
+            readFailed = _afs_readFile(journalFp, buffer, chunk, pos + done) != chunk;
+            checksum = _afs_journalChecksum(checksum, buffer, chunk);
+            done += chunk;
+        }
+        if(readFailed) break;
+
+        if(count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            entries = (AfsJournalEntry*)realloc(entries, sizeof(AfsJournalEntry) * capacity);
+        }
+        entries[count].type = record.type;
+        entries[count].offset = record.offset;
+        entries[count].size = record.size;
+        entries[count].data = pos;
+        count++;
+        pos += dataSize;
+    }
+    free(entries);
+    free(buffer);
+
+    if(ret == 0 && batches > 0 && _afs_syncFile(fp) != 0) {
+        ret = 1;
+    }
+    if(ret != 0) {
+        _afs_LogError("ERROR: _afs_journalRecover - Failed to replay the journal, it's kept for the next attempt.");
+        _afs_LogErrorF("Journal: %s\n", path);
+        fclose(journalFp);
+        return 1;
+    }
+    if(batches > 0) {
+        _afs_LogErrorF("INFO: _afs_journalRecover - Replayed %d unfinished batch(es) from the journal.\n", batches);
+    }
+    // Removed while it's still locked, and only if no other handle created a new journal in its place
+    if(_afs_isFileAtPath(journalFp, path)) {
+        remove(path);
+    }
+    fclose(journalFp);
+    return 0;
+}
+
+/** Creates a journal file, failing if it already exists, and keeps it to itself for as long as it's open:
+ * on Unix it's locked with flock(), on Windows it's opened without sharing.
+ * So a second handle on the same AFS can't create or replay it, see _afs_journalRecover().
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param path Path of the journal file
+ * @return The journal file, NULL if it already exists or couldn't be created.
+ */
+FILE* _afs_journalCreateFile(const char* path) {
+    #ifdef _WIN32
+    int fd;
+    if(_sopen_s(&fd, path, _O_CREAT | _O_EXCL | _O_RDWR | _O_BINARY, _SH_DENYRW, _S_IREAD | _S_IWRITE) != 0) {
+        return NULL;
+    }
+    FILE* fp = _fdopen(fd, "w+b");
+    if(fp == NULL) {
+        _close(fd);
+    }
+    return fp;
+    #elif defined(__unix__)
+    // Another handle could have opened the new file to recover it before it was locked,
+    // it then removes it, so the path has to lead to the locked file once the lock is taken.
+    for(int attempt=0;attempt<3;attempt++) {
+        FILE* fp = fopen(path, "wb+x");
+        if(fp == NULL) {
+            return NULL;
+        }
+        if(flock(fileno(fp), LOCK_EX) != 0) {
+            fclose(fp);
+            remove(path);
+            return NULL;
+        }
+        if(_afs_isFileAtPath(fp, path)) {
+            return fp;
+        }
+        fclose(fp);
+    }
+    return NULL;
+    #else
+    return fopen(path, "wb+x");
+    #endif
+}
+
+/** Creates the journal of an AFS opened with AFS_OPEN_JOURNAL.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param path Path of the journal file, the journal takes it over.
+ * @param fileSize Current size of the AFS file
+ * @return The journal, NULL if the file couldn't be created.
+ */
+struct AfsJournal* _afs_journalOpen(char* path, u64 fileSize) {
+    FILE* fp = _afs_journalCreateFile(path);
+    u8 header[AFS_JOURNAL_HEADERSIZE];
+    u32 version = AFS_JOURNAL_VERSION;
+    memcpy(header, AFS_JOURNAL_MAGIC, 4);
+    memcpy(header + 4, &version, 4);
+    if(fp == NULL || _afs_writeFile(fp, header, AFS_JOURNAL_HEADERSIZE, 0) != AFS_JOURNAL_HEADERSIZE) {
+        _afs_LogError("ERROR: _afs_journalOpen - Couldn't create the journal, another handle might have the AFS opened with AFS_OPEN_JOURNAL.");
+        _afs_LogErrorF("Journal: %s\n", path);
+        if(fp != NULL) {
+            fclose(fp);
+            remove(path);
+        }
+        free(path);
+        return NULL;
+    }
+    struct AfsJournal* journal = (struct AfsJournal*)calloc(1, sizeof(struct AfsJournal));
+    journal->fp = fp;
+    journal->path = path;
+    journal->end = AFS_JOURNAL_HEADERSIZE;
+    journal->checksum = AFS_JOURNAL_CHECKSUMBASIS;
+    journal->fileSize = fileSize;
+    journal->baseSize = fileSize;
+    return journal;
+}
+
+/** Commits the current journal batch: the journal is synced once for the whole batch,
+ * then the batch is applied to the AFS file and the journal is emptied.
+ * If applying fails, the journal is kept and replayed when the AFS is opened again.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @return 0 if successful (or there is no journal), 5 if writing the journal or the AFS failed.
+ */
+int _afs_journalCommit(Afs* afs) {
+    struct AfsJournal* journal = afs->internal->journal;
+    if(journal == NULL || journal->count == 0 || afs->internal->dryRun != NULL) {
+        return 0;
+    }
+
+    AfsJournalRecord commit;
+    memset(&commit, 0x00, sizeof(AfsJournalRecord));
+    commit.type = AFS_JOURNAL_COMMIT;
+    commit.offset = journal->count;
+    commit.size = journal->checksum;
+    if(_afs_writeFile(journal->fp, &commit, sizeof(AfsJournalRecord), journal->end) != sizeof(AfsJournalRecord)
+        || _afs_syncFile(journal->fp) != 0) {
+        _afs_LogError("ERROR: _afs_journalCommit - Failed to write the journal, nothing was applied to the AFS yet.");
+        return 5;
+    }
+    journal->end += sizeof(AfsJournalRecord);
+
+    u64 bufferSize = _afs_getChunkSize(afs);
+    u8* buffer = (u8*)malloc(bufferSize);
+    int ret = 0;
+    if(_afs_journalReplay(journal->fp, afs->fstream, journal->entries, journal->count, buffer, bufferSize) != 0
+        || _afs_syncFile(afs->fstream) != 0) {
+        _afs_LogError("ERROR: _afs_journalCommit - Failed to apply the journal, it's replayed when the AFS is opened again.");
+        ret = 5;
+    }
+    free(buffer);
+
+    // Once the AFS is synced the batch isn't needed anymore. A failed batch stays in front of the next ones.
+    if(ret == 0 && _afs_truncateFile(journal->fp, AFS_JOURNAL_HEADERSIZE) == 0) {
+        journal->end = AFS_JOURNAL_HEADERSIZE;
+    }
+    journal->count = 0;
+    journal->extentCount = 0;
+    journal->checksum = AFS_JOURNAL_CHECKSUMBASIS;
+    journal->baseSize = journal->fileSize;
+    return ret;
+}
+
+/** Closes the journal, the file is removed if everything in it was applied.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_journalClose(Afs* afs) {
+    struct AfsJournal* journal = afs->internal->journal;
+    if(journal == NULL) {
+        return;
+    }
+    // Removed while it's still locked, see _afs_journalCreateFile()
+    if(journal->count == 0 && journal->end == AFS_JOURNAL_HEADERSIZE) {
+        remove(journal->path);
+    }
+    fclose(journal->fp);
+    free(journal->entries);
+    free(journal->extents);
+    free(journal->path);
+    free(journal);
+    afs->internal->journal = NULL;
+}
+
+/** Calculates the most compact layout: the entries keep their order, start right behind the entry info
+ * and each one only gets the space it needs, rounded up to AFS_RESERVEDSPACEBUFFER.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param order The entries sorted by offset
+ * @param amount The amount of entries in order
+ * @param newInfo Receives the new entry info array (entrycount + 1 elements)
+ * @return The end offset of the metadata section in the new layout.
+ */
+u64 _afs_planCompact(Afs* afs, const int* order, int amount, AfsEntryInfo* newInfo) {
+    int count = afs->header.entrycount;
+    AfsEntryInfo* oldInfo = afs->header.entryinfo;
+    memcpy(newInfo, oldInfo, sizeof(AfsEntryInfo) * (count + 1));
+
+    u64 curOffset = _afs_alignUp(8 + sizeof(AfsEntryInfo) * (count + 1));
+    for(int pos=0;pos<amount;pos++) {
+        int id = order[pos];
+        newInfo[id].offset = curOffset;
+        // Empty entries still get a block, so no two entries share an offset
+        u64 needed = _afs_alignUp(oldInfo[id].size);
+        curOffset += needed > 0 ? needed : AFS_RESERVEDSPACEBUFFER;
+    }
+    // Metadata
+    newInfo[count].offset = curOffset;
+    return curOffset + oldInfo[count].size;
+}
+
+/** Gets the offset where the data section starts: the offset of the first placed entry, or of the metadata if there is none.
+ * Everything in front of it belongs to the header and entry info.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+u64 _afs_getDataStart(Afs* afs) {
+    int count = afs->header.entrycount;
+    u64 start = afs->header.entryinfo[count].offset;
+    for(int i=0;i<count;i++) {
+        if(_afs_isPlaced(afs, i) && afs->header.entryinfo[i].offset < start) {
+            start = afs->header.entryinfo[i].offset;
+        }
+    }
+    return start;
+}
+
+/** Makes sure the entry info has room for a given amount of entries.
+ * If it doesn't, the whole data section is moved back by a multiple of AFS_RESERVEDSPACEBUFFER.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param capacity The amount of entries the entry info should have room for
+ * @return 0 if successful, 4 if the AFS would grow past AFS_MAXOFFSET, 5 if moving the data failed.
+ */
+int _afs_growToc(Afs* afs, u64 capacity) {
+    int count = afs->header.entrycount;
+    AfsEntryInfo* info = afs->header.entryinfo;
+    u64 tocEnd = 8 + sizeof(AfsEntryInfo) * (count + 1);
+    u64 needed = 8 + sizeof(AfsEntryInfo) * (capacity + 1);
+    u64 dataStart = _afs_getDataStart(afs);
+    if(needed <= dataStart) {
+        return 0;
+    }
+
+    // Moving by whole blocks keeps the alignment of every entry
+    u64 delta = _afs_alignUp(needed - dataStart);
+    if((u64)info[count].offset + info[count].size + delta > AFS_MAXOFFSET) {
+        return 4;
+    }
+    int ret = 0;
+    u64 fileSize = _afs_getFileSize(afs);
+    if(_afs_moveRange(afs, dataStart, dataStart + delta, fileSize - dataStart) != 0
+        || _afs_writeZeros(afs, tocEnd, dataStart + delta - tocEnd) != 0) {
+        ret = 5;
+    }
+    for(int i=0;i<=count;i++) {
+        if(i == count || _afs_isPlaced(afs, i)) {
+            info[i].offset += delta;
+        }
+    }
+    _afs_invalidateFreeExtents(afs);
+    if(_afs_writeAt(afs, info, sizeof(AfsEntryInfo) * (count + 1), 8) != sizeof(AfsEntryInfo) * (count + 1)) {
+        // The data already moved, so the new offsets stay in memory and are written again by the next flush
+        _afs_markInfoDirty(afs, 0, count);
+        ret = 5;
+    }
+    return ret;
+}
+
+/** Adds an empty entry to the entry info and metadata. It isn't placed (see _afs_isPlaced()) and only changed in memory,
+ * the entry info needs to have room for it (see _afs_growToc()).
+ * Every entry from id onwards gets the next higher ID.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param id The index of the new entry, may be entrycount to append it.
+ */
+void _afs_insertSlot(Afs* afs, int id) {
+    int count = afs->header.entrycount;
+    AfsEntryInfo metaInfo = afs->header.entryinfo[count];
+
+    // The metadata section grows by one entry, anything stored behind the entries in it is kept
+    u64 metaSize = (u64)count * sizeof(AfsEntryMetadata);
+    if(metaSize < metaInfo.size) {
+        metaSize = metaInfo.size;
+    }
+    u8* meta = (u8*)realloc(_afs_getMeta(afs), metaSize + sizeof(AfsEntryMetadata));
+    u64 metaPos = (u64)id * sizeof(AfsEntryMetadata);
+    memmove(meta + metaPos + sizeof(AfsEntryMetadata), meta + metaPos, metaSize - metaPos);
+    memset(meta + metaPos, 0x00, sizeof(AfsEntryMetadata));
+    afs->meta = (AfsEntryMetadata*)meta;
+
+    AfsEntryInfo* info = (AfsEntryInfo*)realloc(afs->header.entryinfo, sizeof(AfsEntryInfo) * (count + 2));
+    memmove(info + id + 1, info + id, sizeof(AfsEntryInfo) * (count + 1 - id));
+    memset(info + id, 0x00, sizeof(AfsEntryInfo));
+    info[count + 1].size = metaSize + sizeof(AfsEntryMetadata);
+    afs->header.entryinfo = info;
+
+    if(afs->internal->reservedSpace != NULL) {
+        afs->internal->reservedSpace = (u64*)realloc(afs->internal->reservedSpace, sizeof(u64) * (count + 1));
+        memmove(afs->internal->reservedSpace + id + 1, afs->internal->reservedSpace + id, sizeof(u64) * (count - id));
+        afs->internal->reservedSpace[id] = 0;
+    }
+    afs->header.entrycount++;
+    _afs_invalidateFreeExtents(afs);
+}
+
+/** Takes out an entry added by _afs_insertSlot() again, for when its data couldn't be written. Only changed in memory,
+ * every entry behind id gets its old ID back.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ */
+void _afs_removeSlot(Afs* afs, int id) {
+    int count = afs->header.entrycount;
+    AfsEntryInfo* info = afs->header.entryinfo;
+
+    // The metadata section shrinks by the entry again, the buffer keeps its size
+    u8* meta = (u8*)afs->meta;
+    u64 metaSize = (u64)count * sizeof(AfsEntryMetadata);
+    if(metaSize < info[count].size) {
+        metaSize = info[count].size;
+    }
+    u64 metaPos = (u64)id * sizeof(AfsEntryMetadata);
+    memmove(meta + metaPos, meta + metaPos + sizeof(AfsEntryMetadata), metaSize - metaPos - sizeof(AfsEntryMetadata));
+    info[count].size = metaSize - sizeof(AfsEntryMetadata);
+
+    memmove(info + id, info + id + 1, sizeof(AfsEntryInfo) * (count - id));
+    memset(info + count, 0x00, sizeof(AfsEntryInfo));
+    if(afs->internal->reservedSpace != NULL) {
+        memmove(afs->internal->reservedSpace + id, afs->internal->reservedSpace + id + 1, sizeof(u64) * (count - 1 - id));
+    }
+    afs->header.entrycount--;
+    _afs_invalidateFreeExtents(afs);
+}
+
+/** Copies a string into a new buffer, NULL stays NULL.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+char* _afs_copyString(const char* str) {
+    if(str == NULL) {
+        return NULL;
+    }
+    size_t len = strlen(str) + 1;
+    char* copy = (char*)malloc(len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+/** Frees the owned copies of a staged source.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_freeStagedSource(AfsEntrySource* source) {
+    free((void*)source->data);
+    free((void*)source->filepath);
+    free((void*)source->name);
+    memset(source, 0x00, sizeof(AfsEntrySource));
+}
+
+/** Frees a transaction and everything staged in it.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param txn The transaction
+ * @param count Entry count of the AFS
+ */
+void _afs_freeTransaction(struct AfsTransaction* txn, int count) {
+    for(int id=0;id<count;id++) {
+        if(txn->staged[id]) _afs_freeStagedSource(&txn->sources[id]);
+    }
+    free(txn->sources);
+    free(txn->staged);
+    free(txn->savedMeta);
+    free(txn);
+}
+
+/** Stages the replacement of an entry in the open transaction, replacing an earlier one of the same entry.
+ * Buffer and callback sources are copied into memory, so they don't have to stay valid until the commit.
+ * Files are only read at the commit. The new filename is set right away, so renames staged later still win.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ * @param source Source of the new data
+ * @param size Size of the new data
+ * @return 0 if successful, 5 if reading the callback failed.
+ */
+int _afs_stageSource(Afs* afs, int id, const AfsEntrySource* source, u64 size) {
+    AfsEntrySource staged;
+    memset(&staged, 0x00, sizeof(AfsEntrySource));
+    staged.size = size;
+    if(source->type == AFS_SOURCE_FILE) {
+        staged.type = AFS_SOURCE_FILE;
+        staged.filepath = _afs_copyString(source->filepath);
+    }
+    else {
+        staged.type = AFS_SOURCE_BUFFER;
+        u8* data = (u8*)malloc(size > 0 ? size : 1);
+        staged.data = data;
+        if(source->type == AFS_SOURCE_BUFFER) {
+            memcpy(data, source->data, size);
+        }
+        else {
+            u64 done = 0;
+            while(done < size) {
+                s64 got = source->read(source->userdata, data + done, done, size - done);
+                if(got <= 0) {
+                    _afs_LogError("ERROR: _afs_stageSource - Reading the callback source failed.");
+                    _afs_freeStagedSource(&staged);
+                    return 5;
+                }
+                done += (u64)got < size - done ? (u64)got : size - done;
+            }
+        }
+    }
+
+    AfsEntryMetadata* meta = _afs_getMeta(afs);
+    if(source->name != NULL) {
+        _afs_setFilename(&meta[id], source->name);
+    }
+    else if(source->type == AFS_SOURCE_FILE) {
+        _afs_setFilename(&meta[id], _afs_getFilename(source->filepath));
+    }
+
+    struct AfsTransaction* txn = afs->internal->transaction;
+    if(txn->staged[id]) {
+        _afs_freeStagedSource(&txn->sources[id]);
+    }
+    else {
+        txn->staged[id] = true;
+        txn->stagedCount++;
+    }
+    txn->sources[id] = staged;
+    return 0;
+}
+
+/** Offsets of cloned ranges are kept aligned to this, it's the block size of most filesystems that can clone. */
+#define AFS_CLONEALIGNMENT 4096
+
+/** Copies a range of one file into another file without using or changing their positions.
+ * On Linux copy_file_range() keeps the data inside the kernel, anything it can't copy goes through the buffer.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param src The file that is copied from
+ * @param dst The file that is copied to
+ * @param srcOffset Offset within src
+ * @param dstOffset Offset within dst
+ * @param size Amount of bytes to copy
+ * @param buffer Chunk buffer
+ * @param buffer_size Size of that buffer
+ * @return 0 if successful, 1 if reading or writing failed.
+ */
+int _afs_copyRange(FILE* src, FILE* dst, u64 srcOffset, u64 dstOffset, u64 size, u8* buffer, u64 buffer_size) {
+    u64 done = 0;
+    #ifdef __linux__
+    loff_t inOffset = srcOffset;
+    loff_t outOffset = dstOffset;
+    while(done < size) {
+        ssize_t ret = copy_file_range(fileno(src), &inOffset, fileno(dst), &outOffset, size - done, 0);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) break;
+        done += ret;
+    }
+    #endif
+    while(done < size) {
+        u64 chunk = size - done;
+        if(chunk > buffer_size) chunk = buffer_size;
+        if(_afs_readFile(src, buffer, chunk, srcOffset + done) != chunk
+            || _afs_writeFile(dst, buffer, chunk, dstOffset + done) != chunk) {
+            return 1;
+        }
+        done += chunk;
+    }
+    return 0;
+}
+
+/** Clones a range of one file into another file, like _afs_copyRange().
+ * On Linux the blocks within the range are shared with FICLONERANGE if the filesystem supports it,
+ * so they don't have to be read or written at all. This only works if both offsets are equally far from a block boundary,
+ * the parts in front of the first and behind the last full block are copied.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @return 0 if successful, 1 if reading or writing failed.
+ */
+int _afs_cloneRange(FILE* src, FILE* dst, u64 srcOffset, u64 dstOffset, u64 size, u8* buffer, u64 buffer_size) {
+    #ifdef __linux__
+    struct stat st;
+    u64 block = (fstat(fileno(dst), &st) == 0 && st.st_blksize > 0) ? (u64)st.st_blksize : AFS_CLONEALIGNMENT;
+    if(srcOffset % block == dstOffset % block) {
+        u64 head = (block - srcOffset % block) % block;
+        u64 body = (size > head) ? (size - head) / block * block : 0;
+        struct file_clone_range range;
+        range.src_fd = fileno(src);
+        range.src_offset = srcOffset + head;
+        range.src_length = body;
+        range.dest_offset = dstOffset + head;
+        if(body > 0 && ioctl(fileno(dst), FICLONERANGE, &range) == 0) {
+            u64 tail = head + body;
+            return _afs_copyRange(src, dst, srcOffset, dstOffset, head, buffer, buffer_size) != 0
+                || _afs_copyRange(src, dst, srcOffset + tail, dstOffset + tail, size - tail, buffer, buffer_size) != 0;
+        }
+    }
+    #endif
+    return _afs_copyRange(src, dst, srcOffset, dstOffset, size, buffer, buffer_size);
+}
+
+/** Copies a range of another file to the file of a bulk writer, behind everything that was written so far.
+ * With direct I/O the data is read straight into the buffer of the writer,
+ * and the range is dropped from the page cache of the other file afterwards, it was only read to be copied.
+ * Without it, the range is cloned with _afs_cloneRange().
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @return 0 if successful, 1 if reading or writing failed.
+ */
+int _afs_bulkCopy(struct AfsBulkWriter* writer, FILE* src, u64 srcOffset, u64 dstOffset, u64 size, u8* buffer, u64 buffer_size) {
+    if(_afs_bulkWrite(writer, NULL, 0, dstOffset) != 0) {
+        return 1;
+    }
+    u64 done = 0;
+    while(writer->direct && done < size) {
+        u64 chunk = size - done;
+        if(chunk > writer->bufferSize - writer->fill) chunk = writer->bufferSize - writer->fill;
+        if(_afs_readFile(src, writer->buffer + writer->fill, chunk, srcOffset + done) != chunk) {
+            return 1;
+        }
+        writer->fill += chunk;
+        done += chunk;
+        if(writer->fill == writer->bufferSize && _afs_bulkFlush(writer) != 0) {
+            return 1;
+        }
+    }
+    #ifdef __linux__
+    if(done > 0) {
+        posix_fadvise(fileno(src), srcOffset, done, POSIX_FADV_DONTNEED);
+    }
+    #endif
+    return _afs_cloneRange(src, writer->fp, srcOffset + done, dstOffset + done, size - done, buffer, buffer_size);
+}
+
+/** Gets the aligned buffer used for direct I/O. It's allocated on first use and kept for later rebuilds.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param alignment Alignment of the buffer and its size, see _afs_getDirectAlignment()
+ * @return The buffer, NULL if direct I/O isn't available.
+ */
+u8* _afs_getDirectBuffer(Afs* afs, u64 alignment) {
+    u64 size = (_afs_getChunkSize(afs) + alignment - 1) / alignment * alignment;
+    if(afs->internal->directBuffer != NULL && afs->internal->directBufferSize == size && afs->internal->directAlignment == alignment) {
+        return afs->internal->directBuffer;
+    }
+    free(afs->internal->directBuffer);
+    afs->internal->directBuffer = NULL;
+    afs->internal->directBufferSize = 0;
+    afs->internal->directAlignment = 0;
+    #ifdef __linux__
+    void* buffer;
+    if(posix_memalign(&buffer, alignment, size) == 0) {
+        afs->internal->directBuffer = (u8*)buffer;
+        afs->internal->directBufferSize = size;
+        afs->internal->directAlignment = alignment;
+    }
+    #endif
+    return afs->internal->directBuffer;
+}
+
+/** Sets up the bulk writer of a new file, with direct I/O if it's enabled for the AFS (see afs_setDirectIo()).
+ * In a dry run nothing is written, so direct I/O is never used then.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct whose settings and direct I/O buffer are used
+ * @param writer The bulk writer
+ * @param fp The new file, NULL in a dry run
+ */
+void _afs_initBulkWriter(Afs* afs, struct AfsBulkWriter* writer, FILE* fp) {
+    memset(writer, 0x00, sizeof(struct AfsBulkWriter));
+    writer->fp = fp;
+    if(fp == NULL || afs->internal->dryRun != NULL || !afs->internal->directIo) {
+        return;
+    }
+    u64 alignment = _afs_getDirectAlignment(fp);
+    if(_afs_getDirectBuffer(afs, alignment) != NULL && _afs_setDirectFlag(fp, true) == 0) {
+        writer->direct = true;
+        writer->alignment = alignment;
+        writer->buffer = afs->internal->directBuffer;
+        writer->bufferSize = afs->internal->directBufferSize;
+    }
+}
+
+/** Gives replaced entries up to one block of extra space, so the kept entries behind them
+ * move by a multiple of AFS_CLONEALIGNMENT and can be cloned (see _afs_cloneRange()).
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param order The entries sorted by offset
+ * @param amount The amount of entries in order
+ * @param sources Source for each entry, NULL if the entry is kept
+ * @param info The new entry info array, it's changed in place.
+ * @return The amount of bytes the AFS grew by.
+ */
+u64 _afs_alignForCloning(Afs* afs, const int* order, int amount, const AfsEntrySource** sources, AfsEntryInfo* info) {
+    AfsEntryInfo* oldInfo = afs->header.entryinfo;
+    u64 extra = 0;
+    for(int pos=0;pos<amount;pos++) {
+        int id = order[pos];
+        // Only the first kept entry behind a replaced one has to be checked, the others move along with it
+        if(sources[id] == NULL && pos > 0 && sources[order[pos-1]] != NULL) {
+            u64 misalign = ((info[id].offset + extra) % AFS_CLONEALIGNMENT + AFS_CLONEALIGNMENT - oldInfo[id].offset % AFS_CLONEALIGNMENT) % AFS_CLONEALIGNMENT;
+            if(misalign != 0) {
+                extra += AFS_CLONEALIGNMENT - misalign;
+            }
+        }
+        info[id].offset += extra;
+    }
+    info[afs->header.entrycount].offset += extra;
+    return extra;
+}
+
+/** Syncs the directory of a file, so a rename within it is on the disk as well.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_syncDirectory(const char* filePath) {
+    #ifdef __unix__
+    char* dir = _afs_copyString(filePath);
+    char* sep = strrchr(dir, PATH_SEP);
+    if(sep == NULL) {
+        strcpy(dir, ".");
+    }
+    else {
+        sep[sep == dir ? 1 : 0] = '\0';
+    }
+    int fd = open(dir, O_RDONLY);
+    if(fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+    #endif
+}
+
+/** Creates a temporary file next to the AFS, with the permissions of the AFS file.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param tmpPath Receives the path of the new file, free it with free().
+ * @return The new file, NULL if it couldn't be created.
+ */
+FILE* _afs_createTempFile(Afs* afs, char** tmpPath) {
+    char* path = (char*)malloc(strlen(afs->internal->filePath) + sizeof(".XXXXXX"));
+    sprintf(path, "%s.XXXXXX", afs->internal->filePath);
+    FILE* fp = NULL;
+    #ifdef __unix__
+    int fd = mkstemp(path);
+    if(fd >= 0) {
+        // The new file gets the permissions of the old one
+        struct stat st;
+        if(fstat(fileno(afs->fstream), &st) == 0) {
+            fchmod(fd, st.st_mode & 07777);
+        }
+        fp = fdopen(fd, "w+b");
+    }
+    #endif
+    #ifdef _WIN32
+    if(_mktemp_s(path, strlen(path) + 1) == 0) {
+        fp = fopen(path, "w+b");
+    }
+    #endif
+    if(fp == NULL) {
+        _afs_LogError("ERROR: _afs_createTempFile - Couldn't create the temporary file.");
+        _afs_LogErrorF("Filepath: %s\n", path);
+        free(path);
+        return NULL;
+    }
+    *tmpPath = path;
+    return fp;
+}
+
+/** How often and how long (in milliseconds) reopening the AFS file after a rebuild is retried on Windows. */
+#define AFS_REOPENRETRIES 10
+#define AFS_REOPENDELAY 50
+
+/** Finishes a file written by _afs_rebuildToNewFile() and renames it over the AFS file, which the handle then uses.
+ * If anything failed before or fails here, the file is removed instead and the AFS is unchanged.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param fp The new file
+ * @param tmpPath Path of the new file, it's freed.
+ * @param writer The bulk writer of the new file
+ * @param newSize Final size of the new file
+ * @param ret 0 if the new file was written successfully
+ * @return 0 if successful, 1 if the AFS file wasn't replaced.
+ * On Windows, 1 is also returned if the AFS file couldn't be reopened, afs->fstream is NULL then.
+ */
+int _afs_swapRebuiltFile(Afs* afs, FILE* fp, char* tmpPath, struct AfsBulkWriter* writer, u64 newSize, int ret) {
+    // The last direct write is padded, so the file only gets its real size now
+    if(ret == 0 && (_afs_bulkFlush(writer) != 0
+        || (writer->direct && _afs_setDirectFlag(fp, false) != 0)
+        || _afs_truncateFile(fp, newSize) != 0
+        || _afs_syncFile(fp) != 0)) {
+        ret = 1;
+    }
+
+    #ifdef __unix__
+    if(ret == 0 && rename(tmpPath, afs->internal->filePath) != 0) {
+        ret = 1;
+    }
+    if(ret == 0) {
+        _afs_syncDirectory(afs->internal->filePath);
+        fclose(afs->fstream);
+        afs->fstream = fp;
+    }
+    else {
+        fclose(fp);
+        remove(tmpPath);
+    }
+    #endif
+    #ifdef _WIN32
+    // Windows can't replace a file that is still open
+    fclose(fp);
+    if(ret == 0) {
+        fclose(afs->fstream);
+        if(!MoveFileExA(tmpPath, afs->internal->filePath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+            ret = 1;
+        }
+        // Whether the old or the new file is there now, it's reopened.
+        // Scanners often hold a fresh file for a moment, so a failed open is retried a few times.
+        afs->fstream = fopen(afs->internal->filePath, "rb+");
+        for(int i=0;i<AFS_REOPENRETRIES && afs->fstream == NULL;i++) {
+            Sleep(AFS_REOPENDELAY);
+            afs->fstream = fopen(afs->internal->filePath, "rb+");
+        }
+        if(afs->fstream == NULL) {
+            // Every function rejects a handle without a stream, only afs_free() can be used on it
+            _afs_LogError("ERROR: _afs_swapRebuiltFile - Couldn't reopen the AFS file, the handle can only be freed.");
+            _afs_LogErrorF("Filepath: %s\n", afs->internal->filePath);
+            ret = 1;
+        }
+    }
+    if(ret != 0) {
+        remove(tmpPath);
+    }
+    #endif
+    free(tmpPath);
+    return ret;
+}
+
+/** Writes a buffer into the file of a rebuild, in a dry run it's only counted.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @return 0 if successful, 1 if writing failed.
+ */
+int _afs_rebuildWrite(Afs* afs, struct AfsBulkWriter* writer, const void* src, u64 size, u64 offset) {
+    if(afs->internal->dryRun != NULL) {
+        afs->internal->dryRun->plan->bytesWritten += size;
+        return 0;
+    }
+    return _afs_bulkWrite(writer, src, size, offset);
+}
+
+/** Copies a range of the AFS file into the file of a rebuild, see _afs_bulkCopy().
+ * A dry run counts it as read and written, whether or not the filesystem could clone it.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @return 0 if successful, 1 if reading or writing failed.
+ */
+int _afs_rebuildCopy(Afs* afs, struct AfsBulkWriter* writer, u64 srcOffset, u64 dstOffset, u64 size, u8* buffer, u64 buffer_size) {
+    if(afs->internal->dryRun != NULL) {
+        afs->internal->dryRun->plan->bytesRead += size;
+        afs->internal->dryRun->plan->bytesWritten += size;
+        return 0;
+    }
+    return _afs_bulkCopy(writer, afs->fstream, srcOffset, dstOffset, size, buffer, buffer_size);
+}
+
+/** Rebuilds the AFS into a new layout like _afs_applyLayout(), but into a temporary file next to the AFS,
+ * which is synced and renamed over the original. Until the rename, the AFS file isn't touched at all.
+ * Kept entries are cloned from the old file with _afs_cloneRange(), neighbouring kept entries
+ * that move by the same distance are cloned in one go, together with the padding between them.
+ * Padding doesn't have to be written, the new file is created with its final size and is zero-filled already.
+ * In a dry run no file is created, the writes and copies are only counted for the plan.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct, its entry info is replaced by the new one and its file by the new file.
+ * @param order The entries sorted by offset, the new layout must keep this order.
+ * @param amount The amount of entries in order
+ * @param sources Source for each entry, NULL if the entry is kept
+ * @param newInfo The new entry info array (entrycount + 1 elements). Replaced entries might get some extra space, see _afs_alignForCloning().
+ * @param moved Receives the amount of bytes of kept entries that changed their offset (may be NULL)
+ * @return 0 if successful, 1 if the new file couldn't be written (the AFS is unchanged).
+ */
+int _afs_rebuildToNewFile(Afs* afs, const int* order, int amount, const AfsEntrySource** sources, const AfsEntryInfo* newInfo, u64* moved) {
+    if(afs->internal->filePath == NULL) {
+        _afs_LogError("ERROR: _afs_rebuildToNewFile - The path of the AFS is unknown.");
+        return 1;
+    }
+    // Kept data is cloned straight from the file, so nothing may be left in the journal
+    if(_afs_journalCommit(afs) != 0) {
+        return 1;
+    }
+
+    int count = afs->header.entrycount;
+    AfsEntryInfo* oldInfo = afs->header.entryinfo;
+    AfsEntryMetadata* meta = _afs_getMeta(afs);
+    u64 infoSize = sizeof(AfsEntryInfo) * (count + 1);
+    AfsEntryInfo* info = (AfsEntryInfo*)malloc(infoSize);
+    memcpy(info, newInfo, infoSize);
+    u64 extra = _afs_alignForCloning(afs, order, amount, sources, info);
+    if((u64)newInfo[count].offset + extra + newInfo[count].size > AFS_MAXOFFSET) {
+        memcpy(info, newInfo, infoSize);
+    }
+    u64 newSize = _afs_alignUp((u64)info[count].offset + info[count].size);
+
+    // A dry run only counts what would be written, no temporary file is created
+    bool dry = afs->internal->dryRun != NULL;
+    char* tmpPath = NULL;
+    FILE* fp = NULL;
+    if(!dry) {
+        fp = _afs_createTempFile(afs, &tmpPath);
+        if(fp == NULL) {
+            free(info);
+            return 1;
+        }
+    }
+
+    // Everything is written front to back, with direct I/O if it's enabled (see afs_setDirectIo())
+    struct AfsBulkWriter writer;
+    _afs_initBulkWriter(afs, &writer, fp);
+    // Sources are written through a handle on the new file, so _afs_writeSource() can be used as it is
+    Afs out;
+    struct AfsInternal outInternal;
+    memset(&out, 0x00, sizeof(Afs));
+    memset(&outInternal, 0x00, sizeof(struct AfsInternal));
+    out.internal = &outInternal;
+    out.fstream = fp;
+    outInternal.chunkSize = afs->internal->chunkSize;
+    outInternal.bulk = &writer;
+    Afs* target = dry ? afs : &out;
+
+    u64 bufferSize = _afs_getChunkSize(afs);
+    u8* buffer = (u8*)malloc(bufferSize);
+    _afs_trackMemory(afs, bufferSize + infoSize);
+    u64 movedBytes = 0;
+    int ret = dry ? 0 : _afs_truncateFile(fp, newSize);
+    if(ret == 0) {
+        ret = _afs_rebuildWrite(afs, &writer, &afs->header, 8, 0) != 0 || _afs_rebuildWrite(afs, &writer, info, infoSize, 8) != 0;
+    }
+
+    // Whatever is between the entry info and the first entry is kept
+    u64 oldFirst = (amount > 0) ? oldInfo[order[0]].offset : oldInfo[count].offset;
+    u64 newFirst = (amount > 0) ? info[order[0]].offset : info[count].offset;
+    u64 headEnd = oldFirst < newFirst ? oldFirst : newFirst;
+    if(ret == 0 && headEnd > 8 + infoSize) {
+        ret = _afs_rebuildCopy(afs, &writer, 8 + infoSize, 8 + infoSize, headEnd - 8 - infoSize, buffer, bufferSize);
+    }
+    for(int pos=0;pos<amount && ret == 0;pos++) {
+        int id = order[pos];
+        if(sources[id] != NULL) {
+            ret = _afs_writeSource(target, sources[id], info[id].size, info[id].offset, buffer, bufferSize);
+            continue;
+        }
+        int last = pos;
+        s64 delta = (s64)info[id].offset - oldInfo[id].offset;
+        while(last + 1 < amount && sources[order[last+1]] == NULL && (s64)info[order[last+1]].offset - oldInfo[order[last+1]].offset == delta) {
+            last++;
+        }
+        u64 size = (u64)oldInfo[order[last]].offset + oldInfo[order[last]].size - oldInfo[id].offset;
+        ret = _afs_rebuildCopy(afs, &writer, oldInfo[id].offset, info[id].offset, size, buffer, bufferSize);
+        if(delta != 0) {
+            movedBytes += size;
+        }
+        pos = last;
+    }
+    // The whole metadata section is in memory, including anything stored behind the records (see _afs_getMeta()),
+    // and it might already be changed there, e.g. by _afs_insertSlot()
+    if(ret == 0) {
+        ret = _afs_rebuildWrite(afs, &writer, meta, info[count].size, info[count].offset);
+    }
+    free(buffer);
+    _afs_trackMemory(afs, -(s64)bufferSize);
+    if(dry) {
+        afs->internal->dryRun->fileSize = newSize;
+    }
+    else {
+        ret = _afs_swapRebuiltFile(afs, fp, tmpPath, &writer, newSize, ret);
+    }
+
+    if(ret != 0) {
+        _afs_LogError("ERROR: _afs_rebuildToNewFile - Failed to write the new AFS file, the AFS is unchanged.");
+        free(info);
+        _afs_trackMemory(afs, -(s64)infoSize);
+        return 1;
+    }
+    memcpy(oldInfo, info, infoSize);
+    free(info);
+    _afs_trackMemory(afs, -(s64)infoSize);
+    _afs_invalidateFreeExtents(afs);
+    _afs_clearDirty(afs, true, true);
+    if(!dry && afs->internal->journal != NULL) {
+        afs->internal->journal->fileSize = newSize;
+        afs->internal->journal->baseSize = newSize;
+    }
+    if(moved != NULL) {
+        *moved = movedBytes;
+    }
+    return 0;
+}
+
+/** Replaces a single entry that doesn't fit into its space by rebuilding the AFS into a new file, see AFS_GROWTH_REBUILD.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ * @param source Source of the new data
+ * @param size Size of the new data
+ * @return 0 if successful, 4 if the AFS would grow past AFS_MAXOFFSET, 5 if the rebuild failed.
+ */
+int _afs_replaceRebuilding(Afs* afs, int id, const AfsEntrySource* source, u64 size) {
+    int count = afs->header.entrycount;
+    const AfsEntrySource** sources = (const AfsEntrySource**)calloc(count + 1, sizeof(AfsEntrySource*));
+    u64* sizes = (u64*)calloc(count + 1, sizeof(u64));
+    u64 tableSize = (sizeof(AfsEntrySource*) + sizeof(u64)) * (count + 1) + sizeof(AfsEntryInfo) * (count + 1);
+    _afs_trackMemory(afs, tableSize);
+    sources[id] = source;
+    sizes[id] = size;
+
+    int amount;
+    int* order = _afs_getOffsetOrder(afs, &amount);
+    int placed = amount;
+    AfsEntryInfo* newInfo = (AfsEntryInfo*)malloc(sizeof(AfsEntryInfo) * (count + 1));
+    u64 newEnd = _afs_planSequential(afs, order, &amount, sources, sizes, newInfo, true);
+    if(newEnd > AFS_MAXOFFSET) {
+        amount = placed;
+        newEnd = _afs_planSequential(afs, order, &amount, sources, sizes, newInfo, false);
+    }
+
+    int ret = 0;
+    if(newEnd > AFS_MAXOFFSET) {
+        ret = 4;
+    }
+    else {
+        AfsEntryMetadata* meta = _afs_getMeta(afs);
+        u32 oldSize = meta[id].filesize;
+        meta[id].filesize = size;
+        if(_afs_applyLayout(afs, order, amount, sources, newInfo, NULL) != 0) {
+            meta[id].filesize = oldSize;
+            ret = 5;
+        }
+        else {
+            for(int pos=0;pos<amount;pos++) {
+                if(order[pos] == id) _afs_setReservedSpace(afs, id, _afs_getReservedSpace(afs->header.entryinfo, count, order, amount, pos));
+            }
+            _afs_setAction(afs, id, amount > placed ? AFS_EDIT_RELOCATE : AFS_EDIT_SHIFT);
+        }
+    }
+
+    free(newInfo);
+    free(order);
+    free(sources);
+    free(sizes);
+    _afs_trackMemory(afs, -(s64)(tableSize + sizeof(int) * count));
+    return ret;
+}
+
+Afs* afs_open(char* filePath) {
+    return afs_openEx(filePath, AFS_OPEN_READWRITE);
+}
+
+/** Allocates a zeroed AFS handle together with its internal state, both are freed with a single free().
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+Afs* _afs_allocHandle() {
+    Afs* afs = (Afs*)calloc(1, sizeof(Afs) + sizeof(struct AfsInternal));
+    afs->internal = (struct AfsInternal*)(afs + 1);
+    return afs;
+}
+
+Afs* afs_openEx(char* filePath, int flags) {
+    if(filePath == NULL || *filePath == '\0') {
+        return NULL;
+    }
+    FILE* fp = fopen(filePath, (flags & AFS_OPEN_READONLY) ? "rb" : "rb+");
+
+    if(fp == NULL) {
+        if(flags & AFS_OPEN_READONLY) {
+            _afs_LogError("ERROR: afs_open - AFS Filepath invalid.");
+        }
+        else {
+            _afs_LogError(  "ERROR: afs_open - AFS Filepath invalid." \
+                            "Make sure that you have read+write permission for this file.");
+        }
+        _afs_LogErrorF("Filepath: %s\n", filePath);
+        return NULL;
+    }
+    // A batch that was interrupted while it was applied is finished first
+    char* journalPath = _afs_journalPath(filePath);
+    bool journaled = (flags & AFS_OPEN_JOURNAL) && !(flags & AFS_OPEN_READONLY);
+    int recovered = _afs_journalRecover(fp, journalPath, flags & AFS_OPEN_READONLY);
+    if(recovered == 1 || (recovered == 2 && journaled)) {
+        if(recovered == 1) {
+            _afs_LogError("ERROR: afs_open - The AFS couldn't be recovered from its journal.");
+        }
+        else {
+            _afs_LogError("ERROR: afs_open - The AFS is already opened with AFS_OPEN_JOURNAL by another handle.");
+        }
+        free(journalPath);
+        fclose(fp);
+        return NULL;
+    }
+    if(recovered == 2 && !(flags & AFS_OPEN_READONLY)) {
+        _afs_LogError("WARNING: afs_open - The AFS is opened with AFS_OPEN_JOURNAL by another handle, edits through both handles can get mixed up.");
+    }
+    Afs* afs = _afs_allocHandle();
+    afs->fstream = fp;
+    afs->openFlags = flags;
+    afs->internal->filePath = _afs_copyString(filePath);
+    if(journaled) {
+        afs->internal->journal = _afs_journalOpen(journalPath, _afs_getStreamSize(fp));
+        if(afs->internal->journal == NULL) {
+            fclose(fp);
+            free(afs->internal->filePath);
+            free(afs);
+            return NULL;
+        }
+    }
+    else {
+        free(journalPath);
+    }
+
+    // The header and the entry info usually fit into the space before the first entry,
+    // so both are read at once and a second read is only needed for very large tables.
+    u8 head_buf[AFS_RESERVEDSPACEBUFFER];
+    u64 got = _afs_readAt(afs, head_buf, sizeof(head_buf), 0);
+    if(got < 8) {
+        _afs_LogError("ERROR: afs_open - File is too small to be an AFS.");
+        _afs_journalClose(afs);
+        fclose(fp);
+        free(afs->internal->filePath);
+        free(afs);
+        return NULL;
+    }
+    AfsHeader* head = &afs->header;
+    memcpy(head, head_buf, 8);
+
+    // Read Info for all files in the AFS
+    u64 infoSize = ((u64)head->entrycount + 1) * sizeof(AfsEntryInfo);
+    head->entryinfo = (AfsEntryInfo*)malloc(infoSize);
+    u64 buffered = (got - 8 < infoSize) ? got - 8 : infoSize;
+    memcpy(head->entryinfo, head_buf + 8, buffered);
+    if(buffered < infoSize && _afs_readAt(afs, (u8*)head->entryinfo + buffered, infoSize - buffered, 8 + buffered) != infoSize - buffered) {
+        _afs_LogError("ERROR: afs_open - Entry info exceeds the file size.");
+        afs_free(afs);
+        return NULL;
+    }
+
+    // Read Metadata for all files in the AFS
+    if(!(flags & AFS_OPEN_LAZYMETA)) {
+        _afs_getMeta(afs);
+    }
+
+    return afs;
+}
+
+int afs_loadMetadata(Afs* afs) {
+    if(afs == NULL || afs->header.entryinfo == NULL) {
+        _afs_LogError("ERROR: afs_loadMetadata - Invalid AFS pointer.");
+        return 1;
+    }
+    _afs_getMeta(afs);
+    return 0;
+}
+
+/** Releases a handle that afs_openMapped() gave up on after mapping the file.
+ * afs_free() can't be used there, the entry info might not be set up yet.
+ * @note DESIGNED FOR INTERNAL USE ONLY
+ */
+void _afs_freeFailedMapping(Afs* afs) {
+    #ifdef __unix__
+    munmap(afs->internal->mapping, afs->internal->mappingSize);
+    #endif
+    #ifdef _WIN32
+    UnmapViewOfFile(afs->internal->mapping);
+    CloseHandle(afs->internal->mappingHandle);
+    #endif
+    fclose(afs->fstream);
+    free(afs);
+}
+
+Afs* afs_openMapped(char* filePath) {
+    if(filePath == NULL || *filePath == '\0') {
+        return NULL;
+    }
+    FILE* fp = fopen(filePath, "rb");
+
+    if(fp == NULL) {
+        _afs_LogError("ERROR: afs_openMapped - AFS Filepath invalid.");
+        _afs_LogErrorF("Filepath: %s\n", filePath);
+        return NULL;
+    }
+    char* journalPath = _afs_journalPath(filePath);
+    _afs_journalRecover(fp, journalPath, true);
+    free(journalPath);
+    Afs* afs = _afs_allocHandle();
+    afs->fstream = fp;
+    afs->openFlags = AFS_OPEN_READONLY;
+
+    #ifdef __unix__
+    struct stat st;
+    if(fstat(fileno(fp), &st) != 0 || st.st_size < 8) {
+        _afs_LogError("ERROR: afs_openMapped - File is too small to be an AFS.");
+        fclose(fp);
+        free(afs);
+        return NULL;
+    }
+    afs->internal->mappingSize = st.st_size;
+    void* map = mmap(NULL, afs->internal->mappingSize, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if(map == MAP_FAILED) {
+        _afs_LogError("ERROR: afs_openMapped - mmap failed.");
+        perror(NULL);
+        fclose(fp);
+        free(afs);
+        return NULL;
+    }
+    afs->internal->mapping = (u8*)map;
+    #endif
+    #ifdef _WIN32
+    HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(fp));
+    LARGE_INTEGER fsize;
+    if(!GetFileSizeEx(hFile, &fsize) || fsize.QuadPart < 8) {
+        _afs_LogError("ERROR: afs_openMapped - File is too small to be an AFS.");
+        fclose(fp);
+        free(afs);
+        return NULL;
+    }
+    afs->internal->mappingSize = fsize.QuadPart;
+    afs->internal->mappingHandle = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(afs->internal->mappingHandle != NULL) {
+        afs->internal->mapping = (u8*)MapViewOfFile(afs->internal->mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    }
+    if(afs->internal->mapping == NULL) {
+        _afs_LogError("ERROR: afs_openMapped - Failed to map the file.");
+        if(afs->internal->mappingHandle != NULL) CloseHandle(afs->internal->mappingHandle);
+        fclose(fp);
+        free(afs);
+        return NULL;
+    }
+    #endif
+
+    // The header and the entry info array are read in-place from the mapping
+    AfsHeader* head = &afs->header;
+    memcpy(head, afs->internal->mapping, 8);
+    u64 infoEnd = 8 + ((u64)head->entrycount + 1) * sizeof(AfsEntryInfo);
+    if(infoEnd > afs->internal->mappingSize) {
+        _afs_LogError("ERROR: afs_openMapped - Entry info exceeds the file size.");
+        _afs_freeFailedMapping(afs);
+        return NULL;
+    }
+    head->entryinfo = (AfsEntryInfo*)(afs->internal->mapping + 8);
+
+    AfsEntryInfo metaInfo = head->entryinfo[head->entrycount];
+    if((u64)metaInfo.offset + metaInfo.size > afs->internal->mappingSize) {
+        _afs_LogError("ERROR: afs_openMapped - Metadata section exceeds the file size.");
+        _afs_freeFailedMapping(afs);
+        return NULL;
+    }
+    // A short (or missing) metadata section would be indexed past its end,
+    // it's left to _afs_getMeta(), which reads it into a padded copy.
+    if(metaInfo.size >= (u64)head->entrycount * sizeof(AfsEntryMetadata)) {
+        afs->meta = (AfsEntryMetadata*)(afs->internal->mapping + metaInfo.offset);
+    }
+
+    return afs;
+}
+
+void afs_free(Afs* afs) {
+    if(afs == NULL) {
+        puts("WARNING: afs_free - afs pointer already freed. Returning.");
+        return;
+    }
+    if(afs->internal->transaction != NULL) {
+        _afs_LogError("WARNING: afs_free - A transaction is still open, its edits are discarded.");
+        _afs_freeTransaction(afs->internal->transaction, afs->header.entrycount);
+    }
+    else if(_afs_flushDirty(afs) != 0 || _afs_journalCommit(afs) != 0) {
+        _afs_LogError("ERROR: afs_free - Failed to write back changed entry info or metadata.");
+    }
+    _afs_clearDirty(afs, true, true);
+    _afs_journalClose(afs);
+    if(afs->internal->mapping != NULL) {
+        // entryinfo and meta live inside the mapping, unless meta is a padded copy (see afs_openMapped())
+        if(afs->header.entryinfo[afs->header.entrycount].size < (u64)afs->header.entrycount * sizeof(AfsEntryMetadata)) {
+            free(afs->meta);
+        }
+        #ifdef __unix__
+        munmap(afs->internal->mapping, afs->internal->mappingSize);
+        #endif
+        #ifdef _WIN32
+        UnmapViewOfFile(afs->internal->mapping);
+        CloseHandle(afs->internal->mappingHandle);
+        #endif
+    }
+    else {
+        free(afs->meta);
+        free(afs->header.entryinfo);
+    }
+    free(afs->internal->freeExtents);
+    free(afs->internal->reservedSpace);
+    free(afs->internal->filePath);
+    free(afs->internal->directBuffer);
+    if(afs->fstream != NULL) {
+        fclose(afs->fstream);
+    }
+    free(afs);
+    afs = NULL;
+}
+
+int afs_save(Afs* afs, char* filepath) {
+    if(afs == NULL) {
+        _afs_LogError("ERROR: afs_save - Invalid AFS pointer");
+        return 1;
+    }
+    if(filepath == NULL || *filepath == 0x00) {
+        _afs_LogError("ERROR: afs_save - Invalid filepath.");
+        return 2;
+    }
+    FILE* fp = fopen(filepath, "w+b");
+    if(fp == NULL) {
+        _afs_LogErrorF( "ERROR: afs_save - Couldn't create file.\n" \
+                        "Filepath: '%s'\n", filepath);
+        perror(NULL);
+        return 3;
+    }
+
+    if(*afs->header.identifier != 'A' || (afs->header.entrycount > 0 && afs->header.entryinfo == NULL)) {
+        _afs_LogError("ERROR: afs_save - afs->header is invalid.");
+        return 3;
+    }
+    AfsEntryMetadata* meta = (afs->openFlags & AFS_OPEN_LAZYMETA) ? _afs_getMeta(afs) : afs->meta;
+    if(meta == NULL) {
+        _afs_LogError("ERROR: afs_save - afs->meta is invalid.");
+        return 3;
+    }
+
+    fwrite(&afs->header, 1, 8, fp);
+    fwrite(afs->header.entryinfo, sizeof(AfsEntryInfo), afs->header.entrycount+1, fp);
+    fseeko(fp, afs->header.entryinfo[afs->header.entrycount].offset, SEEK_SET);
+    fwrite(meta, sizeof(AfsEntryMetadata), afs->header.entrycount, fp);
+
+    fclose(fp);
+
+    return 0;
+}
+
+int afs_create(char* filepath, const AfsEntrySource* sources, const AfsEntryMetadata* meta, int amount_entries, int spare_slots, bool direct_io) {
+    if(amount_entries < 0 || spare_slots < 0 || (amount_entries > 0 && sources == NULL)) {
+        _afs_LogError("ERROR: afs_create - Invalid sources or amounts.");
+        return 1;
+    }
+    if(filepath == NULL || *filepath == 0x00) {
+        _afs_LogError("ERROR: afs_create - Invalid filepath.");
+        return 2;
+    }
+
+    // The entries follow the entry info and its spare slots, each one padded to AFS_RESERVEDSPACEBUFFER, the metadata comes last
+    int count = amount_entries;
+    u64 infoSize = sizeof(AfsEntryInfo) * (count + 1);
+    u64 metaSize = sizeof(AfsEntryMetadata) * count;
+    AfsEntryInfo* info = (AfsEntryInfo*)malloc(infoSize);
+    u64 offset = _afs_alignUp(8 + infoSize + sizeof(AfsEntryInfo) * (u64)spare_slots);
+    for(int i=0;i<count;i++) {
+        u64 size;
+        if(!_afs_getSourceSize(&sources[i], &size)) {
+            _afs_LogErrorF("ERROR: afs_create - Invalid source for entry %d.\n", i);
+            free(info);
+            return 3;
+        }
+        if(offset + size > AFS_MAXOFFSET) {
+            _afs_LogError("ERROR: afs_create - The entries don't fit into an AFS.");
+            free(info);
+            return 4;
+        }
+        info[i].offset = offset;
+        info[i].size = size;
+        offset = _afs_alignUp(offset + size);
+    }
+    if(offset + metaSize > AFS_MAXOFFSET) {
+        _afs_LogError("ERROR: afs_create - The entries don't fit into an AFS.");
+        free(info);
+        return 4;
+    }
+    info[count].offset = offset;
+    info[count].size = metaSize;
+    u64 fileSize = _afs_alignUp(offset + metaSize);
+
+    // Without given metadata, every entry gets its name and size from its source and the current date
+    AfsEntryMetadata* ownMeta = NULL;
+    if(meta == NULL) {
+        ownMeta = (AfsEntryMetadata*)calloc(count > 0 ? count : 1, sizeof(AfsEntryMetadata));
+        time_t current_time = time(NULL);
+        struct tm tm = *localtime(&current_time);
+        for(int i=0;i<count;i++) {
+            _afs_setReplacedMetadata(ownMeta, i, &sources[i], info[i].size, &tm);
+        }
+        meta = ownMeta;
+    }
+
+    FILE* fp = fopen(filepath, "w+b");
+    if(fp == NULL) {
+        _afs_LogErrorF( "ERROR: afs_create - Couldn't create file.\n" \
+                        "Filepath: '%s'\n", filepath);
+        perror(NULL);
+        free(ownMeta);
+        free(info);
+        return 5;
+    }
+
+    // Everything is written front to back through a bulk writer, like a rebuild (see _afs_rebuildToNewFile()),
+    // so the sources can be written with _afs_writeSource() and direct I/O works the same way
+    Afs* afs = _afs_allocHandle();
+    afs->fstream = fp;
+    afs->internal->directIo = direct_io;
+    struct AfsBulkWriter writer;
+    _afs_initBulkWriter(afs, &writer, fp);
+    afs->internal->bulk = &writer;
+
+    u64 bufferSize = _afs_getChunkSize(afs);
+    u8* buffer = (u8*)malloc(bufferSize);
+    AfsHeader header;
+    memcpy(header.identifier, "AFS", 4);
+    header.entrycount = count;
+    // The file gets its final size first, so the padding between the entries is zero-filled already
+    int ret = _afs_truncateFile(fp, fileSize);
+    if(ret == 0) {
+        ret = _afs_writeAt(afs, &header, 8, 0) != 8 || _afs_writeAt(afs, info, infoSize, 8) != infoSize;
+    }
+    for(int i=0;i<count && ret == 0;i++) {
+        ret = _afs_writeSource(afs, &sources[i], info[i].size, info[i].offset, buffer, bufferSize);
+    }
+    if(ret == 0) {
+        ret = _afs_writeAt(afs, meta, metaSize, info[count].offset) != metaSize;
+    }
+    // The last direct write is padded, so the file only gets its real size now
+    if(ret == 0 && (_afs_bulkFlush(&writer) != 0
+        || (writer.direct && _afs_setDirectFlag(fp, false) != 0)
+        || _afs_truncateFile(fp, fileSize) != 0)) {
+        ret = 1;
+    }
+    if(fclose(fp) != 0) {
+        ret = 1;
+    }
+    if(ret != 0) {
+        _afs_LogErrorF( "ERROR: afs_create - Failed to write the AFS, the file is removed.\n" \
+                        "Filepath: '%s'\n", filepath);
+        remove(filepath);
+        ret = 5;
+    }
+
+    free(buffer);
+    free(afs->internal->directBuffer);
+    free(afs);
+    free(ownMeta);
+    free(info);
+    return ret;
+}
+
+int afs_getEntrycount(Afs* afs) {
+    return afs->header.entrycount;
+}
+
+AfsEntryInfo afs_getEntryinfo(Afs* afs, int id) {
+    AfsEntryInfo out;
+    memset(&out, 0x00, sizeof(AfsEntryInfo));
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_getEntryinfo - Invalid AFS pointer (afs or afs->fstream).");
+        return out;
+    }
+
+    if(id < 0 || id > afs->header.entrycount) {
+        _afs_LogError("ERROR: afs_getEntryinfo - Entry ID out of range.");
+        _afs_LogErrorF("Entry ID: %d\tAFS entry count: %d\n", id, afs->header.entrycount);
+        return out;
+    }
+
+    memcpy(&out, &afs->header.entryinfo[id], sizeof(AfsEntryInfo));
+    return out;
+}
+
+int afs_extractEntryToFile(Afs* afs, int id, const char* folderpath, char* filepath) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_extractEntryToFile - Invalid AFS pointer (afs or afs->fstream).");
+        return 1;
+    }
+
+    if(id < 0 || id > afs->header.entrycount) {
+        _afs_LogError("ERROR: afs_extractEntryToFile - Entry ID out of range.");
+        _afs_LogErrorF("Entry ID: %d\tAFS entry count: %d\n", id, afs->header.entrycount);
+        return 2;
+    }
+
+    if(folderpath == NULL || *folderpath == 0x00 ) {
+        _afs_LogError("ERROR: afs_extractEntryToFile - folderpath invalid.");
+        return 3;
     }
 
-    int off = afs->header.entryinfo[id].offset;
-    int size = afs->header.entryinfo[id].size;
-    u8* buffer = (u8*)malloc(size);
-
     int folderpath_len = strlen(folderpath);
 
-    // create output file path buffer and zero it out
-    char* outpath = (char*)malloc(folderpath_len + AFSMETA_NAMEBUFFERSIZE + 2);
-    memset(outpath, 0x00, folderpath_len + AFSMETA_NAMEBUFFERSIZE + 2);
+    // create output file path buffer and zero it out
+    char* outpath = (char*)malloc(folderpath_len + AFSMETA_NAMEBUFFERSIZE + 2);
+    memset(outpath, 0x00, folderpath_len + AFSMETA_NAMEBUFFERSIZE + 2);
+
+    // copy the location of the output file path
+    strncpy(outpath, folderpath, folderpath_len);
+
+    // at this point, the given argument might be "/path/to/dir/"
+    // or it might be "path/to/dir" (notice the missing slash at the end)
+    // we need to ensure both args lead to the same result
+    if(outpath[folderpath_len-1] != PATH_SEP) {
+        outpath[folderpath_len] = PATH_SEP;
+    }
+
+    AfsEntryMetadata* meta = _afs_getMeta(afs);
+    if(*meta[id].filename != 0x00) {
+        strncat(outpath, meta[id].filename, AFSMETA_NAMEBUFFERSIZE);
+    }
+    else {
+        char temp[AFSMETA_NAMEBUFFERSIZE];
+        snprintf(temp, AFSMETA_NAMEBUFFERSIZE, "blank_%d", id);
+        strncat(outpath, temp, AFSMETA_NAMEBUFFERSIZE);
+    }
+
+    int outpathLen = strlen(outpath);
+
+    if(filepath != NULL) {
+        strncpy(filepath, outpath, PATH_MAX-1);
+        filepath[PATH_MAX-1] = 0x00;
+    }
+
+    u8* buffer = NULL;
+    u64 bufferSize = 0;
+    int ret = _afs_writeEntryToFile(afs, id, outpath, &buffer, &bufferSize);
+    free(buffer);
+
+    if(ret == 1) {
+        _afs_LogError("ERROR: afs_extractEntryToFile - File pointer failed to create.");
+        _afs_LogErrorF("outfile path: %s\n", outpath);
+        free(outpath);
+        return 4;
+    }
+    if(ret == 2) {
+        _afs_LogError("ERROR: afs_extractEntryToFile - Failed to copy the entry data.");
+        _afs_LogErrorF("outfile path: %s\n", outpath);
+        free(outpath);
+        return 5;
+    }
+
+    free(outpath);
+    return 0;
+}
+
+u8* afs_extractEntryToBuffer(Afs* afs, int id) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_extractEntryToBuffer - Invalid AFS pointer (afs or afs->fstream).");
+        return NULL;
+    }
+
+    if(id < 0 || id > afs->header.entrycount) {
+        _afs_LogError("ERROR: afs_extractEntryToBuffer - Entry ID out of range.");
+        _afs_LogErrorF("Entry ID: %d\tAFS entry count: %d\n", id, afs->header.entrycount);
+        return NULL;
+    }
+
+    AfsEntryInfo info = afs->header.entryinfo[id];
+
+    u8* buffer = (u8*)malloc(info.size);
+    _afs_readAt(afs, buffer, info.size, info.offset);
+
+    return buffer;
+}
+
+s64 afs_readEntry(Afs* afs, int id, u64 offset, u64 length, void* dst) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_readEntry - Invalid AFS pointer (afs or afs->fstream).");
+        return -1;
+    }
+
+    if(id < 0 || id >= afs->header.entrycount) {
+        _afs_LogError("ERROR: afs_readEntry - Entry ID out of range.");
+        _afs_LogErrorF("Entry ID: %d\tAFS entry count: %d\n", id, afs->header.entrycount);
+        return -2;
+    }
+
+    if(dst == NULL && length > 0) {
+        _afs_LogError("ERROR: afs_readEntry - dst is NULL.");
+        return -3;
+    }
+
+    AfsEntryInfo info = afs->header.entryinfo[id];
+    if(offset >= info.size) {
+        return 0;
+    }
+    if(length > info.size - offset) {
+        length = info.size - offset;
+    }
+
+    return _afs_readAt(afs, dst, length, info.offset + offset);
+}
+
+AfsEntryStream* afs_entryOpen(Afs* afs, int id) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_entryOpen - Invalid AFS pointer (afs or afs->fstream).");
+        return NULL;
+    }
+
+    if(id < 0 || id >= afs->header.entrycount) {
+        _afs_LogError("ERROR: afs_entryOpen - Entry ID out of range.");
+        _afs_LogErrorF("Entry ID: %d\tAFS entry count: %d\n", id, afs->header.entrycount);
+        return NULL;
+    }
+
+    AfsEntryStream* stream = (AfsEntryStream*)malloc(sizeof(AfsEntryStream));
+    stream->afs = afs;
+    stream->id = id;
+    stream->offset = afs->header.entryinfo[id].offset;
+    stream->size = afs->header.entryinfo[id].size;
+    stream->position = 0;
+    return stream;
+}
+
+s64 afs_entryRead(AfsEntryStream* stream, void* dst, u64 length) {
+    if(stream == NULL || (dst == NULL && length > 0)) {
+        _afs_LogError("ERROR: afs_entryRead - Invalid stream or destination.");
+        return -1;
+    }
+    if(stream->position >= stream->size) {
+        return 0;
+    }
+    if(length > stream->size - stream->position) {
+        length = stream->size - stream->position;
+    }
+
+    u64 got = _afs_readAt(stream->afs, dst, length, stream->offset + stream->position);
+    stream->position += got;
+    return got;
+}
+
+int afs_entrySeek(AfsEntryStream* stream, s64 offset, int whence) {
+    if(stream == NULL) {
+        _afs_LogError("ERROR: afs_entrySeek - Invalid stream.");
+        return 1;
+    }
+
+    s64 base;
+    switch(whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = stream->position; break;
+        case SEEK_END: base = stream->size; break;
+        default:
+            _afs_LogError("ERROR: afs_entrySeek - Invalid whence.");
+            return 2;
+    }
+    if(base + offset < 0) {
+        return 3;
+    }
+
+    // Like with regular files, seeking past the end is allowed, reads just return 0 there.
+    stream->position = base + offset;
+    return 0;
+}
+
+s64 afs_entryTell(AfsEntryStream* stream) {
+    if(stream == NULL) {
+        _afs_LogError("ERROR: afs_entryTell - Invalid stream.");
+        return -1;
+    }
+    return stream->position;
+}
+
+void afs_entryClose(AfsEntryStream* stream) {
+    if(stream == NULL) {
+        _afs_LogError("WARNING: afs_entryClose - stream pointer already freed. Returning.");
+        return;
+    }
+    free(stream);
+}
+
+#ifdef __GLIBC__
+ssize_t _afs_cookieRead(void* cookie, char* buf, size_t size) {
+    s64 ret = afs_entryRead((AfsEntryStream*)cookie, buf, size);
+    return ret < 0 ? -1 : ret;
+}
+
+int _afs_cookieSeek(void* cookie, off64_t* offset, int whence) {
+    AfsEntryStream* stream = (AfsEntryStream*)cookie;
+    if(afs_entrySeek(stream, *offset, whence) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    *offset = stream->position;
+    return 0;
+}
+
+int _afs_cookieClose(void* cookie) {
+    afs_entryClose((AfsEntryStream*)cookie);
+    return 0;
+}
+#endif
+
+FILE* afs_entryOpenFile(Afs* afs, int id) {
+    #ifdef __GLIBC__
+    AfsEntryStream* stream = afs_entryOpen(afs, id);
+    if(stream == NULL) {
+        return NULL;
+    }
+
+    cookie_io_functions_t funcs;
+    memset(&funcs, 0x00, sizeof(cookie_io_functions_t));
+    funcs.read = _afs_cookieRead;
+    funcs.seek = _afs_cookieSeek;
+    funcs.close = _afs_cookieClose;
+
+    FILE* fp = fopencookie(stream, "rb", funcs);
+    if(fp == NULL) {
+        afs_entryClose(stream);
+    }
+    return fp;
+    #else
+    _afs_LogError("ERROR: afs_entryOpenFile - Not supported on this platform, use afs_entryOpen() instead.");
+    return NULL;
+    #endif
+}
+
+const u8* afs_getEntryView(Afs* afs, int id, u32* size) {
+    if(afs == NULL || afs->internal->mapping == NULL) {
+        _afs_LogError("ERROR: afs_getEntryView - AFS wasn't opened with afs_openMapped().");
+        return NULL;
+    }
+
+    if(id < 0 || id >= afs->header.entrycount) {
+        _afs_LogError("ERROR: afs_getEntryView - Entry ID out of range.");
+        _afs_LogErrorF("Entry ID: %d\tAFS entry count: %d\n", id, afs->header.entrycount);
+        return NULL;
+    }
+
+    AfsEntryInfo info = afs->header.entryinfo[id];
+    if((u64)info.offset + info.size > afs->internal->mappingSize) {
+        _afs_LogError("ERROR: afs_getEntryView - Entry exceeds the file size.");
+        return NULL;
+    }
+
+    if(size != NULL) {
+        *size = info.size;
+    }
+    return afs->internal->mapping + info.offset;
+}
+
+int afs_setIoBackend(Afs* afs, AfsIoBackend backend) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_setIoBackend - Invalid AFS pointer (afs or afs->fstream).");
+        return 1;
+    }
+
+    if(backend == AFS_IOBACKEND_IOURING) {
+        #ifdef AFS_HAVE_IOURING
+        AfsUring ring;
+        if(_afs_uringInit(&ring, AFS_URING_BATCHENTRIES * 4) == 0) {
+            _afs_uringFree(&ring);
+            afs->internal->ioBackend = AFS_IOBACKEND_IOURING;
+            return 0;
+        }
+        #endif
+        _afs_LogError("WARNING: afs_setIoBackend - io_uring isn't available, using the stdio backend.");
+        afs->internal->ioBackend = AFS_IOBACKEND_STDIO;
+        return 2;
+    }
+
+    afs->internal->ioBackend = AFS_IOBACKEND_STDIO;
+    return 0;
+}
+
+int afs_setChunkSize(Afs* afs, u64 chunk_size) {
+    if(afs == NULL) {
+        _afs_LogError("ERROR: afs_setChunkSize - Invalid AFS pointer.");
+        return 1;
+    }
+    afs->internal->chunkSize = chunk_size;
+    return 0;
+}
+
+int afs_setGrowthPolicy(Afs* afs, AfsGrowthPolicy policy) {
+    if(afs == NULL) {
+        _afs_LogError("ERROR: afs_setGrowthPolicy - Invalid AFS pointer.");
+        return 1;
+    }
+    afs->internal->growthPolicy = policy;
+    return 0;
+}
+
+int afs_setDirectIo(Afs* afs, bool enabled) {
+    if(afs == NULL) {
+        _afs_LogError("ERROR: afs_setDirectIo - Invalid AFS pointer.");
+        return 1;
+    }
+    #ifndef __linux__
+    if(enabled) {
+        _afs_LogError("WARNING: afs_setDirectIo - Direct I/O isn't available on this platform, using regular writes.");
+        afs->internal->directIo = false;
+        return 2;
+    }
+    #endif
+    afs->internal->directIo = enabled;
+    if(!enabled) {
+        free(afs->internal->directBuffer);
+        afs->internal->directBuffer = NULL;
+        afs->internal->directBufferSize = 0;
+    }
+    return 0;
+}
+
+int afs_setAccessPattern(Afs* afs, AfsAccessPattern pattern) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_setAccessPattern - Invalid AFS File.");
+        return 1;
+    }
+    if(pattern < AFS_ACCESS_NORMAL || pattern > AFS_ACCESS_SEQUENTIAL) {
+        _afs_LogError("ERROR: afs_setAccessPattern - Invalid access pattern.");
+        _afs_LogErrorF("pattern: %d\n", pattern);
+        return 2;
+    }
+    afs->internal->accessPattern = pattern;
+    _afs_adviseAccess(afs, pattern);
+    return 0;
+}
+
+int afs_prefetch(Afs* afs, const int* ids, int amount_entries) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_prefetch - Invalid AFS File.");
+        return 1;
+    }
+    if(ids == NULL || amount_entries <= 0) {
+        _afs_LogError("ERROR: afs_prefetch - Invalid entry array.");
+        return 2;
+    }
+    for(int i=0;i<amount_entries;i++) {
+        if(ids[i] < 0 || ids[i] >= afs->header.entrycount) {
+            _afs_LogError("ERROR: afs_prefetch - Entry ID out of range.");
+            _afs_LogErrorF("Entry ID: %d, AFS Entry Count: %d\n", ids[i], afs->header.entrycount);
+            return 3;
+        }
+    }
+    if(afs->internal->dryRun != NULL) {
+        return 0;
+    }
+
+    // Entries close to each other are requested as one range
+    AfsEntryInfo* info = afs->header.entryinfo;
+    AfsSortKey* keys = (AfsSortKey*)malloc(sizeof(AfsSortKey) * amount_entries);
+    for(int i=0;i<amount_entries;i++) {
+        keys[i].offset = info[ids[i]].offset;
+        keys[i].index = ids[i];
+    }
+    qsort(keys, amount_entries, sizeof(AfsSortKey), _afs_compareSortKey);
+
+    u64 start = 0, end = 0;
+    for(int i=0;i<amount_entries;i++) {
+        u64 offset = keys[i].offset;
+        u64 size = info[keys[i].index].size;
+        if(size == 0) continue;
+        if(end != 0 && offset <= end + AFS_EXTRACT_MERGEGAP) {
+            if(offset + size > end) end = offset + size;
+            continue;
+        }
+        if(end != 0) _afs_prefetchRange(afs, start, end - start);
+        start = offset;
+        end = offset + size;
+    }
+    if(end != 0) _afs_prefetchRange(afs, start, end - start);
+    free(keys);
+    return 0;
+}
+
+int afs_setGrowthHeadroom(Afs* afs, AfsHeadroomMode mode, u64 value) {
+    if(afs == NULL) {
+        _afs_LogError("ERROR: afs_setGrowthHeadroom - Invalid AFS pointer.");
+        return 1;
+    }
+    if(mode < AFS_HEADROOM_NONE || mode > AFS_HEADROOM_GEOMETRIC || value > AFS_MAXOFFSET) {
+        _afs_LogError("ERROR: afs_setGrowthHeadroom - Invalid headroom.");
+        _afs_LogErrorF("mode: %d, value: %llu\n", mode, (unsigned long long)value);
+        return 2;
+    }
+    afs->internal->headroomMode = mode;
+    afs->internal->headroomValue = value;
+    return 0;
+}
+
+int afs_reserveEntry(Afs* afs, int id, u64 capacity) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_reserveEntry - Invalid AFS File.");
+        return 1;
+    }
+    if(_afs_isReadOnly(afs, "afs_reserveEntry") || _afs_isInTransaction(afs, "afs_reserveEntry")) {
+        return 1;
+    }
+    if(id < 0 || id >= afs->header.entrycount) {
+        _afs_LogError("ERROR: afs_reserveEntry - Entry ID out of range.");
+        _afs_LogErrorF("Entry ID: %d, AFS Entry Count: %d\n", id, afs->header.entrycount);
+        return 2;
+    }
+
+    AfsEntryInfo* info = afs->header.entryinfo;
+    AfsEntryInfo metaInfo = info[afs->header.entrycount];
+    u64 wanted = _afs_calcReservedSpace(capacity);
+    u64 reserved = _afs_extentEnd(afs, id) - info[id].offset;
+    if(afs->internal->reservedSpace != NULL && afs->internal->reservedSpace[id] > wanted) {
+        wanted = afs->internal->reservedSpace[id];
+    }
+
+    // The space is already there, it only has to be kept out of the free extent map
+    if(reserved >= wanted) {
+        _afs_setReservedSpace(afs, id, wanted);
+        _afs_invalidateFreeExtents(afs);
+        return 0;
+    }
+    // Worst case, the entry is moved to the end
+    if(capacity > AFS_MAXOFFSET || (u64)metaInfo.offset + metaInfo.size + wanted > AFS_MAXOFFSET) {
+        _afs_LogError("ERROR: afs_reserveEntry - The AFS would grow past the maximum size of the format.");
+        _afs_LogErrorF("capacity: %llu, maximum AFS size: %llu\n", (unsigned long long)capacity, AFS_MAXOFFSET);
+        return 4;
+    }
+
+    int ret;
+    bool isLast = _afs_extentEnd(afs, id) == metaInfo.offset;
+    if(afs->internal->growthPolicy == AFS_GROWTH_REBUILD) {
+        // The entry is rebuilt with its own data, the layout gives it the reservation (see _afs_planSequential())
+        u64 oldReservation = (afs->internal->reservedSpace != NULL) ? afs->internal->reservedSpace[id] : 0;
+        _afs_setReservedSpace(afs, id, wanted);
+        AfsFileRange range = { afs, info[id].offset };
+        AfsEntrySource source = afs_sourceFromCallback(_afs_readFileRange, &range, info[id].size);
+        ret = _afs_replaceRebuilding(afs, id, &source, info[id].size);
+        if(ret != 0 && afs->internal->reservedSpace != NULL) {
+            afs->internal->reservedSpace[id] = oldReservation;
+        }
+    }
+    else if(!_afs_isPlaced(afs, id) || (afs->internal->growthPolicy == AFS_GROWTH_RELOCATE && !isLast)) {
+        AfsFileRange range = { afs, info[id].offset };
+        AfsEntrySource source = afs_sourceFromCallback(_afs_readFileRange, &range, info[id].size);
+        ret = _afs_relocateEntry(afs, id, &source, info[id].size, wanted);
+    }
+    else {
+        // For the last entry, only the metadata has to be moved
+        ret = _afs_growEntrySpace(afs, id, wanted);
+        if(ret == 0) {
+            _afs_setReservedSpace(afs, id, wanted);
+        }
+    }
+    if(ret != 0) {
+        _afs_LogError("ERROR: afs_reserveEntry - Failed to resize the entry.");
+    }
+    return _afs_endEdit(afs, ret, 5);
+}
+
+void afs_freeBuffer(void* buffer) {
+    if(buffer)
+        free(buffer);
+}
+
+int afs_extractFull(Afs* afs, const char* folderpath) {
+    return afs_extractFullParallel(afs, folderpath, 1);
+}
+
+int afs_extractFullParallel(Afs* afs, const char* folderpath, int threads) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_extractFull - Invalid AFS File.");
+        return 1;
+    }
+    if(folderpath == NULL || *folderpath == 0x00 ) {
+        _afs_LogError("ERROR: afs_extractFull - output_folderpath invalid.");
+        return 2;
+    }
+
+    char* dir = _afs_createOutputDir(folderpath);
+
+    int count = afs->header.entrycount;
+    int* ids = (int*)malloc(sizeof(int) * (count > 0 ? count : 1));
+    for(int i=0;i<count;i++) {
+        ids[i] = i;
+    }
+
+    // The output names are decided up front,
+    // so the workers can't race each other for the same name.
+    AfsExtractContext ctx;
+    memset(&ctx, 0x00, sizeof(AfsExtractContext));
+    ctx.afs = afs;
+    ctx.ids = ids;
+    ctx.count = count;
+    ctx.paths = _afs_createExtractPaths(afs, dir, ids, count);
+    _afs_mutexInit(&ctx.lock);
+
+    // The whole AFS is read, so the kernel can read far ahead
+    _afs_adviseAccess(afs, AFS_ACCESS_SEQUENTIAL);
+    _afs_runExtract(&ctx, threads);
+    _afs_adviseAccess(afs, afs->internal->accessPattern);
+
+    _afs_mutexDestroy(&ctx.lock);
+    for(int i=0;i<count;i++) {
+        free(ctx.paths[i]);
+    }
+    free(ctx.paths);
+    free(ids);
+    free(dir);
+    return ctx.failed > 0 ? 3 : 0;
+}
+
+int afs_extractEntries(Afs* afs, const int* ids, int amount_entries, const char* folderpath) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_extractEntries - Invalid AFS File.");
+        return 1;
+    }
+    if(ids == NULL || amount_entries <= 0) {
+        _afs_LogError("ERROR: afs_extractEntries - Invalid entry ID array.");
+        return 2;
+    }
+    for(int i=0;i<amount_entries;i++) {
+        if(ids[i] < 0 || ids[i] >= afs->header.entrycount) {
+            _afs_LogError("ERROR: afs_extractEntries - Entry ID out of range.");
+            _afs_LogErrorF("Entry ID: %d\tAFS entry count: %d\n", ids[i], afs->header.entrycount);
+            return 3;
+        }
+    }
+    if(folderpath == NULL || *folderpath == 0x00 ) {
+        _afs_LogError("ERROR: afs_extractEntries - folderpath invalid.");
+        return 4;
+    }
+
+    char* dir = _afs_createOutputDir(folderpath);
+
+    // Names are handed out in the order the IDs were given,
+    // so the result doesn't depend on where the entries are stored.
+    char** paths = _afs_createExtractPaths(afs, dir, ids, amount_entries);
+
+    // The entries are then extracted in the order they are stored in the AFS
+    AfsSortKey* keys = (AfsSortKey*)malloc(sizeof(AfsSortKey) * amount_entries);
+    for(int i=0;i<amount_entries;i++) {
+        keys[i].offset = afs->header.entryinfo[ids[i]].offset;
+        keys[i].index = i;
+    }
+    qsort(keys, amount_entries, sizeof(AfsSortKey), _afs_compareSortKey);
+
+    int* sortedIds = (int*)malloc(sizeof(int) * amount_entries);
+    char** sortedPaths = (char**)malloc(sizeof(char*) * amount_entries);
+    for(int i=0;i<amount_entries;i++) {
+        sortedIds[i] = ids[keys[i].index];
+        sortedPaths[i] = paths[keys[i].index];
+    }
+
+    AfsExtractContext ctx;
+    memset(&ctx, 0x00, sizeof(AfsExtractContext));
+    ctx.afs = afs;
+    ctx.ids = sortedIds;
+    ctx.count = amount_entries;
+    ctx.paths = sortedPaths;
+
+    bool done = false;
+    _afs_adviseAccess(afs, AFS_ACCESS_SEQUENTIAL);
+    #ifdef AFS_HAVE_IOURING
+    if(afs->internal->ioBackend == AFS_IOBACKEND_IOURING) {
+        done = _afs_extractUring(&ctx) == 0;
+    }
+    #endif
+    if(!done) {
+        _afs_extractMerged(&ctx);
+    }
+    _afs_adviseAccess(afs, afs->internal->accessPattern);
+
+    for(int i=0;i<amount_entries;i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    free(sortedPaths);
+    free(sortedIds);
+    free(keys);
+    free(dir);
+    return ctx.failed > 0 ? 5 : 0;
+}
+
+int afs_replaceEntry(Afs* afs, int id, u8* data, u64 data_size) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_replaceEntry - Invalid AFS File.");
+        return 1;
+    }
+    if(_afs_isReadOnly(afs, "afs_replaceEntry")) {
+        return 1;
+    }
+    if(id < 0 || id >= afs->header.entrycount) {
+        _afs_LogError("ERROR: afs_replaceEntry - Entry ID out of range.");
+        _afs_LogErrorF("Entry ID: %d, AFS Entry Count: %d\n", id, afs->header.entrycount);
+        return 2;
+    }
+    if(data == NULL || data_size == 0) {
+        _afs_LogError("ERROR: afs_replaceEntry - Given data is invalid (NULL or zero size).");
+        _afs_LogErrorF("data: 0x%08x\tdata_size: %llu", *(unsigned int*)&data, (unsigned long long)data_size);
+        return 3;
+    }
+
+    AfsEntrySource source = afs_sourceFromBuffer(data, data_size);
+    if(afs->internal->transaction != NULL) {
+        return _afs_stageSource(afs, id, &source, data_size);
+    }
+    int ret = _afs_replaceEntrySource(afs, id, &source, data_size);
+    if(ret == 4) {
+        _afs_LogError("ERROR: afs_replaceEntry - Failed to resize the entry.");
+        _afs_LogErrorF("data_size: %llu, maximum AFS size: %llu\n", (unsigned long long)data_size, AFS_MAXOFFSET);
+    }
+    else if(ret != 0) {
+        _afs_LogError("ERROR: afs_replaceEntry - Failed to write the entry, the AFS might be damaged.");
+    }
+    return _afs_endEdit(afs, ret, 5);
+}
+
+int afs_replaceEntriesFromFiles(Afs* afs, int* entries, char** filepaths, int amount_entries) {
+    if(entries == NULL || filepaths == NULL) {
+        _afs_LogError("ERROR: afs_replaceEntriesFromFiles - Invalid array args.");
+        return 2;
+    }
+    if(amount_entries <= 0) {
+        _afs_LogError("ERROR: afs_replaceEntriesFromFiles - Invalid replaced entry count.");
+        return 3;
+    }
+
+    AfsEntrySource* sources = (AfsEntrySource*)malloc(sizeof(AfsEntrySource) * amount_entries);
+    for(int i=0;i<amount_entries;i++) {
+        sources[i] = afs_sourceFromFile(filepaths[i]);
+    }
+    int ret = afs_replaceEntries(afs, entries, sources, amount_entries);
+    free(sources);
+    return ret;
+}
+
+int afs_replaceEntries(Afs* afs, const int* entries, const AfsEntrySource* sources, int amount_entries) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_replaceEntries - Invalid AFS File.");
+        return 1;
+    }
+    if(_afs_isReadOnly(afs, "afs_replaceEntries")) {
+        return 1;
+    }
+    if(entries == NULL || sources == NULL) {
+        _afs_LogError("ERROR: afs_replaceEntries - Invalid array args.");
+        return 2;
+    }
+    if(amount_entries <= 0) {
+        _afs_LogError("ERROR: afs_replaceEntries - Invalid replaced entry count.");
+        return 3;
+    }
 
-    // copy the location of the output file path
-    strncpy(outpath, folderpath, folderpath_len);
+    int count = afs->header.entrycount;
+    const AfsEntrySource** sourceOf = (const AfsEntrySource**)calloc(count + 1, sizeof(AfsEntrySource*));
+    u64* sizes = (u64*)calloc(count + 1, sizeof(u64));
+    u64 tableSize = (sizeof(AfsEntrySource*) + sizeof(u64)) * (count + 1);
+    _afs_trackMemory(afs, tableSize);
 
-    // at this point, the given argument might be "/path/to/dir/"
-    // or it might be "path/to/dir" (notice the missing slash at the end)
-    // we need to ensure both args lead to the same result
-    if(outpath[folderpath_len-1] != PATH_SEP) {
-        outpath[folderpath_len] = PATH_SEP;
+    int ret = 0;
+    bool allEntriesSkipped = true;
+    int replaced = 0;
+    int lastId = -1;
+    for(int i=0;i<amount_entries && ret == 0;i++) {
+        // If the file is marked "skip", we skip it
+        int id = entries[i];
+        if(id == -1) {
+            continue;
+        }
+        allEntriesSkipped = false;
+        if(id < 0 || id >= count) {
+            _afs_LogError("ERROR: afs_replaceEntries - Entry ID out of range.");
+            _afs_LogErrorF("Entry ID: %d, AFS Entry Count: %d\n", id, count);
+            ret = 2;
+        }
+        else if(sourceOf[id] != NULL) {
+            continue;
+        }
+        else if(!_afs_getSourceSize(&sources[i], &sizes[id])) {
+            _afs_LogError("ERROR: afs_replaceEntries - a source is invalid, or its file isn't accessible or doesn't exist!");
+            if(sources[i].type == AFS_SOURCE_FILE) {
+                _afs_LogErrorF("File path #%d: %s\n", i, sources[i].filepath);
+            }
+            ret = 2;
+        }
+        else if(sizes[id] > AFS_MAXOFFSET) {
+            _afs_LogError("ERROR: afs_replaceEntries - a source is too large for an AFS entry!");
+            ret = 4;
+        }
+        sourceOf[id] = &sources[i];
+        replaced++;
+        lastId = id;
     }
-
-    if(*afs->meta[id].filename != 0x00) {
-        strncat(outpath, afs->meta[id].filename, AFSMETA_NAMEBUFFERSIZE);
+    if(ret == 0 && allEntriesSkipped) {
+        _afs_LogError("ERROR: afs_replaceEntries - All entries were skipped.");
+        ret = 2;
     }
-    else {
-        char temp[AFSMETA_NAMEBUFFERSIZE];
-        snprintf(temp, AFSMETA_NAMEBUFFERSIZE, "blank_%d", id);
-        strncat(outpath, temp, AFSMETA_NAMEBUFFERSIZE);
+    if(ret != 0) {
+        free(sourceOf);
+        free(sizes);
+        _afs_trackMemory(afs, -(s64)tableSize);
+        return ret;
     }
 
-    int outpathLen = strlen(outpath);
-
-    if(filepath != NULL) {
-        strncpy(filepath, outpath, PATH_MAX-1);
-        filepath[PATH_MAX-1] = 0x00;
+    // Inside a transaction the edits are only staged, afs_commit() applies them all at once
+    if(afs->internal->transaction != NULL) {
+        for(int id=0;id<count && ret == 0;id++) {
+            if(sourceOf[id] != NULL) {
+                ret = _afs_stageSource(afs, id, sourceOf[id], sizes[id]);
+            }
+        }
+        free(sourceOf);
+        free(sizes);
+        return ret;
     }
 
-    FILE* outfile = fopen(outpath, "wb");
+    // The metadata is rewritten at its new offset, so it has to be in memory before the old one gets overwritten
+    AfsEntryMetadata* meta = _afs_getMeta(afs);
+    time_t current_time = time(NULL);
+    struct tm tm = *localtime(&current_time);
 
-    if(outfile == NULL) {
-        _afs_LogError("ERROR: afs_extractEntryToFile - File pointer failed to create.");
-        _afs_LogErrorF("outfile path: %s\n", outpath);
-        free(outpath);
-        return 4;
+    // A single entry doesn't need a rebuild, it's replaced like afs_replaceEntry() does it
+    if(replaced == 1) {
+        AfsEntryMetadata oldMeta = meta[lastId];
+        _afs_setReplacedMetadata(meta, lastId, sourceOf[lastId], sizes[lastId], &tm);
+        ret = _afs_replaceEntrySource(afs, lastId, sourceOf[lastId], sizes[lastId]);
+        if(ret == 4) {
+            meta[lastId] = oldMeta;
+            _afs_LogError("ERROR: afs_replaceEntries - The AFS would grow past the maximum size of the format.");
+        }
+        free(sourceOf);
+        free(sizes);
+        _afs_trackMemory(afs, -(s64)tableSize);
+        return _afs_endEdit(afs, ret, 5);
     }
 
-    fseek(afs->fstream, off, SEEK_SET);
-    fread(buffer, 1, size, afs->fstream);
-    fwrite(buffer, 1, size, outfile);
-
-    fclose(outfile);
-    free(buffer);
+    int amount;
+    int* order = _afs_getOffsetOrder(afs, &amount);
+    AfsEntryInfo* newInfo = (AfsEntryInfo*)malloc(sizeof(AfsEntryInfo) * (count + 1));
+    _afs_trackMemory(afs, sizeof(AfsEntryInfo) * (count + 1));
+    u64 newEnd;
+    if(afs->internal->growthPolicy == AFS_GROWTH_RELOCATE) {
+        // Worst case, every replaced entry is moved to the end
+        AfsEntryInfo metaInfo = afs->header.entryinfo[count];
+        newEnd = (u64)metaInfo.offset + metaInfo.size;
+        for(int id=0;id<count;id++) {
+            if(sourceOf[id] != NULL) newEnd += _afs_calcReservedSpace(sizes[id]);
+        }
+    }
+    else {
+        int placed = amount;
+        newEnd = _afs_planSequential(afs, order, &amount, sourceOf, sizes, newInfo, true);
+        if(newEnd > AFS_MAXOFFSET) {
+            // Without the headroom it might still fit
+            amount = placed;
+            newEnd = _afs_planSequential(afs, order, &amount, sourceOf, sizes, newInfo, false);
+        }
+        // Replaced entries that weren't placed yet are appended behind the last entry
+        for(int pos=0;pos<amount;pos++) {
+            int id = order[pos];
+            if(sourceOf[id] == NULL) continue;
+            if(pos >= placed) {
+                _afs_setAction(afs, id, AFS_EDIT_RELOCATE);
+            }
+            else {
+                bool resized = _afs_getReservedSpace(newInfo, count, order, amount, pos) != _afs_getReservedSpace(afs->header.entryinfo, count, order, placed, pos);
+                _afs_setAction(afs, id, resized ? AFS_EDIT_SHIFT : AFS_EDIT_INPLACE);
+            }
+        }
+    }
+    if(newEnd > AFS_MAXOFFSET) {
+        _afs_LogError("ERROR: afs_replaceEntries - The AFS would grow past the maximum size of the format.");
+        _afs_LogErrorF("New size: %llu, maximum AFS size: %llu\n", (unsigned long long)newEnd, AFS_MAXOFFSET);
+        ret = 4;
+    }
+    else {
+        for(int id=0;id<count;id++) {
+            if(sourceOf[id] != NULL) {
+                _afs_setReplacedMetadata(meta, id, sourceOf[id], sizes[id], &tm);
+            }
+        }
 
-    // Set the correct last modified date
-    _afs_ApplyTimestamp(outpath, afs->meta[id].lastModified);
+        if(afs->internal->growthPolicy == AFS_GROWTH_RELOCATE) {
+            ret = _afs_replaceRelocating(afs, sourceOf, sizes);
+        }
+        else if(_afs_applyLayout(afs, order, amount, sourceOf, newInfo, NULL) != 0) {
+            ret = 5;
+        }
+        else {
+            for(int pos=0;pos<amount;pos++) {
+                if(sourceOf[order[pos]] == NULL) continue;
+                _afs_setReservedSpace(afs, order[pos], _afs_getReservedSpace(afs->header.entryinfo, count, order, amount, pos));
+            }
+        }
+    }
 
-    free(outpath);
-    return 0;
+    free(newInfo);
+    free(order);
+    free(sourceOf);
+    free(sizes);
+    _afs_trackMemory(afs, -(s64)(tableSize + sizeof(AfsEntryInfo) * (count + 1) + sizeof(int) * count));
+    return _afs_endEdit(afs, ret, 5);
 }
 
-u8* afs_extractEntryToBuffer(Afs* afs, int id) {
-    if(afs == NULL || afs->fstream == NULL) {
-        _afs_LogError("ERROR: afs_extractEntryToBuffer - Invalid AFS pointer (afs or afs->fstream).");
-        return NULL;
+int afs_planReplace(Afs* afs, const int* entries, const AfsEntrySource* sources, int amount_entries, AfsReplacePlan* plan) {
+    if(afs == NULL || afs->fstream == NULL || afs->header.entryinfo == NULL) {
+        _afs_LogError("ERROR: afs_planReplace - Invalid AFS File.");
+        return 1;
     }
-
-    if(id < 0 || id > afs->header.entrycount) {
-        _afs_LogError("ERROR: afs_extractEntryToBuffer - Entry ID out of range.");
-        _afs_LogErrorF("Entry ID: %d\tAFS entry count: %d\n", id, afs->header.entrycount);
-        return NULL;
+    if(plan == NULL) {
+        _afs_LogError("ERROR: afs_planReplace - Invalid plan pointer.");
+        return 2;
     }
+    memset(plan, 0x00, sizeof(AfsReplacePlan));
+    int count = afs->header.entrycount;
 
-    AfsEntryInfo info = afs->header.entryinfo[id];
-
-    u8* buffer = (u8*)malloc(info.size);
-    fseek(afs->fstream, info.offset, SEEK_SET);
-    fread(buffer, 1, info.size, afs->fstream);
+    // The replacement runs on a copy of the handle, everything it changes in memory is copied first
+    Afs dry = *afs;
+    struct AfsInternal dryInternal = *afs->internal;
+    dry.internal = &dryInternal;
+    dry.header.entryinfo = (AfsEntryInfo*)malloc(sizeof(AfsEntryInfo) * (count + 1));
+    memcpy(dry.header.entryinfo, afs->header.entryinfo, sizeof(AfsEntryInfo) * (count + 1));
+    if(afs->meta != NULL) {
+        u64 metaSize = (u64)count * sizeof(AfsEntryMetadata);
+        if(metaSize < afs->header.entryinfo[count].size) {
+            metaSize = afs->header.entryinfo[count].size;
+        }
+        dry.meta = (AfsEntryMetadata*)malloc(metaSize > 0 ? metaSize : 1);
+        memcpy(dry.meta, afs->meta, metaSize);
+    }
+    if(afs->internal->freeExtents != NULL) {
+        dryInternal.freeExtents = (AfsExtent*)malloc(sizeof(AfsExtent) * (afs->internal->freeExtentCount + 1));
+        memcpy(dryInternal.freeExtents, afs->internal->freeExtents, sizeof(AfsExtent) * afs->internal->freeExtentCount);
+    }
+    if(afs->internal->reservedSpace != NULL) {
+        dryInternal.reservedSpace = (u64*)malloc(sizeof(u64) * count);
+        memcpy(dryInternal.reservedSpace, afs->internal->reservedSpace, sizeof(u64) * count);
+    }
+    struct AfsDryRun state;
+    state.plan = plan;
+    state.actions = (AfsEditAction*)calloc(count > 0 ? count : 1, sizeof(AfsEditAction));
+    state.memory = 0;
+    state.fileSize = _afs_getFileSize(afs);
+    dryInternal.dryRun = &state;
+    // The plan is for the edits themselves, they aren't staged in an open transaction
+    dryInternal.transaction = NULL;
+    // Only records marked by the replacement are counted
+    dryInternal.dirtyInfo = NULL;
+    dryInternal.dirtyMeta = NULL;
 
-    return buffer;
-}
+    int ret = afs_replaceEntries(&dry, entries, sources, amount_entries);
+    _afs_flushDirty(&dry);
+    if(ret == 0) {
+        plan->newFileSize = state.fileSize;
+        plan->actions = (AfsEditAction*)malloc(sizeof(AfsEditAction) * amount_entries);
+        for(int i=0;i<amount_entries;i++) {
+            int id = entries[i];
+            plan->actions[i] = AFS_EDIT_SKIPPED;
+            if(id < 0) continue;
+            // Only the first edit of an entry is used, the action is taken out so later ones are skipped
+            plan->actions[i] = state.actions[id];
+            state.actions[id] = AFS_EDIT_SKIPPED;
+        }
+    }
+    else {
+        memset(plan, 0x00, sizeof(AfsReplacePlan));
+    }
 
-void afs_freeBuffer(void* buffer) {
-    if(buffer)
-        free(buffer);
+    free(state.actions);
+    free(dry.header.entryinfo);
+    free(dry.meta);
+    free(dryInternal.freeExtents);
+    free(dryInternal.reservedSpace);
+    return ret;
 }
 
-int afs_extractFull(Afs* afs, const char* folderpath) {
+int afs_compact(Afs* afs, AfsCompactResult* result) {
     if(afs == NULL || afs->fstream == NULL) {
-        _afs_LogError("ERROR: afs_extractFull - Invalid AFS File.");
+        _afs_LogError("ERROR: afs_compact - Invalid AFS File.");
         return 1;
     }
-    if(folderpath == NULL || *folderpath == 0x00 ) {
-        _afs_LogError("ERROR: afs_extractFull - output_folderpath invalid.");
-        return 2;
+    if(_afs_isReadOnly(afs, "afs_compact") || _afs_isInTransaction(afs, "afs_compact")) {
+        return 1;
     }
 
-    // In order to ensure each file path will be concatenated correctly,
-    // we must ensure the folder path ends with a '/' character.
-    int pathlen = strlen(folderpath);
-    char* dir = (char*)malloc(pathlen+2);
-    memset(dir, 0x00, pathlen+2);
-    strcpy(dir, folderpath);
-
-    if(folderpath[pathlen-1] != PATH_SEP) {
-        dir[pathlen++] = PATH_SEP;
-    }
+    AfsCompactResult res;
+    memset(&res, 0x00, sizeof(AfsCompactResult));
+    int count = afs->header.entrycount;
+    AfsEntryInfo* info = afs->header.entryinfo;
 
-    if(access(dir, F_OK) != 0) {
-        mkdir(dir);
-    }
+    // The metadata is rewritten at its new offset, so it has to be in memory before the old one gets overwritten
+    _afs_getMeta(afs);
 
-    for(int i=0;i<afs->header.entrycount;i++) {
-        AfsEntryInfo info = afs->header.entryinfo[i];
-        AfsEntryMetadata meta = afs->meta[i];
-        char filepath[sizeof(dir)+AFSMETA_NAMEBUFFERSIZE];
-        strcpy(filepath, dir);
+    // Every entry only keeps the space it needs
+    free(afs->internal->reservedSpace);
+    afs->internal->reservedSpace = NULL;
 
-        char name[AFSMETA_NAMEBUFFERSIZE];
-        if(*meta.filename == 0x00) {
-            snprintf(name, AFSMETA_NAMEBUFFERSIZE, "blank_%d", i);
-        }
-        else {
-            memcpy(name, meta.filename, AFSMETA_NAMEBUFFERSIZE);
-        }
-        strncat(filepath, name, AFSMETA_NAMEBUFFERSIZE);
+    int amount;
+    int* order = _afs_getOffsetOrder(afs, &amount);
+    AfsEntryInfo* newInfo = (AfsEntryInfo*)malloc(sizeof(AfsEntryInfo) * (count + 1));
+    u64 metaEnd = _afs_planCompact(afs, order, amount, newInfo);
+    for(int pos=0;pos<amount;pos++) {
+        if(newInfo[order[pos]].offset != info[order[pos]].offset) res.entriesMoved++;
+    }
 
-        int fcnt = 1;
-        // file already exists
-        while(access(filepath, F_OK) == 0) {
-            // we need to check whether this file has an extension
-            char* ext = strrchr(name, '.');
-            if(ext != NULL) {
-                char* tmp = (char*)malloc(ext-name+1);
-                strncpy(tmp, name, ext-name);
-                tmp[ext-name] = 0x00;
-                snprintf(filepath + pathlen, AFSMETA_NAMEBUFFERSIZE, "%s(%d)%s", tmp, fcnt++, ext);
-                free(tmp);
-            }
-            else {
-                char tmp[0x30];
-                snprintf(tmp, 0x30, "%s(%d)", name, fcnt++);
-                strcpy(filepath+pathlen, tmp);
-            }
+    u64 oldSize = _afs_getFileSize(afs);
+    int ret = 0;
+    if(res.entriesMoved > 0 || newInfo[count].offset != info[count].offset) {
+        const AfsEntrySource** sources = (const AfsEntrySource**)calloc(count + 1, sizeof(AfsEntrySource*));
+        if(_afs_applyLayout(afs, order, amount, sources, newInfo, &res.bytesMoved) != 0) {
+            _afs_LogError("ERROR: afs_compact - Failed to move the entries, the AFS might be damaged.");
+            ret = 2;
         }
+        free(sources);
+    }
 
-        u8* buffer = (u8*)malloc(info.size);
-        FILE* fp = fopen(filepath, "wb");
-        if(fp == NULL) {
-            _afs_LogError("ERROR: afs_extractFull - fp failed to open.");
-            _afs_LogErrorF("filepath: %s\n", filepath);
-            continue;
+    // Everything behind the padded metadata section is cut off (a rebuild into a new file already did that)
+    u64 newSize = _afs_alignUp(metaEnd);
+    if(ret == 0 && newSize < _afs_getFileSize(afs)) {
+        if(_afs_writeZeros(afs, metaEnd, newSize - metaEnd) != 0 || _afs_truncate(afs, newSize) != 0) {
+            _afs_LogError("ERROR: afs_compact - Failed to shrink the AFS file.");
+            ret = 2;
         }
-        fseek(afs->fstream, info.offset, SEEK_SET);
-        fread(buffer, info.size, 1, afs->fstream);
-        fwrite(buffer, info.size, 1, fp);
-        free(buffer);
+    }
+    if(ret == 0 && newSize < oldSize) {
+        res.bytesReclaimed = oldSize - newSize;
+    }
 
-        fclose(fp);
-        // Apply the Timestamp from the metadata section
-        _afs_ApplyTimestamp(filepath, meta.lastModified);
+    free(newInfo);
+    free(order);
+    if(result != NULL) {
+        *result = res;
     }
-    free(dir);
-    return 0;
+    return _afs_endEdit(afs, ret, 2);
 }
 
-int afs_replaceEntry(Afs* afs, int id, u8* data, int data_size) {
+int afs_insertEntry(Afs* afs, int id, const AfsEntrySource* source) {
     if(afs == NULL || afs->fstream == NULL) {
-        _afs_LogError("ERROR: afs_replaceEntry - Invalid AFS File.");
+        _afs_LogError("ERROR: afs_insertEntry - Invalid AFS File.");
         return 1;
     }
-    if(id < 0 || id >= afs->header.entrycount) {
-        _afs_LogError("ERROR: afs_replaceEntry - Entry ID out of range.");
-        _afs_LogErrorF("Entry ID: %d, AFS Entry Count: %d\n", id, afs->header.entrycount);
+    if(_afs_isReadOnly(afs, "afs_insertEntry") || _afs_isInTransaction(afs, "afs_insertEntry")) {
+        return 1;
+    }
+    int count = afs->header.entrycount;
+    AfsEntryInfo metaInfo = afs->header.entryinfo[count];
+    if(metaInfo.offset < 8 + sizeof(AfsEntryInfo) * (count + 1)) {
+        _afs_LogError("ERROR: afs_insertEntry - AFS doesn't have a metadata section.");
+        return 1;
+    }
+    if(id < 0 || id > count) {
+        _afs_LogError("ERROR: afs_insertEntry - Entry ID out of range.");
+        _afs_LogErrorF("Entry ID: %d, AFS Entry Count: %d\n", id, count);
         return 2;
     }
-    if(data == NULL || data_size <= 0) {
-        _afs_LogError("ERROR: afs_replaceEntry - Given data is invalid (NULL or zero size).");
-        _afs_LogErrorF("data: 0x%08x\tdata_size: %d", *(unsigned int*)&data, data_size);
+    u64 size;
+    if(source == NULL || !_afs_getSourceSize(source, &size)) {
+        _afs_LogError("ERROR: afs_insertEntry - The source is invalid, or its file isn't accessible or doesn't exist!");
         return 3;
     }
+    // Worst case, the entry info has to grow by a block and the entry is put at the end.
+    // The metadata section grows like _afs_insertSlot() grows it.
+    u64 metaSize = (u64)count * sizeof(AfsEntryMetadata);
+    if(metaSize < metaInfo.size) {
+        metaSize = metaInfo.size;
+    }
+    u64 newEnd = (u64)metaInfo.offset + metaSize + sizeof(AfsEntryMetadata) + AFS_RESERVEDSPACEBUFFER + _afs_calcReservedSpace(size);
+    if(size > AFS_MAXOFFSET || newEnd > AFS_MAXOFFSET) {
+        _afs_LogError("ERROR: afs_insertEntry - The AFS would grow past the maximum size of the format.");
+        _afs_LogErrorF("New size: %llu, maximum AFS size: %llu\n", (unsigned long long)newEnd, AFS_MAXOFFSET);
+        return 4;
+    }
+
+    // Records still marked dirty belong to the old IDs
+    int ret = _afs_flushDirty(afs);
+    // If the entry info is full, it gets a block of spare slots so the next entries don't move the data section again
+    if(ret == 0 && 8 + sizeof(AfsEntryInfo) * (count + 2) > _afs_getDataStart(afs)) {
+        ret = _afs_growToc(afs, count + 1 + AFS_RESERVEDSPACEBUFFER / sizeof(AfsEntryInfo));
+    }
+    if(ret != 0) {
+        _afs_LogError("ERROR: afs_insertEntry - Failed to make room for the entry info, the AFS might be damaged.");
+        return ret;
+    }
 
-    int reservedSpace = afs->header.entryinfo[id+1].offset - afs->header.entryinfo[id].offset;
+    _afs_insertSlot(afs, id);
+    count++;
+    time_t current_time = time(NULL);
+    struct tm tm = *localtime(&current_time);
+    _afs_setReplacedMetadata(afs->meta, id, source, size, &tm);
 
-    if(data_size >= reservedSpace) {
-        _afs_resizeEntrySpace(afs, id, data_size);
+    // The entry isn't placed yet, so this moves it into free space or to the end of the data section
+    u64 oldMetaOffset = afs->header.entryinfo[count].offset;
+    ret = _afs_replaceEntrySource(afs, id, source, size);
+    if(ret != 0) {
+        _afs_LogError("ERROR: afs_insertEntry - Failed to write the entry, the AFS might be damaged.");
+        _afs_removeSlot(afs, id);
+        count--;
+        // Records written under the new IDs are overwritten again, the entry count in the file never changed.
+        // The slot behind the entry info might have been written as well.
+        if(ret != 4 && afs->fstream != NULL) {
+            _afs_clearDirty(afs, true, true);
+            _afs_markInfoDirty(afs, 0, count);
+            _afs_markMetaDirty(afs, 0, count - 1);
+            _afs_writeZeros(afs, 8 + sizeof(AfsEntryInfo) * (count + 1), sizeof(AfsEntryInfo));
+        }
+        return _afs_endEdit(afs, ret, 5);
     }
-    _afs_replaceEntry_noResize(afs, id, data, data_size);
 
-    return 0;
+    // Entries behind the new one moved up by one slot, and the metadata section grew
+    AfsEntryInfo* info = afs->header.entryinfo;
+    bool metaMoved = info[count].offset != oldMetaOffset;
+    if(_afs_writeAt(afs, &afs->header.entrycount, sizeof(u32), 4) != sizeof(u32)
+        || _afs_writeAt(afs, info + id + 1, sizeof(AfsEntryInfo) * (count - id), 8 + sizeof(AfsEntryInfo) * (id + 1)) != sizeof(AfsEntryInfo) * (count - id)
+        || (!metaMoved && _afs_writeAt(afs, afs->meta, info[count].size, info[count].offset) != info[count].size)) {
+        _afs_LogError("ERROR: afs_insertEntry - Failed to write the entry info, the AFS might be damaged.");
+        ret = 5;
+    }
+    else if(!metaMoved) {
+        _afs_clearDirty(afs, false, true);
+    }
+    return _afs_endEdit(afs, ret, 5);
 }
 
-int afs_replaceEntriesFromFiles(Afs* afs, int* entries, char** filepaths, int amount_entries) {
+int afs_appendEntry(Afs* afs, const AfsEntrySource* source) {
+    if(afs == NULL) {
+        _afs_LogError("ERROR: afs_appendEntry - Invalid AFS File.");
+        return 1;
+    }
+    return afs_insertEntry(afs, afs->header.entrycount, source);
+}
+
+int afs_removeEntries(Afs* afs, const int* entries, int amount_entries) {
     if(afs == NULL || afs->fstream == NULL) {
-        _afs_LogError("ERROR: afs_replaceEntriesFromFiles - Invalid AFS File.");
+        _afs_LogError("ERROR: afs_removeEntries - Invalid AFS File.");
         return 1;
     }
-    if(entries == NULL || filepaths == NULL) {
-        _afs_LogError("ERROR: afs_replaceEntriesFromFiles - Invalid array args.");
+    if(_afs_isReadOnly(afs, "afs_removeEntries") || _afs_isInTransaction(afs, "afs_removeEntries")) {
+        return 1;
+    }
+    if(entries == NULL) {
+        _afs_LogError("ERROR: afs_removeEntries - Invalid array args.");
         return 2;
     }
     if(amount_entries <= 0) {
-        _afs_LogError("ERROR: afs_replaceEntriesFromFiles - Invalid replaced entry count.");
+        _afs_LogError("ERROR: afs_removeEntries - Invalid removed entry count.");
         return 3;
     }
 
-    // Store the old entryinfo array
-    AfsEntryInfo* oldEntries = (AfsEntryInfo*)malloc(sizeof(AfsEntryInfo) * (afs->header.entrycount + 1));
-    memcpy(oldEntries, afs->header.entryinfo, sizeof(AfsEntryInfo) * (afs->header.entrycount + 1));
-
-    // Store the files that are meant to replace the entries
-    u8** fileData = (u8**)malloc(amount_entries * sizeof(u8*));
-    int* fileSizes = (int*)malloc(amount_entries * sizeof(int));
-
-    bool allEntriesSkipped = true;
+    int count = afs->header.entrycount;
+    bool* removed = (bool*)calloc(count > 0 ? count : 1, sizeof(bool));
+    int first = count;
     for(int i=0;i<amount_entries;i++) {
-        // If the file is marked "skip", we skip it
-        if(entries[i] == -1) {
+        // If the entry is marked "skip", we skip it
+        int id = entries[i];
+        if(id == -1) {
             continue;
         }
-        allEntriesSkipped = false;
-        FILE* curFile = fopen(filepaths[i], "rb");
-        if(curFile == NULL) {
-            _afs_LogError("ERROR: afs_replaceEntriesFromFiles - a filepath isn't accessible or doesn't exist!");
-            _afs_LogErrorF("File path #%d: %s\n", i, filepaths[i]);
+        if(id < 0 || id >= count) {
+            _afs_LogError("ERROR: afs_removeEntries - Entry ID out of range.");
+            _afs_LogErrorF("Entry ID: %d, AFS Entry Count: %d\n", id, count);
+            free(removed);
             return 2;
         }
-        int size = ftell(curFile);
-        fseek(curFile, 0, SEEK_END);
-        size = ftell(curFile) - size;
-        fileSizes[i] = size;
+        removed[id] = true;
+        if(id < first) first = id;
+    }
+    if(first == count) {
+        free(removed);
+        return 0;
+    }
+
+    // Records still marked dirty belong to the old IDs
+    if(_afs_flushDirty(afs) != 0) {
+        _afs_LogError("ERROR: afs_removeEntries - Failed to write the entry info, the AFS might be damaged.");
+        free(removed);
+        return 5;
+    }
 
-        fileData[i] = (u8*)malloc(size);
+    // Remaining entries move down to close the gaps, in the entry info, the metadata and the reservations.
+    // The data stays where it is, the space of removed entries counts as free space from now on.
+    AfsEntryInfo* info = afs->header.entryinfo;
+    AfsEntryInfo metaInfo = info[count];
+    // Without a metadata section, only the buffer in memory is updated and its entry info stays zero
+    bool hasMeta = metaInfo.offset >= 8 + sizeof(AfsEntryInfo) * (count + 1);
+    u64 metaSize = (u64)count * sizeof(AfsEntryMetadata);
+    if(metaSize < metaInfo.size) {
+        metaSize = metaInfo.size;
+    }
+    AfsEntryMetadata* meta = _afs_getMeta(afs);
+    int kept = first;
+    for(int id=first;id<count;id++) {
+        if(removed[id]) continue;
+        info[kept] = info[id];
+        meta[kept] = meta[id];
+        if(afs->internal->reservedSpace != NULL) {
+            afs->internal->reservedSpace[kept] = afs->internal->reservedSpace[id];
+        }
+        kept++;
+    }
+    int amountRemoved = count - kept;
+    u64 removedSize = (u64)amountRemoved * sizeof(AfsEntryMetadata);
+    // Anything stored behind the entries in the metadata section is kept
+    memmove((u8*)meta + (u64)kept * sizeof(AfsEntryMetadata), (u8*)meta + (u64)count * sizeof(AfsEntryMetadata), metaSize - (u64)count * sizeof(AfsEntryMetadata));
+    info[kept] = metaInfo;
+    if(hasMeta) {
+        info[kept].size = metaSize - removedSize;
+    }
+    afs->header.entrycount = kept;
+    _afs_invalidateFreeExtents(afs);
+    free(removed);
 
-        fseek(curFile, 0, SEEK_SET);
-        fread(fileData[i], 1, size, curFile);
+    // Only the entry info and metadata from the first removed entry onwards changed, the slots and bytes that aren't used anymore are cleared
+    int ret = 0;
+    u64 metaStart = (u64)first * sizeof(AfsEntryMetadata);
+    if(_afs_writeAt(afs, &afs->header.entrycount, sizeof(u32), 4) != sizeof(u32)
+        || _afs_writeAt(afs, info + first, sizeof(AfsEntryInfo) * (kept + 1 - first), 8 + sizeof(AfsEntryInfo) * first) != sizeof(AfsEntryInfo) * (kept + 1 - first)
+        || _afs_writeZeros(afs, 8 + sizeof(AfsEntryInfo) * (kept + 1), sizeof(AfsEntryInfo) * amountRemoved) != 0
+        || (hasMeta && _afs_writeAt(afs, (u8*)meta + metaStart, info[kept].size - metaStart, metaInfo.offset + metaStart) != info[kept].size - metaStart)
+        || (hasMeta && _afs_writeZeros(afs, metaInfo.offset + info[kept].size, removedSize) != 0)) {
+        _afs_LogError("ERROR: afs_removeEntries - Failed to write the entry info, the AFS might be damaged.");
+        ret = 5;
+    }
+    return _afs_endEdit(afs, ret, 5);
+}
 
-        char* filename = NULL;
-        char* win_fname = strrchr(filepaths[i], '\\');
-        char* unix_fname = strrchr(filepaths[i], '/');
-        if(win_fname > unix_fname) filename = win_fname + 1;
-        else if(unix_fname == NULL) filename = filepaths[i];
-        else filename = unix_fname + 1;
+int afs_removeEntry(Afs* afs, int id) {
+    return afs_removeEntries(afs, &id, 1);
+}
 
-        strncpy(afs->meta[entries[i]].filename, filename, AFSMETA_NAMEBUFFERSIZE);
-        afs->meta[entries[i]].filesize = size;
+int afs_getTocCapacity(Afs* afs) {
+    if(afs == NULL || afs->header.entryinfo == NULL) {
+        _afs_LogError("ERROR: afs_getTocCapacity - Invalid AFS File.");
+        return -1;
+    }
+    u64 capacity = (_afs_getDataStart(afs) - 8) / sizeof(AfsEntryInfo) - 1;
+    return capacity > INT_MAX ? INT_MAX : (int)capacity;
+}
 
-        fclose(curFile);
+int afs_reserveToc(Afs* afs, int capacity) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_reserveToc - Invalid AFS File.");
+        return 1;
+    }
+    if(_afs_isReadOnly(afs, "afs_reserveToc") || _afs_isInTransaction(afs, "afs_reserveToc")) {
+        return 1;
     }
-    if(allEntriesSkipped) {
-        _afs_LogError("ERROR: afs_replaceEntriesFromFiles - All entries were skipped.");
+    if(capacity < 0) {
+        _afs_LogError("ERROR: afs_reserveToc - Invalid capacity.");
         return 2;
     }
+    int ret = _afs_growToc(afs, capacity);
+    if(ret == 4) {
+        _afs_LogError("ERROR: afs_reserveToc - The AFS would grow past the maximum size of the format.");
+    }
+    else if(ret != 0) {
+        _afs_LogError("ERROR: afs_reserveToc - Failed to move the data section, the AFS might be damaged.");
+    }
+    return _afs_endEdit(afs, ret, 5);
+}
 
-    // Change the AFS Header info
-    int curOffset = oldEntries[0].offset;
-    for(int i=0; i < afs->header.entrycount; i++) {
-        bool isImported = false;
-        afs->header.entryinfo[i].offset = curOffset;
+int afs_begin(Afs* afs) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_begin - Invalid AFS File.");
+        return 1;
+    }
+    if(_afs_isReadOnly(afs, "afs_begin")) {
+        return 1;
+    }
+    if(afs->internal->transaction != NULL) {
+        _afs_LogError("ERROR: afs_begin - A transaction is already open.");
+        return 2;
+    }
 
-        for(int j=0;j<amount_entries;j++) {
-            if(entries[j] == i) {
-                isImported = true;
-                afs->header.entryinfo[i].size = fileSizes[j];
-                int reservedSpace = _afs_calcReservedSpace(fileSizes[j]);
-                if(reservedSpace > 0) curOffset += reservedSpace;
-                break;
-            }
-        }
-        if(isImported) continue;
+    // Whatever is marked dirty from now on belongs to the transaction
+    if(_afs_flushDirty(afs) != 0 || _afs_journalCommit(afs) != 0) {
+        _afs_LogError("ERROR: afs_begin - Failed to write back changed entry info or metadata.");
+        return 3;
+    }
 
-        afs->header.entryinfo[i].size = oldEntries[i].size;
-        int reservedSpace = oldEntries[i+1].offset - oldEntries[i].offset;
-        curOffset += reservedSpace;
+    int count = afs->header.entrycount;
+    struct AfsTransaction* txn = (struct AfsTransaction*)calloc(1, sizeof(struct AfsTransaction));
+    txn->sources = (AfsEntrySource*)calloc(count > 0 ? count : 1, sizeof(AfsEntrySource));
+    txn->staged = (bool*)calloc(count > 0 ? count : 1, sizeof(bool));
+    // The metadata is edited in memory right away, so a copy is kept for afs_rollback()
+    AfsEntryMetadata* meta = _afs_getMeta(afs);
+    txn->savedMetaSize = (u64)count * sizeof(AfsEntryMetadata);
+    if(txn->savedMetaSize < afs->header.entryinfo[count].size) {
+        txn->savedMetaSize = afs->header.entryinfo[count].size;
     }
-    // Metadata
-    afs->header.entryinfo[afs->header.entrycount].offset = curOffset;
-
-    // Create output buffer
-    int dataSectionSize_new = curOffset - oldEntries[0].offset;
-    int dataSectionOffset = afs->header.entryinfo[0].offset;
-    u8* buffer = (u8*)malloc(dataSectionSize_new);
-    memset(buffer, 0x00, dataSectionSize_new);
-    // Insert data
-    for(int i=0; i < afs->header.entrycount; i++) {
-        bool isImported = false;
-        for(int j=0;j<amount_entries;j++) {
-            if(entries[j] == i) {
-                isImported = true;
-                // If this is an entry that should be replaced, we take its file data and insert it
-                memcpy(buffer + afs->header.entryinfo[i].offset - dataSectionOffset, fileData[j], fileSizes[j]);
-                break;
-            }
-        }
-        if(isImported) continue;
+    txn->savedMeta = (AfsEntryMetadata*)malloc(txn->savedMetaSize > 0 ? txn->savedMetaSize : 1);
+    memcpy(txn->savedMeta, meta, txn->savedMetaSize);
+    afs->internal->transaction = txn;
+    return 0;
+}
 
-        // If this is a regular entry, we fread it from the AFS and insert it into the buffer that way
-        fseek(afs->fstream, oldEntries[i].offset, SEEK_SET);
-        fread(buffer + afs->header.entryinfo[i].offset - dataSectionOffset, 1, afs->header.entryinfo[i].size, afs->fstream);
+int afs_commit(Afs* afs) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_commit - Invalid AFS File.");
+        return 1;
     }
+    struct AfsTransaction* txn = afs->internal->transaction;
+    if(txn == NULL) {
+        _afs_LogError("ERROR: afs_commit - No transaction is open.");
+        return 1;
+    }
+    // The staged edits are applied by the regular functions, so the transaction has to be closed first
+    afs->internal->transaction = NULL;
+    afs->internal->committing = true;
+    int count = afs->header.entrycount;
 
-    // Update Metadata
-    for(int i=0;i<amount_entries;i++) {
-        AfsEntryMetadata* meta = afs->meta + entries[i];
-        // Filename
-        char* unix_filename = strrchr(filepaths[i], '/') + 1;
-        char* win_filename = strrchr(filepaths[i], '\\') + 1;
-        if(win_filename > unix_filename) {
-            strncpy(meta->filename, win_filename, AFSMETA_NAMEBUFFERSIZE);
-        }
-        else {
-            strncpy(meta->filename, unix_filename, AFSMETA_NAMEBUFFERSIZE);
+    int ret = 0;
+    if(txn->stagedCount > 0) {
+        int* ids = (int*)malloc(sizeof(int) * txn->stagedCount);
+        AfsEntrySource* sources = (AfsEntrySource*)malloc(sizeof(AfsEntrySource) * txn->stagedCount);
+        // The filenames were already set when the edits were staged, later renames included
+        char (*names)[AFSMETA_NAMEBUFFERSIZE + 1] = calloc(txn->stagedCount, AFSMETA_NAMEBUFFERSIZE + 1);
+        int n = 0;
+        for(int id=0;id<count;id++) {
+            if(!txn->staged[id]) continue;
+            ids[n] = id;
+            sources[n] = txn->sources[id];
+            memcpy(names[n], afs->meta[id].filename, AFSMETA_NAMEBUFFERSIZE);
+            sources[n].name = names[n];
+            n++;
         }
-        // Last Modified Date
-        time_t current_time = time(NULL);
-        struct tm tm = *localtime(&current_time);
-        meta->lastModified.year = tm.tm_year + 1900;
-        meta->lastModified.month = tm.tm_mon + 1;
-        meta->lastModified.day = tm.tm_mday;
-        meta->lastModified.hours = tm.tm_hour;
-        meta->lastModified.minutes = tm.tm_min;
-        meta->lastModified.seconds = tm.tm_sec;
-        // File Size
-        meta->filesize = fileSizes[i];
+        // All entries are replaced in one pass, so the data behind them is moved at most once
+        ret = afs_replaceEntries(afs, ids, sources, n);
+        free(ids);
+        free(sources);
+        free(names);
     }
 
-    // Write the new entryinfo to the AFS file
-    fseek(afs->fstream, 8, SEEK_SET);
-    fwrite(afs->header.entryinfo, sizeof(AfsEntryInfo), afs->header.entrycount+1, afs->fstream);
-
-    // The Big Write
-    fseek(afs->fstream, afs->header.entryinfo[0].offset, SEEK_SET);
-    fwrite(buffer, 1, dataSectionSize_new, afs->fstream);
+    // Metadata changes and the records of entries replaced in place are written together
+    afs->internal->committing = false;
+    if(ret == 0) {
+        ret = _afs_flushDirty(afs);
+    }
+    // With a journal, the whole transaction is one batch
+    if(ret == 0) {
+        ret = _afs_journalCommit(afs);
+    }
+    if(ret == 5) {
+        _afs_LogError("ERROR: afs_commit - Failed to apply the transaction, the AFS might be damaged.");
+    }
+    else if(ret != 0) {
+        // Nothing was written, the AFS is left the way afs_rollback() leaves it
+        memcpy(afs->meta, txn->savedMeta, txn->savedMetaSize);
+        _afs_clearDirty(afs, true, true);
+    }
+    _afs_freeTransaction(txn, count);
+    return ret;
+}
 
-    // Write metadata to the AFS file
-    fseek(afs->fstream, afs->header.entryinfo[afs->header.entrycount].offset, SEEK_SET);
-    fwrite(afs->meta, sizeof(AfsEntryMetadata), afs->header.entrycount, afs->fstream);
+int afs_rollback(Afs* afs) {
+    if(afs == NULL || afs->internal->transaction == NULL) {
+        _afs_LogError("ERROR: afs_rollback - No transaction is open.");
+        return 1;
+    }
+    struct AfsTransaction* txn = afs->internal->transaction;
+    memcpy(afs->meta, txn->savedMeta, txn->savedMetaSize);
+    _afs_clearDirty(afs, true, true);
+    _afs_freeTransaction(txn, afs->header.entrycount);
+    afs->internal->transaction = NULL;
+    return 0;
+}
 
-    free(buffer);
-    for(int i=0;i<amount_entries;i++) {
-        if(entries[i] != -1) {
-            free(fileData[i]);
-        }
+int afs_flush(Afs* afs) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_flush - Invalid AFS File.");
+        return 1;
+    }
+    if(_afs_isInTransaction(afs, "afs_flush")) {
+        return 1;
+    }
+    if(_afs_flushDirty(afs) != 0 || _afs_journalCommit(afs) != 0) {
+        _afs_LogError("ERROR: afs_flush - Failed to write the entry info or metadata.");
+        return 2;
     }
-    free(oldEntries);
     return 0;
 }
 
+int afs_writeMetadata(Afs* afs) {
+    if(afs == NULL || afs->fstream == NULL) {
+        _afs_LogError("ERROR: afs_writeMetadata - Invalid AFS File.");
+        return 1;
+    }
+    if(_afs_isReadOnly(afs, "afs_writeMetadata")) {
+        return 1;
+    }
+    int count = afs->header.entrycount;
+    AfsEntryInfo metaInfo = afs->header.entryinfo[count];
+    if(metaInfo.offset < 8 + sizeof(AfsEntryInfo) * (count + 1)) {
+        _afs_LogError("ERROR: afs_writeMetadata - AFS doesn't have a metadata section.");
+        return 1;
+    }
+
+    AfsEntryMetadata* meta = _afs_getMeta(afs);
+    if(afs->internal->transaction != NULL) {
+        _afs_markMetaDirty(afs, 0, count - 1);
+        return 0;
+    }
+    u64 size = (u64)count * sizeof(AfsEntryMetadata);
+    if(_afs_writeAt(afs, meta, size, metaInfo.offset) != size) {
+        _afs_LogError("ERROR: afs_writeMetadata - Failed to write the metadata.");
+        return _afs_endEdit(afs, 2, 2);
+    }
+    _afs_clearDirty(afs, false, true);
+    return _afs_endEdit(afs, 0, 2);
+}
+
+AfsEntrySource afs_sourceFromFile(const char* filepath) {
+    AfsEntrySource source;
+    memset(&source, 0x00, sizeof(AfsEntrySource));
+    source.type = AFS_SOURCE_FILE;
+    source.filepath = filepath;
+    return source;
+}
+
+AfsEntrySource afs_sourceFromBuffer(const void* data, u64 size) {
+    AfsEntrySource source;
+    memset(&source, 0x00, sizeof(AfsEntrySource));
+    source.type = AFS_SOURCE_BUFFER;
+    source.data = data;
+    source.size = size;
+    return source;
+}
+
+AfsEntrySource afs_sourceFromCallback(AfsSourceReadFunc read, void* userdata, u64 size) {
+    AfsEntrySource source;
+    memset(&source, 0x00, sizeof(AfsEntrySource));
+    source.type = AFS_SOURCE_CALLBACK;
+    source.read = read;
+    source.userdata = userdata;
+    source.size = size;
+    return source;
+}
+
 int afs_renameEntry(Afs* afs, int id, const char* new_name, bool permanent) {
     if(afs == NULL || afs->fstream == NULL) {
         _afs_LogError("ERROR: afs_renameEntry - Invalid AFS File.");
         return 1;
     }
+    if(_afs_isReadOnly(afs, "afs_renameEntry")) {
+        return 1;
+    }
     if(id < 0 || id >= afs->header.entrycount) {
         _afs_LogError("ERROR: afs_renameEntry - Entry ID out of range.");
         _afs_LogErrorF("Entry ID: %d, AFS Entry Count: %d\n", id, afs->header.entrycount);
@@ -691,13 +5888,12 @@ int afs_renameEntry(Afs* afs, int id, const char* new_name, bool permanent) {
         return 3;
     }
 
-    AfsEntryInfo metaInf = afs->header.entryinfo[afs->header.entrycount];
-    strncpy(afs->meta[id].filename, new_name, AFSMETA_NAMEBUFFERSIZE);
+    AfsEntryMetadata* meta = _afs_getMeta(afs);
+    strncpy(meta[id].filename, new_name, AFSMETA_NAMEBUFFERSIZE);
 
     if(permanent) {
-        fseek(afs->fstream, metaInf.offset + sizeof(AfsEntryMetadata) * id, SEEK_SET);
-        fwrite(new_name, 1, AFSMETA_NAMEBUFFERSIZE, afs->fstream);
-        fseek(afs->fstream, 0, SEEK_SET);
+        _afs_markMetaDirty(afs, id, id);
+        return _afs_endEdit(afs, 0, 4);
     }
 
     return 0;
@@ -717,7 +5913,7 @@ AfsEntryMetadata afs_getEntryMetadata(Afs* afs, int id) {
         return out;
     }
 
-    memcpy(&out, &(afs->meta[id]), sizeof(AfsEntryMetadata));
+    memcpy(&out, &(_afs_getMeta(afs)[id]), sizeof(AfsEntryMetadata));
 
     return out;
 }
@@ -727,17 +5923,19 @@ int afs_setEntryMetadata(Afs* afs, int id, AfsEntryMetadata new_meta, bool perma
         _afs_LogError("ERROR: afs_setEntryMetadata - Invalid AFS File.");
         return 1;
     }
+    if(_afs_isReadOnly(afs, "afs_setEntryMetadata")) {
+        return 1;
+    }
     if(id < 0 || id >= afs->header.entrycount) {
         _afs_LogError("ERROR: afs_setEntryMetadata - Entry ID out of range.");
         _afs_LogErrorF("Entry ID: %d, AFS Entry Count: %d\n", id, afs->header.entrycount);
         return 2;
     }
-    memcpy(&(afs->meta[id]), &new_meta, sizeof(AfsEntryMetadata));
+    memcpy(&(_afs_getMeta(afs)[id]), &new_meta, sizeof(AfsEntryMetadata));
 
     if(permanent) {
-        fseek(afs->fstream, afs->header.entryinfo[afs->header.entrycount].offset + (id * sizeof(AfsEntryMetadata)), SEEK_SET);
-        fwrite(&new_meta, sizeof(AfsEntryMetadata), 1, afs->fstream);
-        fseek(afs->fstream, 0, SEEK_SET);
+        _afs_markMetaDirty(afs, id, id);
+        return _afs_endEdit(afs, 0, 3);
     }
 
     return 0;
@@ -751,7 +5949,7 @@ Timestamp afs_getLastModifiedDate(Afs* afs, int id) {
         memset(&t, 0x00, sizeof(Timestamp));
         return t;
     }
-    return afs->meta[id].lastModified;
+    return _afs_getMeta(afs)[id].lastModified;
 }
 
 char* afs_timestampToString(Timestamp t) {
@@ -7,6 +7,7 @@
 #include <time.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <errno.h>
 
 #include "types.h"
 
@@ -23,6 +24,13 @@
 #include <direct.h>
 #define mkdir(path) _mkdir(path)
 
+#include <fcntl.h>
+#include <share.h>
+#include <sys/stat.h>
+
+#define fseeko(f, o, w) _fseeki64(f, o, w)
+#define ftello(f) _ftelli64(f)
+
 #endif
 #ifdef __unix__
 
@@ -31,7 +39,15 @@
 #define PATH_SEP '/'
 
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
 #include <fcntl.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 #define mkdir(x) mkdir(x, 0777)
 
 #include <time.h>
@@ -63,6 +79,10 @@ typedef struct {
  * @note IMPORTANT!!! Must be 16-Byte aligned.
  */
 #define AFS_RESERVEDSPACEBUFFER 2048
+/** Largest offset or size an AFS can store, the entry info fields are only 32 bits wide. */
+#define AFS_MAXOFFSET 0xFFFFFFFFull
+/** Size of the buffer used when data has to be copied through user space in chunks. */
+#define AFS_COPYBUFFERSIZE 0x100000
 
 typedef struct {
     char filename[AFSMETA_NAMEBUFFERSIZE];
@@ -70,12 +90,197 @@ typedef struct {
     u32 filesize;    // Seems to verify the file size? Not sure about this one
 }AfsEntryMetadata;
 
+/** I/O backends used for extracting multiple entries at once. */
+typedef enum {
+    /** Regular blocking reads and writes, optionally spread over a thread pool. */
+    AFS_IOBACKEND_STDIO = 0,
+    /** Batches of linked io_uring requests (Linux only). */
+    AFS_IOBACKEND_IOURING = 1
+} AfsIoBackend;
+
+/** What happens when a replaced entry doesn't fit into the space reserved for it. */
+typedef enum {
+    /** The entry stays where it is and every entry behind it is shifted back. This rewrites everything behind the entry. */
+    AFS_GROWTH_SHIFT = 0,
+    /** The entry is moved into free space: space left behind by an earlier move,
+     * or the end of the data section right in front of the metadata.
+     * Only the entry itself is written, and the space it used before can be reused by later replacements. */
+    AFS_GROWTH_RELOCATE = 1,
+    /** Like AFS_GROWTH_SHIFT, but the AFS is rebuilt into a temporary file in the same directory,
+     * which is renamed over the original once it's complete. If anything fails, the AFS stays untouched.
+     * Entries that don't change are cloned from the old file (FICLONERANGE on btrfs, XFS, ...),
+     * so on those filesystems only the replaced entries and the tables are really written.
+     * Elsewhere they are copied with copy_file_range(), or streamed through a buffer.
+     * afs_compact() rebuilds the same way. */
+    AFS_GROWTH_REBUILD = 2
+} AfsGrowthPolicy;
+
+/** How the AFS is going to be read, see afs_setAccessPattern(). The kernel uses it to decide how far to read ahead. */
+typedef enum {
+    /** The kernel's default readahead. */
+    AFS_ACCESS_NORMAL = 0,
+    /** Single entries are read in no particular order, e.g. by a server. Readahead is turned off,
+     * so reading a small entry doesn't pull its neighbours into the page cache. */
+    AFS_ACCESS_RANDOM = 1,
+    /** The AFS is read front to back, the kernel reads further ahead than usual. */
+    AFS_ACCESS_SEQUENTIAL = 2
+} AfsAccessPattern;
+
+/** How much space an entry gets on top of what it needs when it has to be resized, see afs_setGrowthHeadroom().
+ * The extra space lets the entry grow again later without anything being moved.
+ */
+typedef enum {
+    /** No extra space, the entry only gets the next multiple of AFS_RESERVEDSPACEBUFFER. */
+    AFS_HEADROOM_NONE = 0,
+    /** A fixed amount of bytes. */
+    AFS_HEADROOM_FIXED = 1,
+    /** A percentage of the new entry size. */
+    AFS_HEADROOM_PERCENT = 2,
+    /** The reserved space grows by a factor (in percent, e.g. 200 doubles it) like the capacity of a vector. */
+    AFS_HEADROOM_GEOMETRIC = 3
+} AfsHeadroomMode;
+
+/** A range of the AFS file. */
+typedef struct {
+    u64 offset;
+    u64 size;
+} AfsExtent;
+
+/** Flags for afs_openEx(), can be combined with '|'. */
+typedef enum {
+    /** Open for reading and writing, the same as afs_open(). */
+    AFS_OPEN_READWRITE = 0,
+    /** Open without write access. All functions that modify the AFS will fail. */
+    AFS_OPEN_READONLY = 1,
+    /** Don't read the metadata section until it's needed, see afs_loadMetadata(). */
+    AFS_OPEN_LAZYMETA = 2,
+    /** Keep a write-ahead journal next to the AFS file ("<path>.journal"). Nothing is written to the AFS file directly:
+     * changes go into the journal, and every function that changes the AFS applies them as one batch before it returns
+     * (a transaction is a single batch applied by afs_commit()), each batch with a single sync of the journal.
+     * If the program dies while a batch is applied, the next afs_open() finishes it, and batches that weren't committed are discarded.
+     * So the AFS file always contains the state of the last batch, never a mix.
+     * Only one handle at a time can have an AFS opened with a journal, afs_openEx() fails for any other.
+     * @note Everything is written twice, once to the journal and once to the AFS file.
+     * The journal holds everything a single edit writes, e.g. the whole tail of the AFS when an entry grows with AFS_GROWTH_SHIFT. */
+    AFS_OPEN_JOURNAL = 4
+} AfsOpenFlags;
+
+/** Handle for an opened AFS file.
+ * @note Thread safety: All functions that only read from the AFS
+ * (getters, afs_extractEntryToFile, afs_extractEntryToBuffer, afs_extractFull, ...)
+ * never touch the position of fstream and can be called concurrently on the same handle.
+ * Functions that modify the AFS must not run at the same time as any other call on that handle.
+ */
 typedef struct {
     AfsHeader header;
+    /** NULL until the metadata is loaded when opened with AFS_OPEN_LAZYMETA. */
     AfsEntryMetadata* meta;
     FILE* fstream;
+    /** AfsOpenFlags the AFS was opened with. */
+    int openFlags;
+    /** Everything else the library keeps for the handle, private to afs.c. */
+    struct AfsInternal* internal;
 } Afs;
 
+/** Kinds of data an entry can be replaced with, see AfsEntrySource. */
+typedef enum {
+    /** Data is read from a file. */
+    AFS_SOURCE_FILE = 0,
+    /** Data is taken from a buffer in memory. */
+    AFS_SOURCE_BUFFER = 1,
+    /** Data is requested from a callback. */
+    AFS_SOURCE_CALLBACK = 2
+} AfsSourceType;
+
+/** Callback that provides the data of an AFS_SOURCE_CALLBACK source.
+ * It's called with increasing offsets until the whole source was read.
+ *
+ * @param userdata The userdata of the source
+ * @param dst Buffer that receives the data
+ * @param offset Offset within the source data
+ * @param length Maximum amount of bytes to provide
+ * @return The amount of bytes written to dst, 0 or less on failure.
+ */
+typedef s64 (*AfsSourceReadFunc)(void* userdata, void* dst, u64 offset, u64 length);
+
+/** Describes where the new data of a replaced entry comes from.
+ * The data is streamed into the AFS in chunks, so it never has to be in memory all at once.
+ */
+typedef struct {
+    AfsSourceType type;
+    /** Size of the data. Ignored for AFS_SOURCE_FILE, where the size of the file is used. */
+    u64 size;
+    /** AFS_SOURCE_FILE: Path of the file */
+    const char* filepath;
+    /** AFS_SOURCE_BUFFER: The data */
+    const void* data;
+    /** AFS_SOURCE_CALLBACK: The callback and the userdata passed to it */
+    AfsSourceReadFunc read;
+    void* userdata;
+    /** New filename for the metadata. If NULL, files use their own filename and other sources keep the current name. */
+    const char* name;
+} AfsEntrySource;
+
+/** What a replacement does with an entry, see afs_planReplace(). */
+typedef enum {
+    /** The edit is skipped (its ID is -1, or the entry was already replaced by an earlier edit). */
+    AFS_EDIT_SKIPPED = 0,
+    /** The new data fits into the space reserved for the entry and is written in place. */
+    AFS_EDIT_INPLACE = 1,
+    /** The entry gets a new reserved space and everything behind it is shifted. */
+    AFS_EDIT_SHIFT = 2,
+    /** The entry is moved into free space or to the end of the data section. */
+    AFS_EDIT_RELOCATE = 3
+} AfsEditAction;
+
+/** Result of afs_planReplace(). */
+typedef struct {
+    /** What happens with each edit, in the order of the entries array.
+     * Allocated by afs_planReplace(), free it with afs_freeBuffer(). */
+    AfsEditAction* actions;
+    /** Amount of bytes read from the AFS file and from file and callback sources */
+    u64 bytesRead;
+    /** Amount of bytes written to the AFS file, including moved data, padding, entry info and metadata.
+     * With AFS_GROWTH_REBUILD, a rebuild writes the whole new file and kept data is counted as copied,
+     * even though filesystems that can clone ranges don't read or write it. */
+    u64 bytesWritten;
+    /** Amount of bytes of existing data that are moved within the AFS file (included in bytesRead and bytesWritten) */
+    u64 bytesMoved;
+    /** Amount of padding bytes cleared with fallocate() instead of being written (not included in bytesWritten).
+     * Only used on Linux without AFS_OPEN_JOURNAL, filesystems that can't zero a range get the zeros written. */
+    u64 bytesZeroed;
+    /** Most memory the buffers and per-entry tables of afs_replaceEntries() take up at once.
+     * afs_replaceEntry() doesn't need the tables, only the buffers. */
+    u64 peakMemory;
+    /** Size of the AFS file afterwards */
+    u64 newFileSize;
+} AfsReplacePlan;
+
+/** Statistics of afs_compact(). */
+typedef struct {
+    /** Amount of bytes the AFS file got smaller */
+    u64 bytesReclaimed;
+    /** Amount of bytes that were moved within the file */
+    u64 bytesMoved;
+    /** Amount of entries that were moved */
+    int entriesMoved;
+} AfsCompactResult;
+
+/** Read cursor bounded to the byte range of one entry, see afs_entryOpen().
+ * Every cursor has its own position, so several cursors can read from
+ * the same AFS at the same time.
+ */
+typedef struct {
+    Afs* afs;
+    int id;
+    /** Offset of the entry within the AFS file */
+    u64 offset;
+    /** Size of the entry */
+    u64 size;
+    /** Current position within the entry */
+    u64 position;
+} AfsEntryStream;
+
 /** opens an AFS file and builds the handle for it.
  *
  * @param filePath path the the AFS file
@@ -85,6 +290,45 @@ typedef struct {
  */
 EXPORT Afs* afs_open(char* filePath);
 
+/** Opens an AFS file with the given AfsOpenFlags.
+ * With AFS_OPEN_LAZYMETA only the header and the entry info are read,
+ * the metadata section is read on the first access of a name, timestamp or other metadata.
+ * If a journal from an earlier AFS_OPEN_JOURNAL handle was left behind, its committed batches are replayed first
+ * (unless the AFS is opened read-only).
+ *
+ * @param filePath path the the AFS file
+ * @param flags Combination of AfsOpenFlags
+ *
+ * @retval Handle to the constructed AFS struct.
+ * @retval NULL if it failed.
+ */
+EXPORT Afs* afs_openEx(char* filePath, int flags);
+
+/** Loads the metadata section if it hasn't been loaded yet.
+ * Only needed before accessing afs->meta directly on an AFS opened with AFS_OPEN_LAZYMETA,
+ * all library functions load it themselves.
+ *
+ * @param afs The AFS struct
+ *
+ * @retval 0 if successful.
+ * @retval 1 if the AFS is invalid.
+ */
+EXPORT int afs_loadMetadata(Afs* afs);
+
+/** Opens an AFS file read-only and maps it into memory.
+ * header.entryinfo and meta point directly into the mapping,
+ * and entry data can be accessed without copying via afs_getEntryView().
+ * If the metadata section doesn't cover every entry, meta is a zero-padded copy instead (see afs_loadMetadata()).
+ * @note Handles opened this way are read-only, all functions that
+ * modify the AFS (replace, rename, set metadata, AFL import) will fail.
+ *
+ * @param filePath path the the AFS file
+ *
+ * @retval Handle to the constructed AFS struct.
+ * @retval NULL if it failed.
+ */
+EXPORT Afs* afs_openMapped(char* filePath);
+
 /** With construction comes destruction. This frees all AFS related memory.
  *
  * @param afs The AFS struct to be destroyed.
@@ -105,6 +349,28 @@ EXPORT void afs_free(Afs* afs);
  */
 EXPORT int afs_save(Afs* afs, char* filepath);
 
+/** Creates a new AFS file from a list of sources.
+ * The entry info is followed by spare_slots unused slots (see afs_appendEntry()), then the entries
+ * in the given order, each one padded to AFS_RESERVEDSPACEBUFFER, and the metadata section at the end.
+ * The file is written front to back, with direct I/O if it's enabled, the same way afs_setDirectIo() makes rebuilds write.
+ *
+ * @param filepath Path of the new AFS file, an existing file is overwritten.
+ * @param sources Where the data of each entry comes from
+ * @param meta Metadata of each entry, written as it is.
+ * NULL to take the filename and size from the sources, with the current date as last modified date.
+ * @param amount_entries The amount of entries in sources (and meta)
+ * @param spare_slots Amount of unused entry info slots between the entry info and the first entry
+ * @param direct_io true to write with direct I/O (O_DIRECT, Linux only), regular writes are used where it isn't available.
+ *
+ * @retval 0 if the operation was successful.
+ * @retval 1 if sources or one of the amounts is invalid.
+ * @retval 2 if the filepath is invalid.
+ * @retval 3 if a source is invalid (e.g. a file that doesn't exist).
+ * @retval 4 if the AFS would grow past AFS_MAXOFFSET.
+ * @retval 5 if the file couldn't be created or written, nothing is left behind then.
+ */
+EXPORT int afs_create(char* filepath, const AfsEntrySource* sources, const AfsEntryMetadata* meta, int amount_entries, int spare_slots, bool direct_io);
+
 /** Gets the total amount of entries within this AFS. 
  * 
  * @param afs The AFS struct
@@ -133,10 +399,100 @@ EXPORT AfsEntryInfo afs_getEntryinfo(Afs* afs, int id);
  * @retval 2 if the Entry ID is out of range.
  * @retval 3 if the folderpath is invalid.
  * @retval 4 if the file couldn't be created.
+ * @retval 5 if the entry data couldn't be copied completely (e.g. it exceeds the AFS file).
  * @note The filepath buffer must be large enough to store the filepath
  */
 EXPORT int afs_extractEntryToFile(Afs* afs, int id, const char* folderpath, char* filepath);
 
+/** Reads a part of an entry into a buffer owned by the caller.
+ * Reads stop at the end of the entry, so fewer bytes than requested may be read.
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ * @param offset Offset within the entry where reading starts
+ * @param length Maximum amount of bytes to read
+ * @param dst Buffer that receives the data, must be at least length bytes large.
+ *
+ * @retval The amount of bytes read (0 if offset is at or past the end of the entry).
+ * @retval -1 if the AFS is invalid.
+ * @retval -2 if the entry ID is out of range.
+ * @retval -3 if dst is NULL.
+ */
+EXPORT s64 afs_readEntry(Afs* afs, int id, u64 offset, u64 length, void* dst);
+
+/** Opens a read cursor for an entry, which can be used to stream through
+ * the entry without loading all of it into memory.
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ *
+ * @retval Handle to the cursor, must be closed with afs_entryClose().
+ * @retval NULL if the AFS is invalid or the entry ID is out of range.
+ */
+EXPORT AfsEntryStream* afs_entryOpen(Afs* afs, int id);
+
+/** Reads from the current position of an entry cursor and advances it.
+ *
+ * @param stream The entry cursor
+ * @param dst Buffer that receives the data
+ * @param length Maximum amount of bytes to read
+ *
+ * @retval The amount of bytes read, 0 at the end of the entry.
+ * @retval -1 if the cursor or dst is invalid.
+ */
+EXPORT s64 afs_entryRead(AfsEntryStream* stream, void* dst, u64 length);
+
+/** Moves the position of an entry cursor.
+ *
+ * @param stream The entry cursor
+ * @param offset The new position, relative to whence.
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END
+ *
+ * @retval 0 if successful.
+ * @retval 1 if the cursor is invalid.
+ * @retval 2 if whence is invalid.
+ * @retval 3 if the resulting position would be negative.
+ */
+EXPORT int afs_entrySeek(AfsEntryStream* stream, s64 offset, int whence);
+
+/** Gets the current position of an entry cursor.
+ *
+ * @param stream The entry cursor
+ * @retval The position within the entry.
+ * @retval -1 if the cursor is invalid.
+ */
+EXPORT s64 afs_entryTell(AfsEntryStream* stream);
+
+/** Closes an entry cursor.
+ *
+ * @param stream The entry cursor
+ */
+EXPORT void afs_entryClose(AfsEntryStream* stream);
+
+/** Opens an entry as a read-only FILE*, so it can be passed to code that expects stdio streams.
+ * fread, fseek, ftell and fclose work as with a regular file containing only the entry.
+ * @note Only available with glibc (uses fopencookie), returns NULL on other platforms.
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ *
+ * @retval The stream, must be closed with fclose().
+ * @retval NULL if it failed.
+ */
+EXPORT FILE* afs_entryOpenFile(Afs* afs, int id);
+
+/** Gets a read-only view of an entry's data without copying it.
+ *
+ * @param afs The AFS struct (must be opened with afs_openMapped())
+ * @param id The index of the entry
+ * @param size (Optional) if a pointer is given, the size of the entry will be stored there.
+ *
+ * @retval Pointer to the entry data inside the mapping. Valid until afs_free() is called.
+ * @retval NULL if the AFS isn't mapped or the entry ID is out of range.
+ * @note The returned pointer must NOT be freed or written to.
+ */
+EXPORT const u8* afs_getEntryView(Afs* afs, int id, u32* size);
+
 /** Extracts a singular file from the AFS to the specified folder.
  *
  * @param afs The AFS struct
@@ -147,6 +503,128 @@ EXPORT int afs_extractEntryToFile(Afs* afs, int id, const char* folderpath, char
  */
 EXPORT u8* afs_extractEntryToBuffer(Afs* afs, int id);
 
+/** Selects the I/O backend used by afs_extractFull() and the other multi-entry extract functions.
+ * If io_uring is requested but not available (non-Linux, old kernel or blocked by a sandbox),
+ * the regular stdio backend stays in use.
+ * @note With io_uring, the thread count passed to afs_extractFullParallel() is ignored.
+ *
+ * @param afs The AFS struct
+ * @param backend The backend to use
+ *
+ * @retval 0 if successful.
+ * @retval 1 if the AFS is invalid.
+ * @retval 2 if the backend isn't available, the stdio backend is used instead.
+ */
+EXPORT int afs_setIoBackend(Afs* afs, AfsIoBackend backend);
+
+/** Sets the size of the buffer used when data has to be moved or copied in chunks,
+ * e.g. when an entry grows and everything behind it is shifted back.
+ * This is the peak amount of memory such a move needs, no matter how large the AFS is.
+ *
+ * @param afs The AFS struct
+ * @param chunk_size Size of the buffer in bytes, 0 resets it to AFS_COPYBUFFERSIZE.
+ *
+ * @retval 0 if successful.
+ * @retval 1 if the AFS is invalid.
+ */
+EXPORT int afs_setChunkSize(Afs* afs, u64 chunk_size);
+
+/** Makes rebuilds into a new file (see AFS_GROWTH_REBUILD) write with direct I/O (O_DIRECT, Linux only),
+ * so rebuilding a large AFS doesn't push everything else out of the page cache.
+ * The new file is written front to back through an aligned buffer of the configured chunk size (see afs_setChunkSize()),
+ * which is kept for later rebuilds. Entries that don't change are copied through that buffer instead of being cloned,
+ * and dropped from the page cache of the old file once they were read.
+ * Writes are aligned to the logical block size of the device the new file is on.
+ * If the filesystem doesn't support direct I/O, the rebuild quietly uses regular writes.
+ * afs_create() writes new AFS files the same way.
+ *
+ * @param afs The AFS struct
+ * @param enabled true to use direct I/O, false for regular writes (the default)
+ *
+ * @retval 0 if successful.
+ * @retval 1 if the AFS is invalid.
+ * @retval 2 if direct I/O isn't available on this platform, regular writes are used.
+ */
+EXPORT int afs_setDirectIo(Afs* afs, bool enabled);
+
+/** Tells the kernel how the AFS is going to be read (posix_fadvise(), or madvise() for a mapped AFS).
+ * Use AFS_ACCESS_RANDOM when single entries are read on request, so readahead doesn't waste I/O and page cache on their neighbours.
+ * Full extractions, afs_extractEntries() and rebuilds into a new file always read sequentially while they run,
+ * and switch back to this pattern when they are done.
+ * It's only a hint, on Windows it has no effect.
+ *
+ * @param afs The AFS struct
+ * @param pattern The access pattern, AFS_ACCESS_NORMAL by default
+ *
+ * @retval 0 if successful.
+ * @retval 1 if the AFS is invalid.
+ * @retval 2 if the pattern is invalid.
+ */
+EXPORT int afs_setAccessPattern(Afs* afs, AfsAccessPattern pattern);
+
+/** Asks the kernel to start reading entries into the page cache, so later reads of them don't have to wait for the disk.
+ * Returns right away, the data is read in the background while the caller does other work.
+ * Entries close to each other are requested as one range.
+ * It's only a hint, the kernel may drop the data again before it's read. On Windows it has no effect.
+ *
+ * @param afs The AFS struct
+ * @param ids Array containing the indices of the entries that will be read soon
+ * @param amount_entries The amount of entries in the ids array
+ *
+ * @retval 0 if successful.
+ * @retval 1 if the AFS is invalid.
+ * @retval 2 if the ids array or amount_entries is invalid.
+ * @retval 3 if an entry ID is out of range.
+ */
+EXPORT int afs_prefetch(Afs* afs, const int* ids, int amount_entries);
+
+/** Sets what happens when a replaced entry doesn't fit into its reserved space anymore.
+ * With AFS_GROWTH_RELOCATE, entries no longer have to be stored in the order of their IDs,
+ * only the entry info says where each entry is.
+ *
+ * @param afs The AFS struct
+ * @param policy The growth policy
+ *
+ * @retval 0 if successful.
+ * @retval 1 if the AFS is invalid.
+ */
+EXPORT int afs_setGrowthPolicy(Afs* afs, AfsGrowthPolicy policy);
+
+/** Sets how much extra space entries get when they outgrow their reserved space.
+ * Entries that are replaced over and over with slightly larger data then only
+ * have to be resized every few replacements instead of every time.
+ * With AFS_GROWTH_SHIFT, entries that are replaced with smaller data keep their reserved space.
+ *
+ * @param afs The AFS struct
+ * @param mode The headroom mode
+ * @param value Bytes for AFS_HEADROOM_FIXED, percent of the new size for AFS_HEADROOM_PERCENT,
+ * growth factor in percent for AFS_HEADROOM_GEOMETRIC (values of 100 or less use 200). Ignored for AFS_HEADROOM_NONE.
+ *
+ * @retval 0 if successful.
+ * @retval 1 if the AFS is invalid.
+ * @retval 2 if the mode is invalid.
+ */
+EXPORT int afs_setGrowthHeadroom(Afs* afs, AfsHeadroomMode mode, u64 value);
+
+/** Makes sure an entry can be replaced with up to capacity bytes without anything being moved.
+ * If its reserved space is too small, it's resized according to the growth policy, keeping its data.
+ * With AFS_GROWTH_REBUILD, the AFS is rebuilt into a new file like it is for a replacement.
+ * @note The reserved space is stored as padding within the file. With AFS_GROWTH_RELOCATE,
+ * it's only kept out of the free space used for moving other entries while the AFS stays opened.
+ * afs_compact() gives up every reservation.
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ * @param capacity The largest entry size that should fit
+ *
+ * @retval 0 if successful.
+ * @retval 1 if the AFS is invalid.
+ * @retval 2 if the entry ID is out of range.
+ * @retval 4 if the AFS would grow past AFS_MAXOFFSET.
+ * @retval 5 if moving the data failed.
+ */
+EXPORT int afs_reserveEntry(Afs* afs, int id, u64 capacity);
+
 /** Frees a buffer allocated by one of the functions within this library.
  *
  * @param afs The AFS struct
@@ -162,10 +640,44 @@ EXPORT void afs_freeBuffer(void* buffer);
  * @retval 0 on successful extraction
  * @retval 1 if AFS is invalid
  * @retval 2 if folderpath is invalid.
+ * @retval 3 if one or more entries couldn't be extracted, the others were extracted.
  */
 EXPORT int afs_extractFull(Afs* afs, const char* folderpath);
 
+/** Extracts all files within the AFS into a specified folder using multiple threads.
+ * Output names are the same as with afs_extractFull().
+ *
+ * @param afs The AFS struct
+ * @param folderpath The path to the folder where the AFS should be extracted to.
+ * @param threads The amount of worker threads, or 0 to use one per processor.
+ * @retval 0 on successful extraction
+ * @retval 1 if AFS is invalid
+ * @retval 2 if folderpath is invalid.
+ * @retval 3 if one or more entries couldn't be extracted, the others were extracted.
+ */
+EXPORT int afs_extractFullParallel(Afs* afs, const char* folderpath, int threads);
+
+/** Extracts multiple entries from the AFS into a specified folder.
+ * The entries are read in the order they are stored in the AFS, and entries
+ * that lie next to each other are read together, so the AFS is scanned sequentially.
+ * Output names are the same as with afs_extractFull(), handed out in the order of the given IDs.
+ *
+ * @param afs The AFS struct
+ * @param ids Array containing the indices of all entries that should be extracted
+ * @param amount_entries The amount of entries in the ids array
+ * @param folderpath The path to the folder where the entries should be extracted to.
+ *
+ * @retval 0 on successful extraction.
+ * @retval 1 if the AFS is invalid.
+ * @retval 2 if the ids array or amount_entries is invalid.
+ * @retval 3 if an entry ID is out of range.
+ * @retval 4 if the folderpath is invalid.
+ * @retval 5 if one or more entries couldn't be extracted, the others were extracted.
+ */
+EXPORT int afs_extractEntries(Afs* afs, const int* ids, int amount_entries, const char* folderpath);
+
 /** Replaces an entry within the AFS.
+ * If the data fits into the space of the entry, only the data and the changed entry info and metadata records are written.
  *
  * @param afs The AFS struct
  * @param id The index of the entry
@@ -176,9 +688,10 @@ EXPORT int afs_extractFull(Afs* afs, const char* folderpath);
  * @retval 1 if the AFS is invalid.
  * @retval 2 if the entry ID is out of range.
  * @retval 3 if the data array is invalid (NULL or zero size).
- * @retval 4 if resizing was necessary but failed.
+ * @retval 4 if resizing was necessary but failed (e.g. the AFS would grow past AFS_MAXOFFSET).
+ * @retval 5 if writing the AFS failed midway. The AFS might be damaged.
  */
-EXPORT int afs_replaceEntry(Afs* afs, int id, u8* data, int data_size);
+EXPORT int afs_replaceEntry(Afs* afs, int id, u8* data, u64 data_size);
 
 /** Replaces multiple entries in the AFS with given files.
  *
@@ -192,20 +705,236 @@ EXPORT int afs_replaceEntry(Afs* afs, int id, u8* data, int data_size);
  * @retval 1 if the AFS is invalid.
  * @retval 2 if there was an issue with the passed arrays.
  * @retval 3 if amount_entries is invalid.
+ * @retval 4 if the AFS would grow past AFS_MAXOFFSET.
  */
 EXPORT int afs_replaceEntriesFromFiles(Afs* afs, int* entries, char** filepaths, int amount_entries);
 
+/** Replaces multiple entries in the AFS with data from the given sources.
+ * The AFS is rebuilt in a single pass: entries that aren't replaced are moved
+ * within the file and new data is streamed from its source, both through one buffer
+ * of the configured chunk size (see afs_setChunkSize()). The memory needed doesn't depend on the size of the AFS.
+ * If only one entry is replaced, it's handled like afs_replaceEntry() does it.
+ * afs_planReplace() tells what a call would do beforehand.
+ *
+ * @param afs The AFS struct
+ * @param entries An array containing all entry IDs that should be replaced (Entries marked -1 will be skipped)
+ * @param sources An array containing the sources for those entries
+ * @param amount_entries The total amount of entries that should be replaced.
+ * @note entries and sources should have the same size.
+ *
+ * @retval 0 if the operation was successful.
+ * @retval 1 if the AFS is invalid.
+ * @retval 2 if there was an issue with the passed arrays or a source isn't accessible.
+ * @retval 3 if amount_entries is invalid.
+ * @retval 4 if the AFS would grow past AFS_MAXOFFSET.
+ * @retval 5 if reading a source or writing the AFS failed midway. The AFS might be damaged.
+ */
+EXPORT int afs_replaceEntries(Afs* afs, const int* entries, const AfsEntrySource* sources, int amount_entries);
+
+/** Works out what afs_replaceEntries() would do with the given edits, without changing the AFS.
+ * Nothing is read from the sources or written to the AFS file, only the size of file sources is looked up.
+ * A single edit is handled like afs_replaceEntry() handles it, so the plan matches both functions,
+ * as well as afs_replaceEntriesFromFiles().
+ * @note The plan only holds as long as the AFS, its growth policy, headroom and chunk size don't change.
+ *
+ * @param afs The AFS struct
+ * @param entries An array containing all entry IDs that would be replaced (Entries marked -1 will be skipped)
+ * @param sources An array containing the sources for those entries
+ * @param amount_entries The total amount of entries that would be replaced.
+ * @param plan Receives the plan, zeroed if the return value isn't 0.
+ *
+ * @retval The value afs_replaceEntries() would return (except 5, which depends on the actual I/O).
+ */
+EXPORT int afs_planReplace(Afs* afs, const int* entries, const AfsEntrySource* sources, int amount_entries, AfsReplacePlan* plan);
+
+/** Inserts a new entry into the AFS. Every entry from id onwards gets the next higher ID.
+ * The data is put into free space or at the end of the data section (the entries don't have to be stored in the order of their IDs),
+ * so only the new data, the entry info behind id and the metadata section are written.
+ * If the entry info has no room left for another entry, the data section is moved back once
+ * to make room for AFS_RESERVEDSPACEBUFFER / sizeof(AfsEntryInfo) more entries, see afs_reserveToc().
+ *
+ * @param afs The AFS struct
+ * @param id The index the new entry should get, entrycount appends it.
+ * @param source Source of the entry data. Its name (or the filename of a file) is used for the metadata.
+ *
+ * @retval 0 if the operation was successful.
+ * @retval 1 if the AFS is invalid or doesn't have a metadata section.
+ * @retval 2 if the entry ID is out of range.
+ * @retval 3 if the source is invalid or its file isn't accessible.
+ * @retval 4 if the AFS would grow past AFS_MAXOFFSET.
+ * @retval 5 if reading the source or writing the AFS failed midway. The AFS might be damaged.
+ */
+EXPORT int afs_insertEntry(Afs* afs, int id, const AfsEntrySource* source);
+
+/** Adds a new entry behind the last one, see afs_insertEntry().
+ *
+ * @param afs The AFS struct
+ * @param source Source of the entry data
+ *
+ * @retval Same as afs_insertEntry().
+ */
+EXPORT int afs_appendEntry(Afs* afs, const AfsEntrySource* source);
+
+/** Removes entries from the AFS. Every entry behind a removed one gets a lower ID, so the IDs stay contiguous.
+ * The data of the other entries isn't moved: only the entry info and the metadata section are rewritten,
+ * and the space of the removed entries becomes free space. It can be reused by AFS_GROWTH_RELOCATE and
+ * afs_insertEntry(), or given back with afs_compact().
+ *
+ * @param afs The AFS struct
+ * @param entries An array containing all entry IDs that should be removed (Entries marked -1 will be skipped)
+ * @param amount_entries The total amount of entries in the array.
+ *
+ * @retval 0 if the operation was successful.
+ * @retval 1 if the AFS is invalid.
+ * @retval 2 if the array is invalid or an entry ID is out of range.
+ * @retval 3 if amount_entries is invalid.
+ * @retval 5 if writing the AFS failed midway. The AFS might be damaged.
+ */
+EXPORT int afs_removeEntries(Afs* afs, const int* entries, int amount_entries);
+
+/** Removes a single entry from the AFS, see afs_removeEntries().
+ *
+ * @param afs The AFS struct
+ * @param id The index of the entry
+ *
+ * @retval Same as afs_removeEntries().
+ */
+EXPORT int afs_removeEntry(Afs* afs, int id);
+
+/** Gets the amount of entries the entry info has room for without moving the data section.
+ *
+ * @param afs The AFS struct
+ * @return The capacity of the entry info, -1 if the AFS is invalid.
+ */
+EXPORT int afs_getTocCapacity(Afs* afs);
+
+/** Makes room in the entry info for a given amount of entries, so entries can be added later
+ * without moving the data section. If there isn't enough room, the data section is moved back once.
+ *
+ * @param afs The AFS struct
+ * @param capacity The amount of entries the entry info should have room for
+ *
+ * @retval 0 if the operation was successful (or there already was enough room).
+ * @retval 1 if the AFS is invalid.
+ * @retval 2 if the capacity is invalid.
+ * @retval 4 if the AFS would grow past AFS_MAXOFFSET.
+ * @retval 5 if moving the data failed midway. The AFS might be damaged.
+ */
+EXPORT int afs_reserveToc(Afs* afs, int capacity);
+
+/** Opens a transaction: until afs_commit() or afs_rollback(), replacements and permanent metadata changes
+ * (afs_replaceEntry(), afs_replaceEntries(), afs_replaceEntriesFromFiles(), afs_renameEntry(), afs_setEntryMetadata(),
+ * afs_writeMetadata() and afl_importAfl()) are only staged in memory, nothing is written to the AFS file.
+ * afs_commit() then applies all of them in a single pass, so the data behind the edited entries is moved at most once
+ * instead of once per edit, and the metadata section is written once.
+ * @note Buffer and callback sources are copied into memory when they are staged, files are only read by afs_commit().
+ * Until then, reading an entry still returns its old data, while metadata changes are visible right away.
+ * Functions that change the entry count or move entries by themselves (afs_insertEntry(), afs_appendEntry(),
+ * afs_removeEntries(), afs_compact(), afs_reserveToc(), afs_reserveEntry()) fail while a transaction is open.
+ *
+ * @param afs The AFS struct
+ *
+ * @retval 0 if the transaction was opened.
+ * @retval 1 if the AFS is invalid.
+ * @retval 2 if a transaction is already open.
+ * @retval 3 if writing back the changes made before, see afs_flush(), failed.
+ */
+EXPORT int afs_begin(Afs* afs);
+
+/** Applies everything staged since afs_begin() and closes the transaction, see afs_begin().
+ *
+ * @param afs The AFS struct
+ *
+ * @retval 0 if the operation was successful.
+ * @retval 1 if the AFS is invalid or no transaction is open.
+ * @retval 2 if the file of a staged replacement isn't accessible anymore.
+ * @retval 4 if the AFS would grow past AFS_MAXOFFSET.
+ * For 2 and 4 nothing was written and the metadata is restored like afs_rollback() does it.
+ * @retval 5 if reading a source or writing the AFS failed midway. The AFS might be damaged.
+ */
+EXPORT int afs_commit(Afs* afs);
+
+/** Discards everything staged since afs_begin(), restores the metadata and closes the transaction.
+ *
+ * @param afs The AFS struct
+ *
+ * @retval 0 if the operation was successful.
+ * @retval 1 if the AFS is invalid or no transaction is open.
+ */
+EXPORT int afs_rollback(Afs* afs);
+
+/** Writes back the entry info and metadata records that were only changed in memory so far.
+ * Functions that change the AFS already write the records they changed before they return,
+ * all records changed by one call are written together, one write for each run of consecutive records.
+ * So outside of a transaction, this is only needed to make sure nothing is left over, afs_free() does the same.
+ * With AFS_OPEN_JOURNAL, this also commits anything that is left in the journal as one batch.
+ * Nothing is flushed while a transaction is open, afs_commit() does that.
+ *
+ * @param afs The AFS struct
+ *
+ * @retval 0 if the operation was successful.
+ * @retval 1 if the AFS is invalid or a transaction is open.
+ * @retval 2 if writing failed.
+ */
+EXPORT int afs_flush(Afs* afs);
+
+/** Writes the whole metadata section of the AFS file from afs->meta.
+ * Inside a transaction the write is deferred to afs_commit().
+ *
+ * @param afs The AFS struct
+ *
+ * @retval 0 if the operation was successful.
+ * @retval 1 if the AFS is invalid or doesn't have a metadata section.
+ * @retval 2 if writing failed.
+ */
+EXPORT int afs_writeMetadata(Afs* afs);
+
+/** Moves the entries of the AFS together, so the file doesn't contain any unused space anymore.
+ * Entries keep their order and each one gets only the space it needs, rounded up to AFS_RESERVEDSPACEBUFFER.
+ * Entries that are already in the right place aren't touched, neighbouring entries are moved together,
+ * and the data goes through one buffer of the configured chunk size (see afs_setChunkSize()).
+ * The file is shortened to the end of the padded metadata section.
+ *
+ * @param afs The AFS struct
+ * @param result Receives how much was moved and reclaimed (may be NULL)
+ *
+ * @retval 0 if the operation was successful.
+ * @retval 1 if the AFS is invalid.
+ * @retval 2 if moving data or shrinking the file failed. The AFS might be damaged.
+ */
+EXPORT int afs_compact(Afs* afs, AfsCompactResult* result);
+
+/** Creates a source that reads the data from a file.
+ * @param filepath Path of the file, must stay valid until the source was used.
+ */
+EXPORT AfsEntrySource afs_sourceFromFile(const char* filepath);
+
+/** Creates a source that takes the data from a buffer.
+ * @param data The data, must stay valid until the source was used.
+ * @param size Size of the data
+ */
+EXPORT AfsEntrySource afs_sourceFromBuffer(const void* data, u64 size);
+
+/** Creates a source that requests the data from a callback.
+ * @param read The callback
+ * @param userdata Passed to every call of the callback
+ * @param size Size of the data
+ */
+EXPORT AfsEntrySource afs_sourceFromCallback(AfsSourceReadFunc read, void* userdata, u64 size);
+
 /** Renames an entry of the AFS.
  *
  * @param afs The AFS struct
  * @param id The index of the entry
  * @param new_name The new name for the entry
  * @param permanent If true, the function will overwrite the metadata in the AFS File itself as well.
+ * Inside a transaction, this happens at afs_commit().
  *
  * @retval 0 if the operation was successful.
  * @retval 1 if the AFS is invalid.
  * @retval 2 if entry ID is out of range.
  * @retval 3 if new_name is invalid.
+ * @retval 4 if writing the metadata failed.
  */
 EXPORT int afs_renameEntry(Afs* afs, int id, const char* new_name, bool permanent);
 
@@ -221,10 +950,12 @@ EXPORT AfsEntryMetadata afs_getEntryMetadata(Afs* afs, int id);
  * @param id The index of the entry
  * @param new_meta Metadata that will replace the current one
  * @param permanent If true, the function will overwrite the metadata in the AFS File itself as well.
+ * Inside a transaction, this happens at afs_commit().
  *
  * @retval 0 if successful.
  * @retval 1 if the AFS is invalid.
  * @retval 2 if the entry ID is out of range.
+ * @retval 3 if writing the metadata failed.
  */
 EXPORT int afs_setEntryMetadata(Afs* afs, int id, AfsEntryMetadata new_meta, bool permanent);
 
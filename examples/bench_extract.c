@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../afs.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/** Prints a help text explaining how to use this program
+ */
+void printHelp() {
+    puts("bench_extract - Measures the extraction throughput for different thread counts.\n");
+    puts("arg1 = A path to an AFS file");
+    puts("arg2 = A path to an output folder (a subfolder is created for every run)");
+    puts("arg3 = (Optional) The highest thread count to measure, default is one per processor");
+}
+
+/** Gets the current time in seconds from a monotonic clock.
+ */
+double getTime() {
+    #ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / freq.QuadPart;
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+    #endif
+}
+
+/*
+ * This is an example program used to demonstrate how one can use this library.
+ * In this case, we extract the same AFS several times, doubling the amount of
+ * threads each time, and print how fast each run was.
+ *
+ * Note that the first run also has to pull the AFS into the page cache,
+ * so it is run twice and only the second run is counted.
+*/
+int main(int argc, char** argv) {
+    if(argc < 3) {
+        puts("ERROR: main - Not enough arguments.");
+        printHelp();
+        return 1;
+    }
+
+    Afs* afs = afs_open(argv[1]);
+    if(afs == NULL) {
+        puts("ERROR: main - AFS file couldn't be opened.");
+        return 1;
+    }
+
+    // We add up the size of every entry, so we know how much data each run moves.
+    int entrycount = afs_getEntrycount(afs);
+    u64 totalSize = 0;
+    for(int i=0;i<entrycount;i++) {
+        totalSize += afs_getEntryinfo(afs, i).size;
+    }
+
+    int maxThreads = 0;
+    if(argc > 3) {
+        maxThreads = atoi(argv[3]);
+    }
+    if(maxThreads <= 0) {
+        #ifdef _WIN32
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        maxThreads = si.dwNumberOfProcessors;
+        #else
+        maxThreads = sysconf(_SC_NPROCESSORS_ONLN);
+        #endif
+    }
+
+    printf("%d entries, %.2f MB total\n", entrycount, totalSize / 1048576.0);
+    puts(
+        "+---------+------------+------------+-------------+\n" \
+        "| Threads | Time (s)   | MB/s       | Entries/s   |\n" \
+        "+---------+------------+------------+-------------+" \
+    );
+
+    char outpath[PATH_MAX];
+    snprintf(outpath, PATH_MAX, "%s%cwarmup", argv[2], PATH_SEP);
+    mkdir(argv[2]);
+    afs_extractFullParallel(afs, outpath, 1);
+
+    int threads = 1;
+    while(threads <= maxThreads) {
+        // Every run gets its own folder, otherwise the names
+        // of the second run would all end in "(1)".
+        snprintf(outpath, PATH_MAX, "%s%cthreads_%d", argv[2], PATH_SEP, threads);
+
+        double start = getTime();
+        afs_extractFullParallel(afs, outpath, threads);
+        double elapsed = getTime() - start;
+
+        printf("| %7d | %10.3f | %10.2f | %11.0f |\n", threads, elapsed,
+            totalSize / 1048576.0 / elapsed, entrycount / elapsed);
+
+        // Make sure the highest thread count is always measured
+        if(threads == maxThreads) break;
+        threads *= 2;
+        if(threads > maxThreads) {
+            threads = maxThreads;
+        }
+    }
+    puts("+---------+------------+------------+-------------+");
+
+    afs_free(afs);
+    return 0;
+}
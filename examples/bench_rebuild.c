@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../afs.h"
+
+/** Prints a help text explaining how to use this program
+ */
+void printHelp() {
+    puts("bench_rebuild - Compares rebuilding an AFS with regular writes and with direct I/O.\n");
+    puts("arg1 = A path to an AFS file (it isn't changed)");
+    puts("arg2 = A path for a working copy of the AFS, in the directory that should be measured");
+    puts("arg3 = (Optional) The amount of runs for each mode, default is 3");
+}
+
+/** Gets the current time in seconds from a monotonic clock.
+ */
+double getTime() {
+    #ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / freq.QuadPart;
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+    #endif
+}
+
+/** Gets how much of a file is in the page cache in MB, or a negative value if it isn't known.
+ */
+double getResidentMB(const char* path) {
+    double resident = -1;
+    #ifdef __unix__
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return resident;
+    }
+    struct stat st;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if(fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        u64 pages = (st.st_size + pageSize - 1) / pageSize;
+        unsigned char* vec = (unsigned char*)malloc(pages);
+        if(map != MAP_FAILED && mincore(map, st.st_size, vec) == 0) {
+            u64 count = 0;
+            for(u64 i=0;i<pages;i++) {
+                count += vec[i] & 1;
+            }
+            resident = count * (double)pageSize / 1048576.0;
+        }
+        free(vec);
+        if(map != MAP_FAILED) munmap(map, st.st_size);
+    }
+    close(fd);
+    #endif
+    return resident;
+}
+
+/** Copies a file, returns 0 if successful.
+ */
+int copyFile(const char* src, const char* dst) {
+    FILE* in = fopen(src, "rb");
+    FILE* out = fopen(dst, "wb");
+    if(in == NULL || out == NULL) {
+        if(in != NULL) fclose(in);
+        if(out != NULL) fclose(out);
+        return 1;
+    }
+    u8* buffer = (u8*)malloc(AFS_COPYBUFFERSIZE);
+    size_t got;
+    while((got = fread(buffer, 1, AFS_COPYBUFFERSIZE, in)) > 0) {
+        fwrite(buffer, 1, got, out);
+    }
+    free(buffer);
+    fclose(in);
+    fclose(out);
+    return 0;
+}
+
+/*
+ * This is an example program used to demonstrate how one can use this library.
+ * In this case, we rebuild a copy of an AFS into a new file (AFS_GROWTH_REBUILD)
+ * by growing its first entry, once with regular writes and once with direct I/O,
+ * and print how long each run took and how much of the new file is in the page cache afterwards.
+ *
+ * With regular writes, most of the new file ends up in the page cache.
+ * With direct I/O, it should hardly be in there at all.
+*/
+int main(int argc, char** argv) {
+    if(argc < 3) {
+        puts("ERROR: main - Not enough arguments.");
+        printHelp();
+        return 1;
+    }
+    int runs = (argc > 3) ? atoi(argv[3]) : 3;
+    if(runs <= 0) {
+        runs = 3;
+    }
+
+    Afs* afs = afs_openEx(argv[1], AFS_OPEN_READONLY);
+    if(afs == NULL) {
+        puts("ERROR: main - AFS file couldn't be opened.");
+        return 1;
+    }
+    // We grow the first entry by a whole AFS_RESERVEDSPACEBUFFER, so it never fits into its old space.
+    AfsEntryInfo first = afs_getEntryinfo(afs, 0);
+    u64 newSize = (u64)first.size + AFS_RESERVEDSPACEBUFFER;
+    u8* data = (u8*)calloc(newSize, 1);
+    afs_readEntry(afs, 0, 0, first.size, data);
+    FILE* fp = fopen(argv[1], "rb");
+    fseeko(fp, 0, SEEK_END);
+    double totalMB = ftello(fp) / 1048576.0;
+    fclose(fp);
+    afs_free(afs);
+
+    printf("%.2f MB per rebuild\n", totalMB);
+    puts(
+        "+----------+-----+------------+------------+-----------------+\n" \
+        "| Mode     | Run | Time (s)   | MB/s       | Cached (MB)     |\n" \
+        "+----------+-----+------------+------------+-----------------+" \
+    );
+
+    for(int direct=0;direct<2;direct++) {
+        for(int run=1;run<=runs;run++) {
+            if(copyFile(argv[1], argv[2]) != 0) {
+                puts("ERROR: main - The working copy couldn't be created.");
+                free(data);
+                return 1;
+            }
+            afs = afs_open(argv[2]);
+            if(afs == NULL) {
+                puts("ERROR: main - The working copy couldn't be opened.");
+                free(data);
+                return 1;
+            }
+            afs_setGrowthPolicy(afs, AFS_GROWTH_REBUILD);
+            afs_setDirectIo(afs, direct);
+
+            double start = getTime();
+            int ret = afs_replaceEntry(afs, 0, data, newSize);
+            double elapsed = getTime() - start;
+            afs_free(afs);
+            double cached = getResidentMB(argv[2]);
+
+            if(ret != 0) {
+                puts("ERROR: main - The rebuild failed.");
+                free(data);
+                return 1;
+            }
+            if(cached < 0) {
+                printf("| %-8s | %3d | %10.3f | %10.2f | %15s |\n", direct ? "direct" : "buffered", run,
+                    elapsed, totalMB / elapsed, "-");
+            }
+            else {
+                printf("| %-8s | %3d | %10.3f | %10.2f | %15.2f |\n", direct ? "direct" : "buffered", run,
+                    elapsed, totalMB / elapsed, cached);
+            }
+        }
+    }
+    puts("+----------+-----+------------+------------+-----------------+");
+
+    remove(argv[2]);
+    free(data);
+    return 0;
+}
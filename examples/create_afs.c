@@ -21,6 +21,9 @@ void printHelp() {
     puts("arg1 = A path to a folder");
     puts("arg2 = A path to an AFL file");
     puts("arg3 = A path to an output AFS file");
+    puts("\nOptions:");
+    puts("--spare <n> = Amount of spare entry info slots, so entries can be appended later without moving the data");
+    puts("--direct    = Write the AFS with direct I/O, so it doesn't go through the page cache (Linux only)");
 }
 
 #ifndef PATH_MAX
@@ -81,8 +84,9 @@ AfsSubfile* getFiles(char* folderpath, int* filecount, Afl* afl) {
         return NULL;
     }
 
-    AfsSubfile* filelist = (AfsSubfile*)malloc(*filecount * sizeof(AfsSubfile));
     int entrycount = afl_getEntrycount(afl);
+    // Entries without a file keep an empty path
+    AfsSubfile* filelist = (AfsSubfile*)calloc(entrycount > 0 ? entrycount : 1, sizeof(AfsSubfile));
 
     hfd = FindFirstFileA(dir, &fd);
     do {
@@ -154,7 +158,8 @@ AfsSubfile* getFiles(char* folderpath, int* filecount, Afl* afl) {
 
     int entrycount = afl_getEntrycount(afl);
 
-    AfsSubfile* filelist = (AfsSubfile*)malloc(*filecount * sizeof(AfsSubfile));
+    // Entries without a file keep an empty path
+    AfsSubfile* filelist = (AfsSubfile*)calloc(entrycount > 0 ? entrycount : 1, sizeof(AfsSubfile));
     while(cur = readdir(dir), cur != NULL) {
         if(strcmp(cur->d_name, ".") == 0 || strcmp(cur->d_name, "..") == 0) continue;
         
@@ -165,11 +170,12 @@ AfsSubfile* getFiles(char* folderpath, int* filecount, Afl* afl) {
             }
         }
         if(cursub == NULL) continue;
-        snprintf(cursub->path, PATH_MAX, "%s/%s", rpath, cur->d_name);
+        snprintf(fpath, PATH_MAX, "%s/%s", rpath, cur->d_name);
 
         struct stat curStat;
-        lstat(cursub->path, &curStat);
+        lstat(fpath, &curStat);
         if(S_ISREG(curStat.st_mode)) {
+            strcpy(cursub->path, fpath);
             cursub->lm = getLastModified(&curStat);
             cursub->size = curStat.st_size;
             cursub->paddedSize = getPaddedSize(cursub->size);
@@ -218,6 +224,26 @@ int main(int argc, char** argv) {
         return 2;
     }
 
+    // Everything behind the paths is an option, see printHelp()
+    int spareSlots = 0;
+    bool direct = false;
+    for(int i=4;i<argc;i++) {
+        if(strcmp(argv[i], "--direct") == 0) {
+            direct = true;
+        }
+        else if(strcmp(argv[i], "--spare") == 0 && i + 1 < argc) {
+            spareSlots = atoi(argv[++i]);
+            if(spareSlots < 0) {
+                spareSlots = 0;
+            }
+        }
+        else {
+            printf("ERROR: main - Unknown option '%s'.\n", argv[i]);
+            printHelp();
+            return 4;
+        }
+    }
+
     puts("Reading AFL...");
     Afl* afl = afl_open(argv[2]);
     int entrycount = afl_getEntrycount(afl);
@@ -237,9 +263,12 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    // The offsets are the ones afs_create() gives the entries,
+    // the metadata of the original AFS files stores them in the filesize fields
     u32* curval = (u32*)entinfo;
     puts("Calculating file offsets...");
-    u32 curOffset = getPaddedSize(infosize + 8);
+    u32 curOffset = getPaddedSize(infosize + 8 + spareSlots * sizeof(AfsEntryInfo));
+    AfsEntrySource* sources = (AfsEntrySource*)calloc(entrycount > 0 ? entrycount : 1, sizeof(AfsEntrySource));
     for(int i=0;i<entrycount;i++) {
         char* entry = afl_getName(afl, i);
         AfsSubfile* file = &files[i];
@@ -253,45 +282,31 @@ int main(int argc, char** argv) {
             curval++;
         }
         metadata[i].lastModified = file->lm;
+
+        if(*file->path == 0x00) {
+            printf("'%s' not found. Skipping.\n", entry);
+            sources[i].type = AFS_SOURCE_BUFFER;
+        }
+        else {
+            sources[i].type = AFS_SOURCE_FILE;
+            sources[i].filepath = file->path;
+        }
     }
-    entinfo[entrycount].offset = curOffset;
-    entinfo[entrycount].size = metasize;
     metadata[0].filesize = entrycount;
 
     puts("Creating AFS...");
-    Afs* afs = (Afs*)malloc(sizeof(Afs));
-    strncpy(afs->header.identifier, "AFS", 4);
-    afs->fstream = fopen(argv[3], "wb");
-    afs->header.entrycount = entrycount;
-    afs->header.entryinfo = entinfo;
-    afs->meta = metadata;
-    
-    fwrite(&afs->header, 8, 1, afs->fstream);
-    fwrite(afs->header.entryinfo, sizeof(AfsEntryInfo), entrycount+1, afs->fstream);
-    fseek(afs->fstream, afs->header.entryinfo[0].offset, SEEK_SET);
-    
-    for(int i=0;i<entrycount;i++) {
-        fseek(afs->fstream, afs->header.entryinfo[i].offset, SEEK_SET);
-        AfsSubfile* file = &files[i];
-        u8* buf = (u8*)calloc(file->paddedSize, 1);
-        FILE* fp = fopen(file->path, "rb");
-        if(fp == NULL) {
-            printf("'%s' not found. Skipping.\n", afs->meta[i].filename);
-            continue;
-        }      
-        fread(buf, file->size, 1, fp);
-        fwrite(buf, file->paddedSize, 1, afs->fstream);
-        fclose(fp);
-        free(buf);
+    int ret = afs_create(argv[3], sources, metadata, entrycount, spareSlots, direct);
+    if(ret != 0) {
+        puts("ERROR: main - Failed to write the AFS.");
+    }
+    else {
+        printf("'%s' created.\n", argv[3]);
     }
-    u8* buf = (u8*)calloc(getPaddedSize(metasize), 1);
-    memcpy(buf, afs->meta, metasize);
-    fwrite(buf, getPaddedSize(metasize), 1, afs->fstream);
-    printf("'%s' created.\n", argv[3]);
 
-    free(buf);
-    afs_free(afs);
+    free(sources);
+    free(entinfo);
+    free(metadata);
     afl_free(afl);
     free(files);
-    return 0;
+    return ret;
 }
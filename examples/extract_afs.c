@@ -21,6 +21,7 @@ void printHelp() {
     puts("arg2 = Either a path to an AFL file, or the letter 'n' in case no AFL is wanted");
     puts("arg3 = The index of a singular entry to extract, or the letter 'n' in case all files should be extracted");
     puts("arg4 = A path to an output folder where all entries are to be stored");
+    puts("arg5 = (Optional) The amount of threads used to extract all entries, 0 for one per processor");
 }
 
 /*
@@ -32,6 +33,7 @@ void printHelp() {
  * arg2 = Either a path to an AFL file or the letter 'n' in case no AFL is wanted
  * arg3 = The index of a singular entry to extract, or the letter 'n' in case all files should be extracted
  * arg4 = A path to an output folder where all entries are to be stored
+ * arg5 = (Optional) The amount of threads used to extract all entries, 0 for one per processor
 */
 int main(int argc, char** argv) {
     // Checking if all arguments are present
@@ -100,7 +102,14 @@ int main(int argc, char** argv) {
     // We check which option the user has given us
     if(*argv[3] == 'n') {
         // This one function call here fully extracts the entire AFS File.
-        int ret = afs_extractFull(afs, argv[4]);
+        // If a thread count was given, the entries are extracted by that many threads at once.
+        int ret;
+        if(argc > 5) {
+            ret = afs_extractFullParallel(afs, argv[4], atoi(argv[5]));
+        }
+        else {
+            ret = afs_extractFull(afs, argv[4]);
+        }
         if(ret != 0) {
             return ret;
         }
@@ -110,11 +119,15 @@ int main(int argc, char** argv) {
         // If we only want to extract a single Entry,
         int entryId = atoi(argv[3]);
         // ...this function extracts the selected Entry to the folder
-        char* outfile = afs_extractEntryToFile(afs, entryId, argv[4]);
-        // the function returns the filepath to the extracted entry,
-        // so we can just use its return 
+        char outfile[PATH_MAX];
+        int ret = afs_extractEntryToFile(afs, entryId, argv[4], outfile);
+        if(ret != 0) {
+            afs_free(afs);
+            return ret;
+        }
+        // the function copies the filepath of the extracted entry into outfile,
+        // so we can just print it
         printf("File extracted to %s.\n", outfile);
-        free(outfile);
     }
 
     // Lastly we make sure that no memory leaks occur by freeing all AFS related memory.
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../afs.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/** Prints a help text explaining how to use this program
+ */
+void printHelp() {
+    puts("test_journal - Checks AFS_OPEN_JOURNAL: edits through the journal give the same file as regular writes,");
+    puts("committed batches left behind are replayed on open, incomplete ones are discarded.\n");
+    puts("arg1 = A path to a folder for the temporary files");
+}
+
+#define ENTRYCOUNT 4
+
+int failures = 0;
+
+/** Counts and prints a failed check.
+ */
+void check(bool ok, const char* what) {
+    if(!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/** Fills a buffer with a pattern that differs for every seed.
+ */
+void fillPattern(u8* dst, u64 size, u32 seed) {
+    for(u64 i=0;i<size;i++) {
+        dst[i] = (u8)(i * 7 + seed * 13);
+    }
+}
+
+/** Reads a whole file into memory, returns NULL if it doesn't exist.
+ */
+u8* readFile(const char* path, u64* size) {
+    FILE* fp = fopen(path, "rb");
+    if(fp == NULL) {
+        return NULL;
+    }
+    fseeko(fp, 0, SEEK_END);
+    *size = ftello(fp);
+    fseeko(fp, 0, SEEK_SET);
+    u8* data = (u8*)malloc(*size > 0 ? *size : 1);
+    if(fread(data, 1, *size, fp) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    return data;
+}
+
+/** Writes a buffer to a new file, returns 0 if successful.
+ */
+int writeFile(const char* path, const u8* data, u64 size) {
+    FILE* fp = fopen(path, "wb");
+    if(fp == NULL) {
+        return 1;
+    }
+    int ret = fwrite(data, 1, size, fp) != size;
+    fclose(fp);
+    return ret;
+}
+
+/** Checks whether a file exists.
+ */
+bool fileExists(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if(fp != NULL) {
+        fclose(fp);
+    }
+    return fp != NULL;
+}
+
+/** Checks whether an entry holds the expected data.
+ */
+bool entryEquals(Afs* afs, int id, const u8* expected, u64 size) {
+    if(afs_getEntryinfo(afs, id).size != size) {
+        return false;
+    }
+    u8* data = (u8*)malloc(size > 0 ? size : 1);
+    bool equal = afs_readEntry(afs, id, 0, size, data) == (s64)size && memcmp(data, expected, size) == 0;
+    free(data);
+    return equal;
+}
+
+/** Does the same edits on an AFS, the result has to be the same with and without the journal.
+ * They grow, shrink, remove and append entries, and afs_compact() at the end truncates the file.
+ */
+void editAfs(const char* path, int flags, AfsGrowthPolicy policy) {
+    Afs* afs = afs_openEx((char*)path, flags);
+    check(afs != NULL, "open for editing");
+    if(afs == NULL) {
+        return;
+    }
+    afs_setGrowthPolicy(afs, policy);
+    u8 grown[9000];
+    u8 shrunk[300];
+    u8 appended[5000];
+    fillPattern(grown, sizeof(grown), 10);
+    fillPattern(shrunk, sizeof(shrunk), 11);
+    fillPattern(appended, sizeof(appended), 12);
+
+    check(afs_replaceEntry(afs, 1, grown, sizeof(grown)) == 0, "grow entry 1");
+    check(entryEquals(afs, 1, grown, sizeof(grown)), "read grown entry 1");
+    check(afs_replaceEntry(afs, 2, shrunk, sizeof(shrunk)) == 0, "shrink entry 2");
+    check(afs_removeEntry(afs, 0) == 0, "remove entry 0");
+    AfsEntrySource source = afs_sourceFromBuffer(appended, sizeof(appended));
+    check(afs_appendEntry(afs, &source) == 0, "append an entry");
+    AfsCompactResult result;
+    check(afs_compact(afs, &result) == 0, "compact");
+    check(entryEquals(afs, 0, grown, sizeof(grown)), "read entry 0 after compacting");
+    check(entryEquals(afs, 1, shrunk, sizeof(shrunk)), "read entry 1 after compacting");
+    check(entryEquals(afs, 3, appended, sizeof(appended)), "read entry 3 after compacting");
+    afs_free(afs);
+}
+
+/** Layout of the records in a journal file, see afs.c. */
+typedef struct {
+    u32 type;
+    u64 offset;
+    u64 size;
+} JournalRecord;
+
+#define JOURNAL_WRITE 1
+#define JOURNAL_TRUNCATE 2
+#define JOURNAL_COMMIT 3
+
+/** Builds a journal file in memory the way AFS_OPEN_JOURNAL writes it.
+ */
+typedef struct {
+    u8* data;
+    u64 size;
+    u64 checksum;
+    u64 count;
+} JournalBuilder;
+
+void journalAppend(JournalBuilder* journal, const void* src, u64 size, bool hashed) {
+    journal->data = (u8*)realloc(journal->data, journal->size + size);
+    memcpy(journal->data + journal->size, src, size);
+    journal->size += size;
+    for(u64 i=0;i<size && hashed;i++) {
+        journal->checksum ^= ((const u8*)src)[i];
+        journal->checksum *= 0x100000001B3ull;
+    }
+}
+
+void journalRecord(JournalBuilder* journal, u32 type, u64 offset, u64 size, const void* data) {
+    JournalRecord record;
+    memset(&record, 0x00, sizeof(JournalRecord));
+    record.type = type;
+    record.offset = offset;
+    record.size = size;
+    if(type == JOURNAL_COMMIT) {
+        record.offset = journal->count;
+        record.size = journal->checksum;
+        journalAppend(journal, &record, sizeof(JournalRecord), false);
+        journal->count = 0;
+        journal->checksum = 0xCBF29CE484222325ull;
+        return;
+    }
+    journalAppend(journal, &record, sizeof(JournalRecord), true);
+    if(type == JOURNAL_WRITE) {
+        journalAppend(journal, data, size, true);
+    }
+    journal->count++;
+}
+
+/*
+ * This is a regression test for AFS_OPEN_JOURNAL.
+ * The same edits are done on two copies of an AFS, one of them through the journal,
+ * for every growth policy, and both files have to be identical afterwards.
+ * Then a journal is left behind like after a crash: one committed batch, which truncates the AFS
+ * and writes behind the truncated size again, and one batch without its commit record.
+ * Opening the AFS has to replay the first one and discard the second one.
+*/
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        puts("ERROR: main - No folder specified.");
+        printHelp();
+        return 1;
+    }
+    char basePath[PATH_MAX];
+    char journaledPath[PATH_MAX];
+    char regularPath[PATH_MAX];
+    char journalPath[PATH_MAX + sizeof(".journal")];
+    snprintf(basePath, PATH_MAX, "%s%ctest_journal_base.afs", argv[1], PATH_SEP);
+    snprintf(journaledPath, PATH_MAX, "%s%ctest_journal_a.afs", argv[1], PATH_SEP);
+    snprintf(regularPath, PATH_MAX, "%s%ctest_journal_b.afs", argv[1], PATH_SEP);
+    snprintf(journalPath, sizeof(journalPath), "%s.journal", journaledPath);
+
+    // Entries of different sizes, so every edit moves something
+    const u64 sizes[ENTRYCOUNT] = { 3000, 4000, 5000, 6000 };
+    u8* data[ENTRYCOUNT];
+    AfsEntrySource sources[ENTRYCOUNT];
+    for(int i=0;i<ENTRYCOUNT;i++) {
+        data[i] = (u8*)malloc(sizes[i]);
+        fillPattern(data[i], sizes[i], i);
+        sources[i] = afs_sourceFromBuffer(data[i], sizes[i]);
+    }
+    if(afs_create(basePath, sources, NULL, ENTRYCOUNT, 0, false) != 0) {
+        puts("ERROR: main - The test AFS couldn't be created.");
+        return 1;
+    }
+    u64 baseSize;
+    u8* base = readFile(basePath, &baseSize);
+
+    const char* policyNames[] = { "SHIFT", "RELOCATE", "REBUILD" };
+    for(int policy=AFS_GROWTH_SHIFT;policy<=AFS_GROWTH_REBUILD;policy++) {
+        remove(journalPath);
+        writeFile(journaledPath, base, baseSize);
+        writeFile(regularPath, base, baseSize);
+        int before = failures;
+        editAfs(journaledPath, AFS_OPEN_JOURNAL, (AfsGrowthPolicy)policy);
+        editAfs(regularPath, AFS_OPEN_READWRITE, (AfsGrowthPolicy)policy);
+
+        u64 journaledSize, regularSize;
+        u8* journaled = readFile(journaledPath, &journaledSize);
+        u8* regular = readFile(regularPath, &regularSize);
+        check(journaled != NULL && regular != NULL && journaledSize == regularSize
+            && memcmp(journaled, regular, journaledSize) == 0, "journaled and regular edits give the same file");
+        check(!fileExists(journalPath), "the journal is removed once everything is applied");
+        free(journaled);
+        free(regular);
+        printf("%s edits: %s\n", policyNames[policy], failures == before ? "ok" : "FAILED");
+    }
+
+    // A batch that was committed but not applied yet: it truncates the AFS in front of the last entry,
+    // writes into the last entry and restores the metadata behind it, so the gap in between has to read as zeros.
+    int before = failures;
+    remove(journalPath);
+    writeFile(journaledPath, base, baseSize);
+    Afs* afs = afs_openEx(journaledPath, AFS_OPEN_READONLY);
+    AfsEntryInfo first = afs_getEntryinfo(afs, 0);
+    AfsEntryInfo last = afs_getEntryinfo(afs, ENTRYCOUNT - 1);
+    AfsEntryInfo meta = afs_getEntryinfo(afs, ENTRYCOUNT);
+    afs_free(afs);
+
+    u8 written[16];
+    memset(written, 0x77, sizeof(written));
+    u8 discarded[64];
+    memset(discarded, 0xEE, sizeof(discarded));
+    JournalBuilder journal;
+    memset(&journal, 0x00, sizeof(JournalBuilder));
+    journal.checksum = 0xCBF29CE484222325ull;
+    u32 version = 1;
+    journalAppend(&journal, "AFSJ", 4, false);
+    journalAppend(&journal, &version, 4, false);
+    journalRecord(&journal, JOURNAL_TRUNCATE, 0, last.offset, NULL);
+    journalRecord(&journal, JOURNAL_WRITE, last.offset + 100, sizeof(written), written);
+    journalRecord(&journal, JOURNAL_WRITE, meta.offset, meta.size, base + meta.offset);
+    journalRecord(&journal, JOURNAL_TRUNCATE, 0, baseSize, NULL);
+    journalRecord(&journal, JOURNAL_COMMIT, 0, 0, NULL);
+    // The second batch has no commit record, it was never applied
+    journalRecord(&journal, JOURNAL_WRITE, first.offset, sizeof(discarded), discarded);
+    writeFile(journalPath, journal.data, journal.size);
+    free(journal.data);
+
+    afs = afs_open(journaledPath);
+    check(afs != NULL, "open an AFS with a journal left behind");
+    if(afs != NULL) {
+        u8* expected = (u8*)calloc(last.size, 1);
+        memcpy(expected + 100, written, sizeof(written));
+        for(int i=0;i<ENTRYCOUNT-1;i++) {
+            check(entryEquals(afs, i, data[i], sizes[i]), "entries in front of the truncated size are unchanged");
+        }
+        check(entryEquals(afs, ENTRYCOUNT - 1, expected, last.size), "the last entry is zeros except for the replayed write");
+        free(expected);
+        afs_free(afs);
+    }
+    u64 replayedSize;
+    u8* replayed = readFile(journaledPath, &replayedSize);
+    check(replayed != NULL && replayedSize == baseSize, "the replayed AFS has its old size");
+    check(replayed != NULL && memcmp(replayed + meta.offset, base + meta.offset, meta.size) == 0, "the metadata is restored");
+    check(!fileExists(journalPath), "the journal is removed after replaying it");
+    free(replayed);
+    printf("Replay: %s\n", failures == before ? "ok" : "FAILED");
+
+    remove(basePath);
+    remove(journaledPath);
+    remove(regularPath);
+    free(base);
+    for(int i=0;i<ENTRYCOUNT;i++) {
+        free(data[i]);
+    }
+    if(failures > 0) {
+        printf("%d check(s) failed.\n", failures);
+        return 1;
+    }
+    puts("All checks passed.");
+    return 0;
+}
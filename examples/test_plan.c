@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../afs.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/** Prints a help text explaining how to use this program
+ */
+void printHelp() {
+    puts("test_plan - Checks that afs_planReplace() predicts what afs_replaceEntries() does:");
+    puts("the return value, the size of the file and (on Linux) the amount of bytes written.\n");
+    puts("arg1 = A path to a folder for the temporary files");
+}
+
+#define ENTRYCOUNT 4
+
+int failures = 0;
+
+/** Counts and prints a failed check.
+ */
+void check(bool ok, const char* what) {
+    if(!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/** Fills a buffer with a pattern that differs for every seed.
+ */
+void fillPattern(u8* dst, u64 size, u32 seed) {
+    for(u64 i=0;i<size;i++) {
+        dst[i] = (u8)(i * 7 + seed * 13);
+    }
+}
+
+/** Reads a whole file into memory, returns NULL if it doesn't exist.
+ */
+u8* readFile(const char* path, u64* size) {
+    FILE* fp = fopen(path, "rb");
+    if(fp == NULL) {
+        return NULL;
+    }
+    fseeko(fp, 0, SEEK_END);
+    *size = ftello(fp);
+    fseeko(fp, 0, SEEK_SET);
+    u8* data = (u8*)malloc(*size > 0 ? *size : 1);
+    if(fread(data, 1, *size, fp) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    return data;
+}
+
+/** Writes a buffer to a new file, returns 0 if successful.
+ */
+int writeFile(const char* path, const u8* data, u64 size) {
+    FILE* fp = fopen(path, "wb");
+    if(fp == NULL) {
+        return 1;
+    }
+    int ret = fwrite(data, 1, size, fp) != size;
+    fclose(fp);
+    return ret;
+}
+
+/** Gets the amount of bytes this process has written so far, or -1 if it isn't known.
+ */
+s64 getBytesWritten() {
+    s64 written = -1;
+    #ifdef __linux__
+    FILE* fp = fopen("/proc/self/io", "r");
+    if(fp == NULL) {
+        return written;
+    }
+    char line[128];
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        if(strncmp(line, "wchar:", 6) == 0) {
+            written = strtoll(line + 6, NULL, 10);
+        }
+    }
+    fclose(fp);
+    #endif
+    return written;
+}
+
+/** A set of edits that is planned and then done. */
+typedef struct {
+    const char* name;
+    int amount;
+    int entries[2];
+    u64 sizes[2];
+} TestCase;
+
+/*
+ * This is a regression test for afs_planReplace().
+ * Every edit is planned on a copy of an AFS and then done for real, for every growth policy.
+ * The plan mustn't change the file, has to return what the replacement returns
+ * and has to predict the size of the file afterwards. On Linux, the bytes the replacement
+ * actually wrote are compared with bytesWritten as well. Ranges that are cloned or zeroed
+ * with fallocate() don't show up there, so they are only an upper bound for rebuilds and padding.
+*/
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        puts("ERROR: main - No folder specified.");
+        printHelp();
+        return 1;
+    }
+    char basePath[PATH_MAX];
+    char path[PATH_MAX];
+    snprintf(basePath, PATH_MAX, "%s%ctest_plan_base.afs", argv[1], PATH_SEP);
+    snprintf(path, PATH_MAX, "%s%ctest_plan.afs", argv[1], PATH_SEP);
+
+    const u64 sizes[ENTRYCOUNT] = { 3000, 4000, 5000, 6000 };
+    u8* data[ENTRYCOUNT];
+    AfsEntrySource sources[ENTRYCOUNT];
+    for(int i=0;i<ENTRYCOUNT;i++) {
+        data[i] = (u8*)malloc(sizes[i]);
+        fillPattern(data[i], sizes[i], i);
+        sources[i] = afs_sourceFromBuffer(data[i], sizes[i]);
+    }
+    if(afs_create(basePath, sources, NULL, ENTRYCOUNT, 0, false) != 0) {
+        puts("ERROR: main - The test AFS couldn't be created.");
+        return 1;
+    }
+    u64 baseSize;
+    u8* base = readFile(basePath, &baseSize);
+
+    const TestCase cases[] = {
+        { "in place", 1, { 1, -1 }, { 1000, 0 } },
+        { "grow one", 1, { 1, -1 }, { 9000, 0 } },
+        { "grow the last", 1, { 3, -1 }, { 20000, 0 } },
+        { "grow two", 2, { 2, 0 }, { 12000, 7000 } },
+        { "grow and shrink", 2, { 0, 2 }, { 15000, 100 } },
+    };
+    const char* policyNames[] = { "SHIFT", "RELOCATE", "REBUILD" };
+    static u8 newData[2][20000];
+    fillPattern(newData[0], sizeof(newData[0]), 20);
+    fillPattern(newData[1], sizeof(newData[1]), 21);
+
+    for(int policy=AFS_GROWTH_SHIFT;policy<=AFS_GROWTH_REBUILD;policy++) {
+        for(u64 c=0;c<sizeof(cases)/sizeof(TestCase);c++) {
+            const TestCase* test = &cases[c];
+            int before = failures;
+            writeFile(path, base, baseSize);
+            Afs* afs = afs_open(path);
+            if(afs == NULL) {
+                check(false, "open the AFS");
+                continue;
+            }
+            afs_setGrowthPolicy(afs, (AfsGrowthPolicy)policy);
+            AfsEntrySource edits[2];
+            for(int i=0;i<test->amount;i++) {
+                edits[i] = afs_sourceFromBuffer(newData[i], test->sizes[i]);
+            }
+
+            AfsReplacePlan plan;
+            int planned = afs_planReplace(afs, test->entries, edits, test->amount, &plan);
+            u64 plannedSize;
+            u8* unchanged = readFile(path, &plannedSize);
+            check(unchanged != NULL && plannedSize == baseSize && memcmp(unchanged, base, baseSize) == 0, "planning doesn't change the file");
+            free(unchanged);
+
+            fflush(stdout);
+            s64 written = getBytesWritten();
+            int ret = afs_replaceEntries(afs, test->entries, edits, test->amount);
+            if(written >= 0) {
+                written = getBytesWritten() - written;
+            }
+            afs_free(afs);
+            check(planned == ret, "the plan returns what the replacement returns");
+
+            u64 newSize;
+            u8* replaced = readFile(path, &newSize);
+            check(ret != 0 || plan.newFileSize == newSize, "newFileSize is the size of the file afterwards");
+            free(replaced);
+            if(ret == 0 && written >= 0) {
+                // Only the page cache of the AFS is written, the kernel counts every write() and pwrite()
+                check((u64)written <= plan.bytesWritten + plan.bytesZeroed, "bytesWritten covers everything that was written");
+                check(policy == AFS_GROWTH_REBUILD || (u64)written >= plan.bytesWritten, "nothing counted in bytesWritten is skipped");
+            }
+
+            afs = afs_open(path);
+            for(int i=0;i<test->amount && afs != NULL;i++) {
+                u8* entry = afs_extractEntryToBuffer(afs, test->entries[i]);
+                check(entry != NULL && afs_getEntryinfo(afs, test->entries[i]).size == test->sizes[i]
+                    && memcmp(entry, newData[i], test->sizes[i]) == 0, "the new data is in place");
+                afs_freeBuffer(entry);
+            }
+            afs_free(afs);
+            if(plan.actions != NULL) {
+                afs_freeBuffer(plan.actions);
+            }
+            printf("%-8s %-16s: written %llu planned %llu, size %llu planned %llu: %s\n", policyNames[policy], test->name,
+                (unsigned long long)written, (unsigned long long)plan.bytesWritten,
+                (unsigned long long)newSize, (unsigned long long)plan.newFileSize, failures == before ? "ok" : "FAILED");
+        }
+    }
+
+    remove(basePath);
+    remove(path);
+    free(base);
+    for(int i=0;i<ENTRYCOUNT;i++) {
+        free(data[i]);
+    }
+    if(failures > 0) {
+        printf("%d check(s) failed.\n", failures);
+        return 1;
+    }
+    puts("All checks passed.");
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../afs.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/** Prints a help text explaining how to use this program
+ */
+void printHelp() {
+    puts("test_remove_nometa - Checks that removing entries from an AFS without a metadata section");
+    puts("leaves the header, the entry info and the data of the other entries intact.\n");
+    puts("arg1 = A path to a folder for the temporary files");
+}
+
+#define ENTRYCOUNT 5
+
+int failures = 0;
+
+/** Counts and prints a failed check.
+ */
+void check(bool ok, const char* what) {
+    if(!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/** Fills a buffer with a pattern that differs for every seed.
+ */
+void fillPattern(u8* dst, u64 size, u32 seed) {
+    for(u64 i=0;i<size;i++) {
+        dst[i] = (u8)(i * 7 + seed * 13);
+    }
+}
+
+/** Reads a whole file into memory, returns NULL if it doesn't exist.
+ */
+u8* readFile(const char* path, u64* size) {
+    FILE* fp = fopen(path, "rb");
+    if(fp == NULL) {
+        return NULL;
+    }
+    fseeko(fp, 0, SEEK_END);
+    *size = ftello(fp);
+    fseeko(fp, 0, SEEK_SET);
+    u8* data = (u8*)malloc(*size > 0 ? *size : 1);
+    if(fread(data, 1, *size, fp) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    return data;
+}
+
+/** Writes a buffer to a new file, returns 0 if successful.
+ */
+int writeFile(const char* path, const u8* data, u64 size) {
+    FILE* fp = fopen(path, "wb");
+    if(fp == NULL) {
+        return 1;
+    }
+    int ret = fwrite(data, 1, size, fp) != size;
+    fclose(fp);
+    return ret;
+}
+
+/** Checks whether an entry holds the expected data.
+ */
+bool entryEquals(Afs* afs, int id, const u8* expected, u64 size) {
+    if(afs_getEntryinfo(afs, id).size != size) {
+        return false;
+    }
+    u8* data = (u8*)malloc(size > 0 ? size : 1);
+    bool equal = afs_readEntry(afs, id, 0, size, data) == (s64)size && memcmp(data, expected, size) == 0;
+    free(data);
+    return equal;
+}
+
+/*
+ * This is a regression test for afs_removeEntries() on an AFS without a metadata section,
+ * which some games use: the entry info slot behind the last entry is zero.
+ * Removing entries must not write any metadata then, before it was written to offset 0
+ * over the header and the entry info.
+*/
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        puts("ERROR: main - No folder specified.");
+        printHelp();
+        return 1;
+    }
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s%ctest_remove_nometa.afs", argv[1], PATH_SEP);
+
+    const u64 sizes[ENTRYCOUNT] = { 3000, 4000, 5000, 6000, 7000 };
+    u8* data[ENTRYCOUNT];
+    AfsEntrySource sources[ENTRYCOUNT];
+    for(int i=0;i<ENTRYCOUNT;i++) {
+        data[i] = (u8*)malloc(sizes[i]);
+        fillPattern(data[i], sizes[i], i);
+        sources[i] = afs_sourceFromBuffer(data[i], sizes[i]);
+    }
+    if(afs_create(path, sources, NULL, ENTRYCOUNT, 0, false) != 0) {
+        puts("ERROR: main - The test AFS couldn't be created.");
+        return 1;
+    }
+
+    // The metadata section is cut off and its entry info slot cleared
+    u64 size;
+    u8* file = readFile(path, &size);
+    AfsEntryInfo* info = (AfsEntryInfo*)(file + 8);
+    u64 dataEnd = info[ENTRYCOUNT].offset;
+    memset(&info[ENTRYCOUNT], 0x00, sizeof(AfsEntryInfo));
+    writeFile(path, file, dataEnd);
+
+    Afs* afs = afs_open(path);
+    check(afs != NULL, "open the AFS without metadata");
+    if(afs != NULL) {
+        int removed[2] = { 1, 3 };
+        check(afs_removeEntries(afs, removed, 2) == 0, "remove entries 1 and 3");
+        check(afs_getEntrycount(afs) == ENTRYCOUNT - 2, "entry count after removing");
+        check(afs_removeEntry(afs, 0) == 0, "remove entry 0");
+        afs_free(afs);
+    }
+
+    u64 newSize;
+    u8* changed = readFile(path, &newSize);
+    AfsEntryInfo* newInfo = (AfsEntryInfo*)(changed + 8);
+    check(newSize == dataEnd, "the file size is unchanged");
+    check(memcmp(changed, "AFS", 4) == 0 && *(u32*)(changed + 4) == 2, "the header is intact");
+    check(newInfo[0].offset == info[2].offset && newInfo[0].size == info[2].size
+        && newInfo[1].offset == info[4].offset && newInfo[1].size == info[4].size, "the entry info of the kept entries");
+    check(newInfo[2].offset == 0 && newInfo[2].size == 0, "the metadata slot stays zero");
+    check(memcmp(changed + info[0].offset, file + info[0].offset, dataEnd - info[0].offset) == 0, "the data section is untouched");
+    free(changed);
+
+    afs = afs_open(path);
+    check(afs != NULL, "reopen the AFS");
+    if(afs != NULL) {
+        check(entryEquals(afs, 0, data[2], sizes[2]) && entryEquals(afs, 1, data[4], sizes[4]), "read the kept entries");
+        afs_free(afs);
+    }
+
+    remove(path);
+    free(file);
+    for(int i=0;i<ENTRYCOUNT;i++) {
+        free(data[i]);
+    }
+    if(failures > 0) {
+        printf("%d check(s) failed.\n", failures);
+        return 1;
+    }
+    puts("All checks passed.");
+    return 0;
+}